@@ -114,12 +114,28 @@ extern const uint32_t LLAMA_DEFAULT_CTXLEN;
 - (BOOL)loadMedia:(NSURL *)urlMedia
  useSecurityScope:(BOOL)useSecurityScope;
 
+- (NSArray *)loadMediaBatch:(NSArray *)arrMedia
+           useSecurityScope:(BOOL)useSecurityScope;
+
+- (BOOL)loadMediaFromData:(NSData *)data;
+
+- (BOOL)loadCGImage:(CGImageRef)imageRef;
+
 - (BOOL)isSupportedAudioURL:(NSURL *)urlFile;
 
 - (BOOL)isSupportedImageURL:(NSURL *)urlFile;
 
 - (BOOL)generate:(NSString *)prompt;
 
+- (BOOL)generateOnce:(NSString *)prompt;
+
+- (BOOL)regenerate;
+
+- (BOOL)editLastPrompt:(NSString *)prompt;
+
+- (NSArray *)generateResponses:(NSString *)prompt
+                         count:(int)count;
+
 - (BOOL)isBusy;
 
 - (BOOL)isInterrupted;
@@ -128,6 +144,21 @@ extern const uint32_t LLAMA_DEFAULT_CTXLEN;
 
 - (BOOL)clearHistory;
 
+- (BOOL)rollbackTurns:(int)count;
+
+- (BOOL)setTemperature:(float)temp;
+
+- (BOOL)setContextLength:(uint32_t)ctxLen;
+
+- (BOOL)setResponseCache:(int)maxEntries
+             directory:(NSURL *)urlDirectory;
+
+- (BOOL)setThermalGovernor:(BOOL)enabled
+               warmCelsius:(float)warmC
+                hotCelsius:(float)hotC;
+
+- (BOOL)reportTemperature:(float)tempC;
+
 + (NSArray *)validateModelAndProjectorURLs:(NSArray *)arrModels;
 
 + (NSString *)appleSiliconModel:(BOOL)bDetailed;
@@ -198,68 +198,28 @@
         return;
     }
         
-    // Add any supported dropped file(s)...
-    NSUInteger countAdded=0;
+    // Gather any supported dropped file(s)...
+    NSMutableArray *arrMedia=[NSMutableArray array];
     NSUInteger countMax=[LlamarattiWrapper maxSupportedMedia];
-    for ( NSURL *urlTmpDragged in arrDraggedURLs ) {
+    for ( NSURL *urlDragged in arrDraggedURLs ) {
         
-        NSURL *urlDragged = urlTmpDragged;
-        
-        // Is this a supported audio type?
-        if ( [llamaWrapper isSupportedAudioURL:urlDragged] ) {
-
-            if ( [vc loadAudioIntoContext:urlDragged
-                         useSecurityScope:YES] ) {
-                countAdded++;
-            }
-        }
-        
-        // Is this a supported image type?
-        else if ( [llamaWrapper isSupportedImageURL:urlDragged] ) {
-
-            BOOL useSecurityScope=YES;
-            
-            // Is this an HEIC image?
-            NSString *pathExt=[urlDragged pathExtension];
-            if ( [[pathExt lowercaseString] isEqualToString:@"heic"] ) {
-                
-                // Yes, can we convert the file?
-                urlDragged = [NSImage convertHEICtoTmpJPG:urlTmpDragged
-                                            withTmpPrefix:gMediaTemplate
-                                                withLoss:IMAGE_CONVERSION_LOSS];
-                if ( !urlDragged ) {
-                    continue;
-                }
-                
-                // URL points to temp folder within app sandbox
-                useSecurityScope=NO;
-                
-            // Is this a WEBP image?
-            } else if ( [[pathExt lowercaseString] isEqualToString:@"webp"] ) {
-                
-                // Yes, can we convert the file?
-                urlDragged = [NSImage convertWEBPtoTmpJPG:urlTmpDragged
-                                            withTmpPrefix:gMediaTemplate];
-                if ( !urlDragged ) {
-                    continue;
-                }
-                
-                // URL points to temp folder within app sandbox
-                useSecurityScope=NO;
-            }
-            
-            if ( [vc loadImageIntoContext:urlDragged
-                         useSecurityScope:useSecurityScope] ) {
-                countAdded++;
-            }
+        // Is this a supported audio or image type?
+        // heic/webp are decoded in memory by the wrapper, no conversion needed
+        if ( [llamaWrapper isSupportedAudioURL:urlDragged] ||
+             [llamaWrapper isSupportedImageURL:urlDragged] ) {
+            [arrMedia addObject:urlDragged];
         }
         
-        // Have we added enough?
-        if ( countAdded > countMax ) {
+        // Have we gathered enough?
+        if ( [arrMedia count] > countMax ) {
             break;
         }
     }
     
+    // ...and load them together so they are decoded in parallel
+    NSUInteger countAdded=[vc loadMediaIntoContext:arrMedia
+                                  useSecurityScope:YES];
+    
     // Did we add any media files?
     if ( countAdded == 0 ) {
         
@@ -79,6 +79,9 @@ NSArray *gArrClearContextPrompts;
 NSArray *gArrSuppAudioTypes;
 NSArray *gArrSuppVisionTypes;
 
+// Image types llama.cpp can't decode, these are decoded in memory via ImageIO
+NSArray *gArrImageIOTypes;
+
 // Used by C callback below to access Obj-C selector
 id      gTarget;
 SEL     gSelector;
@@ -600,6 +603,7 @@ bool llama_multimodal_callback(void *vmtmd, LlamarattiEvent type, const char *te
      */
     gArrSuppAudioTypes=[NSArray arrayWithObjects:@"wav", @"mp3", @"flac",nil];
     gArrSuppVisionTypes=[NSArray arrayWithObjects:@"heic", @"jpg", @"jpeg", @"png", @"bmp", @"gif", @"webp", nil];
+    gArrImageIOTypes=[NSArray arrayWithObjects:@"heic", @"webp", nil];
     
     /**
      * @brief Mac Silicon Device Model Info
@@ -1070,6 +1074,126 @@ bool llama_multimodal_callback(void *vmtmd, LlamarattiEvent type, const char *te
     return (res==GGML_STATUS_SUCCESS);
 }
 
+/**
+ * @brief Generates text for a prompt on its own, outside the conversation
+ *
+ * The conversation is left as it was & the media loaded since the last
+ * prompt go with this request. Repeated deterministic requests over the
+ * same media are answered from the response cache, see
+ * setResponseCache:directory:
+ *
+ * @param prompt the user prompt
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)generateOnce:(NSString *)prompt {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         !isValidNSString(prompt) ) {
+        return NO;
+    }
+
+    // Can we evaluate & get a response?
+    int res = _mtmd->evaluate_and_respond_once(safeCharFromNSS(prompt));
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Generates a new response to the last prompt
+ *
+ * The conversation is branched before the last response, so the prompt
+ * & its media aren't evaluated again, & the old branch is dropped
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)regenerate {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         _mtmd->get_turn_count() < 1 ) {
+        return NO;
+    }
+    
+    // Can we branch before the last response, drop the old branch & respond again?
+    int parentID = _mtmd->get_session_id();
+    int sessionID;
+    int res = _mtmd->fork_session(&sessionID, _mtmd->get_turn_count() - 1, true);
+    if ( res==GGML_STATUS_SUCCESS ) {
+        res = _mtmd->delete_session(parentID);
+    }
+    if ( res==GGML_STATUS_SUCCESS ) {
+        res = _mtmd->respond();
+    }
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Replaces the last prompt & generates a response to it
+ *
+ * The last turn is rolled back, so only the new prompt is evaluated
+ *
+ * @param prompt the new user prompt
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)editLastPrompt:(NSString *)prompt {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         !isValidNSString(prompt) ||
+         _mtmd->get_turn_count() < 1 ) {
+        return NO;
+    }
+    
+    // Can we remove the last turn & evaluate the new prompt?
+    int res = _mtmd->rollback_turns(1);
+    if ( res==GGML_STATUS_SUCCESS ) {
+        res = _mtmd->evaluate_and_respond(safeCharFromNSS(prompt));
+    }
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Generates several alternative responses to the same prompt
+ *
+ * The prompt is evaluated once & the responses are decoded together.
+ * They are returned rather than streamed, the first continues the chat.
+ *
+ * @param prompt the user prompt
+ * @param count the number of responses
+ *
+ * @return an NSString per response, nil on error
+ *
+ */
+- (NSArray *)generateResponses:(NSString *)prompt
+                         count:(int)count {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         !isValidNSString(prompt) ||
+         count < 1 ) {
+        return nil;
+    }
+    
+    // Can we evaluate & get the responses?
+    std::vector<std::string> responses;
+    int res = _mtmd->evaluate_and_respond_n(safeCharFromNSS(prompt), count, responses);
+    if ( res!=GGML_STATUS_SUCCESS ) {
+        return nil;
+    }
+    
+    NSMutableArray *arrResponses=[NSMutableArray arrayWithCapacity:responses.size()];
+    for ( const std::string &response : responses ) {
+        NSString *strResponse=[NSString stringWithUTF8String:response.c_str()];
+        [arrResponses addObject:strResponse ? strResponse : @""];
+    }
+    return arrResponses;
+}
+
 /**
  * @brief Returns whether we are busy generating
  *
@@ -1143,16 +1267,227 @@ bool llama_multimodal_callback(void *vmtmd, LlamarattiEvent type, const char *te
     }
     
     // Can we load the specified media?
-    int res = _mtmd->load_media(safeCharFromNSS([urlMedia path]));
+    BOOL bSuccess=NO;
+    NSString *pathExt=[[urlMedia pathExtension] lowercaseString];
+    if ( [gArrImageIOTypes containsObject:pathExt] ) {
+        bSuccess = [self loadImageInMemory:urlMedia];
+    } else {
+        int res = _mtmd->load_media(safeCharFromNSS([urlMedia path]));
+        bSuccess = (res==GGML_STATUS_SUCCESS);
+    }
     
     if ( useSecurityScope ) {
         // Stop accessing
         [Utils stopAccessingSecurityScopedURLs:@[urlMedia]];
     }
     
+    return bSuccess;
+}
+
+/**
+ * @brief Loads several media files into the model context at once
+ *
+ * Files the engine can decode are decoded in parallel, any that need
+ * ImageIO are loaded in between, so the media stay in the order given
+ *
+ * @param arrMedia the URLs of the media to load
+ * @param useSecurityScope whether the URLs are security-scoped
+ *
+ * @return an NSNumber BOOL per URL, nil on error
+ *
+ */
+- (NSArray *)loadMediaBatch:(NSArray *)arrMedia
+           useSecurityScope:(BOOL)useSecurityScope {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         !isValidNSArray(arrMedia) ) {
+        return nil;
+    }
+    
+    if ( useSecurityScope ) {
+        // Can we start accessing these security-scoped files?
+        BOOL bSuccess = [Utils startAccessingSecurityScopedURLs:arrMedia];
+        if ( !bSuccess ) {
+            return nil;
+        }
+    }
+    
+    NSMutableArray *arrResults=[NSMutableArray arrayWithCapacity:[arrMedia count]];
+    NSUInteger ind=0;
+    while ( ind < [arrMedia count] ) {
+        
+        NSURL *urlMedia=arrMedia[ind];
+        if ( [gArrImageIOTypes containsObject:[[urlMedia pathExtension] lowercaseString]] ) {
+            [arrResults addObject:@([self loadImageInMemory:urlMedia])];
+            ind++;
+            continue;
+        }
+        
+        // Gather the run of files the engine can decode itself
+        std::vector<char *> paths;
+        while ( ind < [arrMedia count] ) {
+            urlMedia=arrMedia[ind];
+            if ( [gArrImageIOTypes containsObject:[[urlMedia pathExtension] lowercaseString]] ) {
+                break;
+            }
+            paths.push_back(isValidFileNSURL(urlMedia) ? safeCharFromNSS([urlMedia path]) : NULL);
+            ind++;
+        }
+        
+        std::vector<int> results(paths.size(), GGML_STATUS_FAILED);
+        _mtmd->load_media_batch(paths.data(), (int)paths.size(), results.data());
+        for ( int res : results ) {
+            [arrResults addObject:@(res==GGML_STATUS_SUCCESS)];
+        }
+    }
+    
+    if ( useSecurityScope ) {
+        // Stop accessing
+        [Utils stopAccessingSecurityScopedURLs:arrMedia];
+    }
+    
+    return arrResults;
+}
+
+/**
+ * @brief Loads encoded media that is already in memory into the model context
+ *
+ * @param data the contents of a supported image or audio file
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)loadMediaFromData:(NSData *)data {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         !isValidNSData(data) ) {
+        return NO;
+    }
+    
+    // Can we load the media straight from the data's bytes?
+    int res = _mtmd->load_media_from_buffer((const unsigned char *)[data bytes],
+                                            (size_t)[data length]);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Loads an image into the model context
+ *
+ * Renders the image into a packed RGB buffer that is handed straight
+ * to the encoder
+ *
+ * @param imageRef the image to load
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)loadCGImage:(CGImageRef)imageRef {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ||
+         !imageRef ) {
+        return NO;
+    }
+    
+    size_t width = CGImageGetWidth(imageRef);
+    size_t height = CGImageGetHeight(imageRef);
+    size_t rowBytes = width * 4;
+    
+    unsigned char *pixels = (unsigned char *)malloc(rowBytes * height);
+    if ( !pixels ) {
+        return NO;
+    }
+    
+    // Can we draw the image as 8 bit sRGB?
+    CGColorSpaceRef colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+    CGContextRef ctx = CGBitmapContextCreate(pixels,
+                                             width,
+                                             height,
+                                             8,
+                                             rowBytes,
+                                             colorSpace,
+                                             kCGImageAlphaNoneSkipLast | kCGBitmapByteOrder32Big);
+    CGColorSpaceRelease(colorSpace);
+    if ( !ctx ) {
+        free(pixels);
+        return NO;
+    }
+    CGContextDrawImage(ctx, CGRectMake(0, 0, width, height), imageRef);
+    CGContextRelease(ctx);
+    
+    // Pack RGBX down to RGB in place
+    for ( size_t ind=0; ind<width*height; ind++ ) {
+        pixels[ind*3]   = pixels[ind*4];
+        pixels[ind*3+1] = pixels[ind*4+1];
+        pixels[ind*3+2] = pixels[ind*4+2];
+    }
+    
+    int res = _mtmd->load_media_from_rgb(pixels,
+                                         (unsigned int)width,
+                                         (unsigned int)height);
+    free(pixels);
+    
     return (res==GGML_STATUS_SUCCESS);
 }
 
+/**
+ * @brief Decodes an image with ImageIO & loads it into the model context
+ *
+ * Used for formats llama.cpp can't decode itself (heic/webp), replacing
+ * the conversion to a temporary JPG file
+ *
+ * @param urlImage the url of the image file
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)loadImageInMemory:(NSURL *)urlImage {
+    
+    // Can we create an image source?
+    CGImageSourceRef sourceRef = CGImageSourceCreateWithURL((__bridge CFURLRef)urlImage, NULL);
+    if ( !sourceRef ) {
+        NSLog(gErrLrtConvertImageFail,
+              __func__,
+              [urlImage path]);
+        return NO;
+    }
+    
+    NSDictionary *imageProps = (__bridge_transfer NSDictionary *)
+        CGImageSourceCopyPropertiesAtIndex(sourceRef, 0, NULL);
+    NSNumber *numWidth = imageProps[(NSString *)kCGImagePropertyPixelWidth];
+    NSNumber *numHeight = imageProps[(NSString *)kCGImagePropertyPixelHeight];
+    if ( !isValidNSNumber(numWidth) || !isValidNSNumber(numHeight) ) {
+        CFRelease(sourceRef);
+        NSLog(gErrLrtConvertImageFail,
+              __func__,
+              [urlImage path]);
+        return NO;
+    }
+    
+    // Decode at full size, applying the EXIF orientation as we go
+    NSUInteger maxSize = MAX([numWidth unsignedIntegerValue], [numHeight unsignedIntegerValue]);
+    NSDictionary *options = @{ (NSString *)kCGImageSourceCreateThumbnailFromImageAlways : @YES,
+                               (NSString *)kCGImageSourceCreateThumbnailWithTransform : @YES,
+                               (NSString *)kCGImageSourceThumbnailMaxPixelSize : @(maxSize) };
+    CGImageRef imageRef = CGImageSourceCreateThumbnailAtIndex(sourceRef,
+                                                              0,
+                                                              (__bridge CFDictionaryRef)options);
+    CFRelease(sourceRef);
+    if ( !imageRef ) {
+        NSLog(gErrLrtConvertImageFail,
+              __func__,
+              [urlImage path]);
+        return NO;
+    }
+    
+    BOOL bSuccess = [self loadCGImage:imageRef];
+    CGImageRelease(imageRef);
+    
+    return bSuccess;
+}
+
 #pragma mark - Multimedia File Support
 
 /**
@@ -1327,6 +1662,147 @@ bool llama_multimodal_callback(void *vmtmd, LlamarattiEvent type, const char *te
     return (res==GGML_STATUS_SUCCESS);
 }
 
+/**
+ * @brief Removes the last turns of the chat history
+ *
+ * The earlier turns & their media stay evaluated
+ *
+ * @param count - the number of turns to remove
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)rollbackTurns:(int)count {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd || count < 1 ) {
+        return NO;
+    }
+    
+    // Can we remove the turns?
+    int res = _mtmd->rollback_turns(count);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Changes the sampling temperature without reloading the model
+ *
+ * @param temp - the new temperature
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)setTemperature:(float)temp {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd || !isValidLLMTemp(temp) ) {
+        return NO;
+    }
+    
+    // Can we rebuild the sampler with the new temperature?
+    lr_sampling sampling;
+    if ( _mtmd->get_sampling(&sampling) != GGML_STATUS_SUCCESS ) {
+        return NO;
+    }
+    sampling.temp = temp;
+    int res = _mtmd->set_sampling(sampling);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Changes the context length without reloading the model
+ *
+ * The chat history is kept if it fits in the new length
+ *
+ * @param ctxLen - the new context length in tokens
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)setContextLength:(uint32_t)ctxLen {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd || !isValidLLMCtxLen(ctxLen) ) {
+        return NO;
+    }
+    
+    // Can we recreate the context with the new length?
+    int res = _mtmd->set_context_size((int)ctxLen);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Replays the responses of repeated deterministic requests
+ *
+ * Only requests made with generateOnce: that use a temperature of 0 or
+ * a fixed seed are cached
+ *
+ * @param maxEntries - the most responses kept in memory, 0 to disable the cache
+ * @param urlDirectory - (optional) a directory that also keeps responses
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)setResponseCache:(int)maxEntries
+               directory:(NSURL *)urlDirectory {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd || maxEntries < 0 ) {
+        return NO;
+    }
+    
+    // Can we set up the cache?
+    char *dirPath = urlDirectory ? safeCharFromNSS([urlDirectory path]) : NULL;
+    int res = _mtmd->set_response_cache(maxEntries, 0, dirPath);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Throttles generation while the system runs hot
+ *
+ * Reads the Linux thermal zones where there are any, otherwise goes by
+ * the temperatures passed to reportTemperature:
+ *
+ * @param enabled - whether to throttle
+ * @param warmC - the temperature in Celsius where throttling starts, 0 for the default
+ * @param hotC - the temperature in Celsius where throttling is at its most, 0 for the default
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)setThermalGovernor:(BOOL)enabled
+               warmCelsius:(float)warmC
+                hotCelsius:(float)hotC {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ) {
+        return NO;
+    }
+    
+    // Can we start or stop throttling?
+    int res = _mtmd->set_thermal_governor(enabled, NULL, warmC, hotC);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
+/**
+ * @brief Passes a system temperature to the thermal governor
+ *
+ * @param tempC - the temperature in Celsius
+ *
+ * @return the status of the operation
+ *
+ */
+- (BOOL)reportTemperature:(float)tempC {
+    
+    // Did we get the parameters we need?
+    if ( !_mtmd ) {
+        return NO;
+    }
+    
+    int res = _mtmd->report_temperature(tempC);
+    return (res==GGML_STATUS_SUCCESS);
+}
+
 /**
  * @brief Determines the model and projection file URLS from a model array
  *
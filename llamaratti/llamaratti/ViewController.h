@@ -105,6 +105,9 @@
 - (BOOL)loadImageIntoContext:(NSURL *)urlImage
             useSecurityScope:(BOOL)useSecurityScope;
 
+- (NSUInteger)loadMediaIntoContext:(NSArray *)arrMedia
+                  useSecurityScope:(BOOL)useSecurityScope;
+
 - (void)startTimedRippleFor:(CGFloat)time;
 
 - (void)updateGaugesWithTemp:(CGFloat)temp
@@ -1943,6 +1943,61 @@ NSString * const gPlaceholderPromptAsk=@"Right click or ask me anything, then pr
     return YES;
 }
 
+/**
+ * @brief Loads the specified media files into the current model context
+ *
+ * The files are decoded together, each one that loads is appended to
+ * the response window in order
+ *
+ * @param arrMedia the urls of the audio & image files
+ *
+ * @return the number of files loaded
+ */
+- (NSUInteger)loadMediaIntoContext:(NSArray *)arrMedia
+                  useSecurityScope:(BOOL)useSecurityScope {
+    
+    // Do we have an initialized wrapper?
+    if ( !self->_llamaWrapper ) {
+        return 0;
+    }
+    
+    // Did we get the parameters we need?
+    if ( !isValidNSArray(arrMedia) ) {
+        return 0;
+    }
+    
+    // Can we load the media into our context?
+    NSArray *arrResults=[_llamaWrapper loadMediaBatch:arrMedia
+                                     useSecurityScope:useSecurityScope];
+    if ( [arrResults count] != [arrMedia count] ) {
+        return 0;
+    }
+    
+    // Append each loaded file to the response window
+    NSUInteger countLoaded=0;
+    for ( NSUInteger ind=0; ind<[arrMedia count]; ind++ ) {
+        
+        if ( ![arrResults[ind] boolValue] ) {
+            continue;
+        }
+        countLoaded++;
+        
+        NSURL *urlMedia=arrMedia[ind];
+        if ( [_llamaWrapper isSupportedAudioURL:urlMedia] ) {
+            NSURL *urlAudioImage=[[NSBundle mainBundle] URLForImageResource:@"audio"];
+            [self appendUserImageToResponse:urlAudioImage
+                           useSecurityScope:NO
+                             withImageWidth:RESPONSE_IMAGE_AUDIO_SIZE];
+        } else {
+            [self appendUserImageToResponse:urlMedia
+                           useSecurityScope:useSecurityScope
+                             withImageWidth:RESPONSE_IMAGE_SIZE];
+        }
+    }
+    
+    return countLoaded;
+}
+
 /**
  * @brief Appends the specified text to the status field
  *
@@ -2390,7 +2445,12 @@ NSString * const gPlaceholderPromptAsk=@"Right click or ask me anything, then pr
     // No, is the user done selecting?
     if ( ![_sliderLLMTemp isTracking] ) {
         
-        // Yes, confirm changes
+        // Yes, can we apply it without reloading the model?
+        if ( [_llamaWrapper setTemperature:[_sliderLLMTemp value]] ) {
+            return;
+        }
+        
+        // No, confirm changes
         [self promptToReloadWithSettingsFromGaugeValues:YES
                                       andAdditionalArgs:YES];
     }
@@ -2435,7 +2495,12 @@ NSString * const gPlaceholderPromptAsk=@"Right click or ask me anything, then pr
     // No, is the user done selecting?
     if ( ![_sliderCtxLen isTracking] ) {
         
-        // Yes, confirm changes
+        // Yes, can we apply it without reloading the model?
+        if ( [_llamaWrapper setContextLength:(uint32_t)[_sliderCtxLen value]] ) {
+            return;
+        }
+        
+        // No, confirm changes
         [self promptToReloadWithSettingsFromGaugeValues:YES
                                       andAdditionalArgs:YES];
     }
@@ -3434,6 +3499,12 @@ NSString * const gPlaceholderPromptAsk=@"Right click or ask me anything, then pr
             }
             break;
         }
+            
+        case LlamarattiEventProgress:
+        {
+            // The images keep rippling while the prompt is evaluated
+            break;
+        }
     }
 }
 
@@ -0,0 +1,619 @@
+/**
+ *
+ * @file lr-mtmd-cli-audio.cpp
+ *
+ * @brief Streaming audio decoding
+ *
+ * Reads PCM audio in fixed-length windows, converting each window to
+ * mono float samples at the rate expected by the audio encoder, so long
+ * recordings never need to be held in memory all at once
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "lr-mtmd-cli-audio.h"
+#include "lr-mtmd-cli-trace.h"
+
+// Number of source frames read from disk per resampling step
+#define LR_AUDIO_READ_FRAMES    4096
+
+// WAVE format tags
+#define WAV_FORMAT_PCM          0x0001
+#define WAV_FORMAT_IEEE_FLOAT   0x0003
+#define WAV_FORMAT_EXTENSIBLE   0xFFFE
+
+static uint16_t rd_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t rd_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief Removes or compresses the non-speech parts of mono audio
+ *
+ * Uses the frame energy relative to an adaptive noise floor (the 10th
+ * percentile of all frame energies), padded on both sides of each speech
+ * run so that word onsets & tails are not clipped
+ *
+ * @param in the source samples
+ * @param n_in the number of source samples
+ * @param rate the sample rate
+ * @param params the detection settings
+ * @param out (returned) the trimmed samples
+ *
+ * @return the number of samples kept, 0 if no speech was found
+ */
+size_t lr_vad_trim(const float *in,
+                   size_t n_in,
+                   int rate,
+                   const lr_vad_params &params,
+                   std::vector<float> &out) {
+
+    out.clear();
+
+    // Did we get the parameters we need?
+    if ( !in || n_in == 0 || rate <= 0 || params.frame_ms <= 0.0f ) {
+        return 0;
+    }
+
+    const size_t frame = std::max<size_t>(1, (size_t)((float)rate * params.frame_ms / 1000.0f));
+    const size_t n_frames = (n_in + frame - 1) / frame;
+
+    // Too short to say anything useful, keep it all
+    if ( n_frames < 4 ) {
+        out.assign(in, in + n_in);
+        return n_in;
+    }
+
+    // Energy of each frame in dBFS
+    std::vector<float> energy(n_frames);
+    for ( size_t f=0; f<n_frames; f++ ) {
+        size_t s0 = f * frame;
+        size_t s1 = std::min(n_in, s0 + frame);
+        double sum = 0.0;
+        for ( size_t i=s0; i<s1; i++ ) {
+            sum += (double)in[i] * (double)in[i];
+        }
+        energy[f] = (float)(10.0 * log10(sum / (double)(s1 - s0) + 1e-10));
+    }
+
+    // Estimate the noise floor
+    std::vector<float> sorted(energy);
+    std::nth_element(sorted.begin(), sorted.begin() + (long)(n_frames / 10), sorted.end());
+    float noise = sorted[n_frames / 10];
+    float thresh = std::max(noise + params.threshold_db, params.floor_dbfs);
+
+    // Mark speech frames, then widen each run by the padding
+    std::vector<bool> speech(n_frames, false);
+    const long pad = (long)(params.pad_ms / params.frame_ms);
+    for ( size_t f=0; f<n_frames; f++ ) {
+        if ( energy[f] > thresh ) {
+            long f0 = std::max<long>(0, (long)f - pad);
+            long f1 = std::min<long>((long)n_frames - 1, (long)f + pad);
+            for ( long g=f0; g<=f1; g++ ) {
+                speech[(size_t)g] = true;
+            }
+        }
+    }
+
+    const size_t min_silence = (size_t)(params.min_silence_ms / params.frame_ms);
+    const size_t keep_half = (size_t)(params.keep_silence_ms / params.frame_ms / 2.0f);
+
+    bool anySpeech = false;
+    out.reserve(n_in);
+
+    // Copy speech runs & short pauses, shorten long silences
+    size_t f = 0;
+    while ( f < n_frames ) {
+
+        size_t run = f;
+        while ( run < n_frames && speech[run] == speech[f] ) {
+            run++;
+        }
+
+        size_t s0 = f * frame;
+        size_t s1 = std::min(n_in, run * frame);
+
+        if ( speech[f] ) {
+            anySpeech = true;
+            out.insert(out.end(), in + s0, in + s1);
+        } else if ( run - f < min_silence ) {
+            out.insert(out.end(), in + s0, in + s1);
+        } else {
+            // Leading & trailing silence is dropped entirely
+            size_t head = (f == 0) ? 0 : std::min(s1, s0 + keep_half * frame);
+            size_t tail = (run == n_frames) ? s1 : std::max(head, s1 - keep_half * frame);
+            if ( f != 0 ) {
+                out.insert(out.end(), in + s0, in + head);
+            }
+            if ( run != n_frames ) {
+                out.insert(out.end(), in + tail, in + s1);
+            }
+        }
+        f = run;
+    }
+
+    if ( !anySpeech ) {
+        out.clear();
+    }
+    return out.size();
+}
+
+/**
+ * @brief Constructor
+ *
+ */
+lr_resampler::lr_resampler() {
+
+    _step=1.0;
+    _pos=0.0;
+}
+
+/**
+ * @brief Resets the resampler for a new stream
+ *
+ * @param rate_in the source sample rate
+ * @param rate_out the target sample rate
+ *
+ */
+void lr_resampler::reset(int rate_in, int rate_out) {
+
+    _step = (rate_in > 0 && rate_out > 0) ? (double)rate_in / (double)rate_out : 1.0;
+    _pos = 0.0;
+    _pending.clear();
+}
+
+/**
+ * @brief Resamples a block of mono samples
+ *
+ * @param in the source samples
+ * @param n_in the number of source samples
+ * @param out (appended) the resampled samples
+ *
+ */
+void lr_resampler::process(const float *in, size_t n_in, std::vector<float> &out) {
+
+    _pending.insert(_pending.end(), in, in + n_in);
+
+    // Emit every output sample whose neighbours are both available
+    while ( _pos + 1.0 < (double)_pending.size() ) {
+        size_t i = (size_t)_pos;
+        float frac = (float)(_pos - (double)i);
+        out.push_back(_pending[i] + (_pending[i + 1] - _pending[i]) * frac);
+        _pos += _step;
+    }
+
+    // Drop the samples we have moved past
+    size_t consumed = std::min((size_t)_pos, _pending.size());
+    _pending.erase(_pending.begin(), _pending.begin() + consumed);
+    _pos -= (double)consumed;
+}
+
+/**
+ * @brief Emits any samples held back at the end of the stream
+ *
+ * @param out (appended) the resampled samples
+ *
+ */
+void lr_resampler::flush(std::vector<float> &out) {
+
+    while ( _pos < (double)_pending.size() ) {
+        out.push_back(_pending[(size_t)_pos]);
+        _pos += _step;
+    }
+    _pending.clear();
+    _pos = 0.0;
+}
+
+/**
+ * @brief Constructor
+ *
+ */
+lr_wav_reader::lr_wav_reader() {
+
+    _fp=NULL;
+    _format=0;
+    _channels=0;
+    _sample_rate=0;
+    _bits_per_sample=0;
+    _block_align=0;
+    _data_bytes=0;
+    _data_read=0;
+}
+
+/**
+ * @brief Destructor
+ *
+ */
+lr_wav_reader::~lr_wav_reader() {
+
+    close();
+}
+
+/**
+ * @brief Returns whether the specified file has a RIFF/WAVE header
+ *
+ * @param path the path to the file
+ *
+ * @return whether the file is a WAV file
+ */
+bool lr_wav_reader::is_wav_file(const std::string &path) {
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if ( !fp ) {
+        return false;
+    }
+
+    uint8_t hdr[12];
+    bool isWav = fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+                 memcmp(hdr, "RIFF", 4) == 0 &&
+                 memcmp(hdr + 8, "WAVE", 4) == 0;
+    fclose(fp);
+
+    return isWav;
+}
+
+/**
+ * @brief Opens a WAV file and positions it at the start of the sample data
+ *
+ * @param path the path to the WAV file
+ *
+ * @return the status of the operation
+ */
+bool lr_wav_reader::open(const std::string &path) {
+
+    close();
+
+    _fp = fopen(path.c_str(), "rb");
+    if ( !_fp ) {
+        return false;
+    }
+
+    uint8_t hdr[12];
+    if ( fread(hdr, 1, sizeof(hdr), _fp) != sizeof(hdr) ||
+         memcmp(hdr, "RIFF", 4) != 0 ||
+         memcmp(hdr + 8, "WAVE", 4) != 0 ) {
+        close();
+        return false;
+    }
+
+    // Walk the chunks until we find the sample data
+    bool haveFmt = false;
+    uint8_t chunk[8];
+    while ( fread(chunk, 1, sizeof(chunk), _fp) == sizeof(chunk) ) {
+
+        uint32_t chunkSize = rd_u32(chunk + 4);
+
+        if ( memcmp(chunk, "fmt ", 4) == 0 ) {
+
+            uint8_t fmt[40] = {0};
+            size_t n = std::min<size_t>(chunkSize, sizeof(fmt));
+            if ( n < 16 || fread(fmt, 1, n, _fp) != n ) {
+                close();
+                return false;
+            }
+
+            _format          = rd_u16(fmt);
+            _channels        = rd_u16(fmt + 2);
+            _sample_rate     = (int)rd_u32(fmt + 4);
+            _block_align     = rd_u16(fmt + 12);
+            _bits_per_sample = rd_u16(fmt + 14);
+
+            // The real format lives in the first 2 bytes of the SubFormat GUID
+            if ( _format == WAV_FORMAT_EXTENSIBLE && n >= 26 ) {
+                _format = rd_u16(fmt + 24);
+            }
+
+            // Skip the rest of the chunk, including the pad byte
+            long skip = (long)(chunkSize - n) + (chunkSize & 1);
+            if ( skip && fseek(_fp, skip, SEEK_CUR) != 0 ) {
+                close();
+                return false;
+            }
+            haveFmt = true;
+
+        } else if ( memcmp(chunk, "data", 4) == 0 ) {
+
+            if ( !haveFmt ) {
+                break;
+            }
+            _data_bytes = chunkSize;
+            _data_read = 0;
+
+            bool isPCM = _format == WAV_FORMAT_PCM &&
+                         (_bits_per_sample == 8 || _bits_per_sample == 16 ||
+                          _bits_per_sample == 24 || _bits_per_sample == 32);
+            bool isFloat = _format == WAV_FORMAT_IEEE_FLOAT &&
+                           (_bits_per_sample == 32 || _bits_per_sample == 64);
+
+            if ( (!isPCM && !isFloat) ||
+                 _channels <= 0 ||
+                 _sample_rate <= 0 ||
+                 _block_align != _channels * (_bits_per_sample / 8) ) {
+                break;
+            }
+            return true;
+
+        } else {
+
+            if ( fseek(_fp, (long)chunkSize + (chunkSize & 1), SEEK_CUR) != 0 ) {
+                break;
+            }
+        }
+    }
+
+    close();
+    return false;
+}
+
+/**
+ * @brief Closes the WAV file
+ *
+ */
+void lr_wav_reader::close() {
+
+    if ( _fp ) {
+        fclose(_fp);
+        _fp=NULL;
+    }
+    _data_bytes=0;
+    _data_read=0;
+}
+
+/**
+ * @brief Returns the number of frames in the sample data
+ *
+ * @return the number of frames
+ */
+uint64_t lr_wav_reader::n_frames() const {
+
+    return _block_align > 0 ? _data_bytes / (uint64_t)_block_align : 0;
+}
+
+/**
+ * @brief Reads frames and downmixes them to mono floats
+ *
+ * @param out (appended) the mono samples
+ * @param n_frames the maximum number of frames to read
+ *
+ * @return the number of frames read, 0 at the end of the data
+ */
+size_t lr_wav_reader::read_mono(std::vector<float> &out, size_t n_frames) {
+
+    if ( !_fp || _data_read >= _data_bytes ) {
+        return 0;
+    }
+
+    uint64_t remaining = (_data_bytes - _data_read) / (uint64_t)_block_align;
+    n_frames = (size_t)std::min<uint64_t>(n_frames, remaining);
+
+    _raw.resize(n_frames * (size_t)_block_align);
+    size_t got = fread(_raw.data(), (size_t)_block_align, n_frames, _fp);
+    _data_read += (uint64_t)got * (uint64_t)_block_align;
+
+    // Treat a truncated file as the end of the data
+    if ( got < n_frames ) {
+        _data_read = _data_bytes;
+    }
+
+    const int bytes = _bits_per_sample / 8;
+    const float scale = 1.0f / (float)_channels;
+
+    size_t base = out.size();
+    out.resize(base + got);
+
+    for ( size_t f=0; f<got; f++ ) {
+
+        const uint8_t *p = _raw.data() + f * (size_t)_block_align;
+        float sum = 0.0f;
+
+        for ( int c=0; c<_channels; c++, p+=bytes ) {
+
+            if ( _format == WAV_FORMAT_IEEE_FLOAT ) {
+                if ( bytes == 4 ) {
+                    float v; memcpy(&v, p, 4); sum += v;
+                } else {
+                    double v; memcpy(&v, p, 8); sum += (float)v;
+                }
+            } else {
+                switch ( bytes ) {
+                    case 1: sum += ((float)p[0] - 128.0f) / 128.0f; break;
+                    case 2: sum += (float)(int16_t)rd_u16(p) / 32768.0f; break;
+                    case 3: sum += (float)((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8) / 8388608.0f; break;
+                    default: sum += (float)((double)(int32_t)rd_u32(p) / 2147483648.0); break;
+                }
+            }
+        }
+        out[base + f] = sum * scale;
+    }
+
+    return got;
+}
+
+/**
+ * @brief Constructor
+ *
+ */
+lr_audio_stream::lr_audio_stream() {
+
+    _window_samples=0;
+    _n_windows=0;
+    _max_queued=LR_AUDIO_DEFAULT_MAX_QUEUED;
+    _target_rate=0;
+    _started=false;
+    _finished=false;
+    _cancelled=false;
+}
+
+/**
+ * @brief Destructor
+ *
+ */
+lr_audio_stream::~lr_audio_stream() {
+
+    cancel();
+}
+
+/**
+ * @brief Opens an audio file and starts decoding it in the background
+ *
+ * @param path the path to the audio file
+ * @param target_rate the sample rate expected by the audio encoder
+ * @param window_secs the length of each window in seconds, at least LR_AUDIO_MIN_WINDOW_SECS
+ * @param max_queued the maximum number of decoded windows held in memory
+ *
+ * @return the status of the operation
+ */
+bool lr_audio_stream::open(const std::string &path,
+                           int target_rate,
+                           float window_secs,
+                           size_t max_queued) {
+
+    // Did we get the parameters we need?
+    if ( _started ||
+         path.empty() ||
+         target_rate <= 0 ||
+         window_secs < LR_AUDIO_MIN_WINDOW_SECS ||
+         (size_t)(window_secs * (float)target_rate) == 0 ||
+         max_queued == 0 ) {
+        return false;
+    }
+
+    if ( !_reader.open(path) ) {
+        return false;
+    }
+    if ( _reader.sample_rate() <= 0 ) {
+        _reader.close();
+        return false;
+    }
+
+    _path = path;
+    _target_rate = target_rate;
+    _window_samples = (size_t)(window_secs * (float)target_rate);
+    _max_queued = max_queued;
+    _resampler.reset(_reader.sample_rate(), target_rate);
+
+    // Work out up front how many windows the file will produce
+    double secs = (double)_reader.n_frames() / (double)_reader.sample_rate();
+    size_t samples = (size_t)ceil(secs * (double)target_rate);
+    _n_windows = (samples + _window_samples - 1) / _window_samples;
+
+    _started = true;
+    _thread = std::thread(&lr_audio_stream::run, this);
+
+    return true;
+}
+
+/**
+ * @brief Producer thread, decodes and resamples one window at a time
+ *
+ */
+void lr_audio_stream::run() {
+
+    std::vector<float> mono;
+    std::vector<float> window;
+    window.reserve(_window_samples + LR_AUDIO_READ_FRAMES);
+
+    lr_trace_set_thread_name("audio stream");
+
+    bool eof = false;
+    while ( !eof ) {
+
+        // Fill the next window
+        {
+            LR_TRACE_SCOPE("read_window");
+            while ( window.size() < _window_samples ) {
+                mono.clear();
+                if ( _reader.read_mono(mono, LR_AUDIO_READ_FRAMES) == 0 ) {
+                    _resampler.flush(window);
+                    eof = true;
+                    break;
+                }
+                _resampler.process(mono.data(), mono.size(), window);
+            }
+        }
+
+        // Carry any overshoot over to the following window
+        std::vector<float> overflow;
+        if ( window.size() > _window_samples ) {
+            overflow.assign(window.begin() + (long)_window_samples, window.end());
+            window.resize(_window_samples);
+        }
+
+        {
+            // Wait for room in the queue
+            LR_TRACE_SCOPE("wait_queue");
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] { return _cancelled || _queue.size() < _max_queued; });
+            if ( _cancelled ) {
+                break;
+            }
+            if ( !window.empty() ) {
+                _queue.push_back(std::move(window));
+            }
+        }
+        _cv.notify_all();
+
+        window = std::move(overflow);
+        window.reserve(_window_samples + LR_AUDIO_READ_FRAMES);
+    }
+
+    _reader.close();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _finished = true;
+    }
+    _cv.notify_all();
+}
+
+/**
+ * @brief Returns the next decoded window, waiting for it if needed
+ *
+ * @param pcm (returned) the mono samples at the target rate
+ *
+ * @return false once all windows have been returned or the stream was cancelled
+ */
+bool lr_audio_stream::next_window(std::vector<float> &pcm) {
+
+    if ( !_started ) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return _cancelled || _finished || !_queue.empty(); });
+
+    if ( _cancelled || _queue.empty() ) {
+        return false;
+    }
+
+    pcm = std::move(_queue.front());
+    _queue.pop_front();
+    lock.unlock();
+    _cv.notify_all();
+
+    return true;
+}
+
+/**
+ * @brief Stops decoding and waits for the producer thread to exit
+ *
+ */
+void lr_audio_stream::cancel() {
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cancelled = true;
+        _queue.clear();
+    }
+    _cv.notify_all();
+
+    if ( _thread.joinable() ) {
+        _thread.join();
+    }
+}
@@ -0,0 +1,179 @@
+/**
+ *
+ * @file lr-mtmd-cli-audio.h
+ *
+ * @brief Streaming audio decoding
+ *
+ * Reads PCM audio in fixed-length windows, converting each window to
+ * mono float samples at the rate expected by the audio encoder, so long
+ * recordings never need to be held in memory all at once
+ *
+ */
+
+#ifndef LR_MTMD_CLI_AUDIO_H
+#define LR_MTMD_CLI_AUDIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Default length of a streamed audio window, matches the whisper encoder chunk
+#define LR_AUDIO_DEFAULT_WINDOW_SECS    30.0f
+
+// Shortest streamed audio window, one 10ms hop of the encoder's spectrogram
+#define LR_AUDIO_MIN_WINDOW_SECS        0.01f
+
+// Default number of decoded windows that may wait for the encoder
+#define LR_AUDIO_DEFAULT_MAX_QUEUED     2
+
+/**
+ * @struct lr_vad_params
+ *
+ * @brief Voice activity detection settings
+ *
+ * Frames louder than the estimated noise floor by threshold_db count as
+ * speech. Silences longer than min_silence_ms are compressed down to
+ * keep_silence_ms so word & sentence boundaries are preserved.
+ *
+ */
+struct lr_vad_params {
+    float frame_ms        = 30.0f;
+    float threshold_db    = 10.0f;
+    float floor_dbfs      = -55.0f;
+    float pad_ms          = 150.0f;
+    float min_silence_ms  = 500.0f;
+    float keep_silence_ms = 200.0f;
+};
+
+size_t lr_vad_trim(const float *in,
+                   size_t n_in,
+                   int rate,
+                   const lr_vad_params &params,
+                   std::vector<float> &out);
+
+/**
+ * @class lr_resampler
+ *
+ * @brief Streaming linear resampler
+ *
+ * Keeps the fractional read position and the unconsumed tail between
+ * calls so that consecutive blocks resample seamlessly
+ *
+ */
+class lr_resampler {
+
+    double _step;
+    double _pos;
+    std::vector<float> _pending;
+
+public:
+
+    lr_resampler();
+
+    void reset(int rate_in, int rate_out);
+
+    void process(const float *in, size_t n_in, std::vector<float> &out);
+
+    void flush(std::vector<float> &out);
+};
+
+/**
+ * @class lr_wav_reader
+ *
+ * @brief Incremental RIFF/WAVE reader
+ *
+ * Supports integer PCM (8/16/24/32 bit) and IEEE float (32/64 bit),
+ * including WAVE_FORMAT_EXTENSIBLE headers
+ *
+ */
+class lr_wav_reader {
+
+    FILE *_fp;
+
+    int _format;
+    int _channels;
+    int _sample_rate;
+    int _bits_per_sample;
+    int _block_align;
+
+    uint64_t _data_bytes;
+    uint64_t _data_read;
+
+    std::vector<uint8_t> _raw;
+
+public:
+
+    lr_wav_reader();
+
+    ~lr_wav_reader();
+
+    static bool is_wav_file(const std::string &path);
+
+    bool open(const std::string &path);
+
+    void close();
+
+    size_t read_mono(std::vector<float> &out, size_t n_frames);
+
+    int sample_rate() const { return _sample_rate; }
+
+    uint64_t n_frames() const;
+};
+
+/**
+ * @class lr_audio_stream
+ *
+ * @brief Decodes an audio file into windows on a background thread
+ *
+ * The producer thread stays at most max_queued windows ahead of the
+ * consumer, which bounds memory use regardless of recording length
+ *
+ */
+class lr_audio_stream {
+
+    lr_wav_reader _reader;
+    lr_resampler _resampler;
+
+    std::string _path;
+    size_t _window_samples;
+    size_t _n_windows;
+    size_t _max_queued;
+    int _target_rate;
+
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::vector<float>> _queue;
+
+    bool _started;
+    bool _finished;
+    bool _cancelled;
+
+    void run();
+
+public:
+
+    lr_audio_stream();
+
+    ~lr_audio_stream();
+
+    bool open(const std::string &path,
+              int target_rate,
+              float window_secs = LR_AUDIO_DEFAULT_WINDOW_SECS,
+              size_t max_queued = LR_AUDIO_DEFAULT_MAX_QUEUED);
+
+    bool next_window(std::vector<float> &pcm);
+
+    void cancel();
+
+    size_t n_windows() const { return _n_windows; }
+
+    const std::string &path() const { return _path; }
+};
+
+#endif  // LR_MTMD_CLI_AUDIO_H
@@ -0,0 +1,58 @@
+/**
+ *
+ * @file lr-mtmd-cli-bytes.h
+ *
+ * @brief Packs values into byte buffers & reads them back
+ *
+ * Used by the recording & response cache file formats. Numbers are kept
+ * in host byte order & strings as a 32 bit length followed by the bytes.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_BYTES_H
+#define LR_MTMD_CLI_BYTES_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Appends a value's bytes to a buffer
+template <typename T>
+static inline void lr_put(std::vector<uint8_t> &buf, const T &value) {
+
+    const uint8_t *p = (const uint8_t *)&value;
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+static inline void lr_put_string(std::vector<uint8_t> &buf, const std::string &s) {
+
+    lr_put(buf, (uint32_t)s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+}
+
+// Reads a value from a buffer, false if it runs past the end
+template <typename T>
+static inline bool lr_get(const std::vector<uint8_t> &buf, size_t &pos, T &value) {
+
+    if ( buf.size() - pos < sizeof(T) ) {
+        return false;
+    }
+    memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+static inline bool lr_get_string(const std::vector<uint8_t> &buf, size_t &pos, std::string &s) {
+
+    uint32_t len;
+    if ( !lr_get(buf, pos, len) ||
+         buf.size() - pos < len ) {
+        return false;
+    }
+    s.assign((const char *)buf.data() + pos, len);
+    pos += len;
+    return true;
+}
+
+#endif  // LR_MTMD_CLI_BYTES_H
@@ -0,0 +1,328 @@
+/**
+ *
+ * @file lr-mtmd-cli-c.cpp
+ *
+ * @brief C interface to lr_mtmd_cli for other language bindings
+ *
+ * Buffered spans are appended to one text buffer & handed out in
+ * batches. The buffer being drained is swapped with the one being filled
+ * once all of its spans have been handed out, so both keep their
+ * capacity & steady streaming allocates nothing.
+ *
+ */
+
+#include "ggml.h"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+#include "lr-mtmd-cli.h"
+#include "lr-mtmd-cli-c.h"
+
+static_assert(LR_MTMD_EVENT_STATUS == LlamarattiEventStatus &&
+              LR_MTMD_EVENT_RESPONSE == LlamarattiEventResponse &&
+              LR_MTMD_EVENT_PROGRESS == LlamarattiEventProgress,
+              "C event types must match LlamarattiEvent");
+
+/**
+ * @struct lr_mtmd
+ *
+ * @brief An engine & the spans it has produced but not yet handed out
+ *
+ */
+struct lr_mtmd : public lr_mtmd_cli {
+
+    // a span kept as an offset into its text buffer until it is handed out
+    struct entry {
+        int32_t event;
+        size_t offset;
+        size_t len;
+    };
+
+    lr_mtmd_span_fn span_fn = NULL;
+    void *user_data = NULL;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string pending_text;
+    std::vector<entry> pending;
+    std::string drained_text;
+    std::vector<entry> drained;
+    size_t n_drained = 0;
+
+    std::string prompt;
+
+    // passes a span to the callback or keeps it for lr_mtmd_drain()
+    bool emit(int32_t event, const char *ptr, size_t len) {
+        if ( span_fn ) {
+            lr_mtmd_span span = { event, ptr, len };
+            return span_fn(user_data, span);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back({ event, pending_text.size(), len });
+            if ( len ) {
+                pending_text.append(ptr, len);
+            }
+        }
+        cv.notify_one();
+        return is_interrupted();
+    }
+};
+
+/**
+ * @brief Routes the engine's events to its spans
+ *
+ * @param vmtmd the lr_mtmd_cli instance, always an lr_mtmd here
+ * @param event the event type
+ * @param text the text of the event
+ *
+ * @return whether to stop generating
+ */
+static bool lr_mtmd_callback(void *vmtmd, LlamarattiEvent event, const char *text) {
+
+    if ( !vmtmd ) {
+        return false;
+    }
+    lr_mtmd *engine = static_cast<lr_mtmd *>((lr_mtmd_cli *)vmtmd);
+    return engine->emit((int32_t)event, text, text ? strlen(text) : 0);
+}
+
+/**
+ * @brief Returns the version of this interface
+ *
+ * @return LR_MTMD_ABI_VERSION as built
+ */
+int32_t lr_mtmd_abi_version(void) {
+
+    return LR_MTMD_ABI_VERSION;
+}
+
+/**
+ * @brief Creates an engine
+ *
+ * @return the engine, NULL on error
+ */
+lr_mtmd *lr_mtmd_create(void) {
+
+    return new (std::nothrow) lr_mtmd();
+}
+
+/**
+ * @brief Unloads & frees an engine
+ *
+ * @param engine the engine
+ */
+void lr_mtmd_free(lr_mtmd *engine) {
+
+    delete engine;
+}
+
+/**
+ * @brief Loads the model & projector
+ *
+ * @param engine the engine
+ * @param argv the arguments for llama.cpp
+ * @param argc the count of arguments
+ * @param is_vision_supported (returned) whether vision is supported
+ * @param is_audio_supported (returned) whether audio is supported
+ *
+ * @return the status of the operation, 0 on success
+ */
+int32_t lr_mtmd_init(lr_mtmd *engine,
+                     const char *argv[],
+                     int32_t argc,
+                     bool *is_vision_supported,
+                     bool *is_audio_supported) {
+
+    if ( !engine ) {
+        return GGML_STATUS_FAILED;
+    }
+    return engine->init((char **)argv, argc, is_vision_supported, is_audio_supported, lr_mtmd_callback);
+}
+
+/**
+ * @brief Delivers spans to a callback as they are produced
+ *
+ * Set it before generating. Without one spans are buffered for
+ * lr_mtmd_drain().
+ *
+ * @param engine the engine
+ * @param fn the callback, NULL to buffer spans
+ * @param user_data passed to the callback
+ */
+void lr_mtmd_set_span_callback(lr_mtmd *engine, lr_mtmd_span_fn fn, void *user_data) {
+
+    if ( !engine ) {
+        return;
+    }
+    engine->span_fn = fn;
+    engine->user_data = user_data;
+}
+
+/**
+ * @brief Hands out buffered spans in order
+ *
+ * The spans point into the engine's buffers & stay valid until the next
+ * call. Call it from one thread at a time.
+ *
+ * @param engine the engine
+ * @param spans (returned) the spans
+ * @param max_spans the most spans to return
+ * @param timeout_ms how long to wait for a span, 0 not to wait, -1 to wait until one comes
+ *
+ * @return the number of spans returned
+ */
+size_t lr_mtmd_drain(lr_mtmd *engine, lr_mtmd_span *spans, size_t max_spans, int32_t timeout_ms) {
+
+    if ( !engine || !spans || !max_spans ) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(engine->mutex);
+
+    // Have all the drained spans been handed out? Then swap in the pending ones
+    if ( engine->n_drained == engine->drained.size() ) {
+        auto has_pending = [engine]() { return !engine->pending.empty(); };
+        if ( timeout_ms < 0 ) {
+            engine->cv.wait(lock, has_pending);
+        } else if ( timeout_ms > 0 ) {
+            engine->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), has_pending);
+        }
+        engine->drained_text.clear();
+        engine->drained.clear();
+        engine->n_drained = 0;
+        engine->drained_text.swap(engine->pending_text);
+        engine->drained.swap(engine->pending);
+    }
+
+    size_t n = std::min(max_spans, engine->drained.size() - engine->n_drained);
+    for ( size_t i=0; i<n; i++ ) {
+        const lr_mtmd::entry &e = engine->drained[engine->n_drained + i];
+        spans[i].event = e.event;
+        spans[i].ptr = engine->drained_text.data() + e.offset;
+        spans[i].len = e.len;
+    }
+    engine->n_drained += n;
+    return n;
+}
+
+/**
+ * @brief Loads a media file for the next prompt
+ *
+ * @param engine the engine
+ * @param media_path the path of the file
+ *
+ * @return the status of the operation, 0 on success
+ */
+int32_t lr_mtmd_load_media(lr_mtmd *engine, const char *media_path) {
+
+    if ( !engine ) {
+        return GGML_STATUS_FAILED;
+    }
+    return engine->load_media((char *)media_path);
+}
+
+/**
+ * @brief Loads an encoded image or audio file already in memory for the next prompt
+ *
+ * @param engine the engine
+ * @param buf the file contents
+ * @param len the number of bytes
+ *
+ * @return the status of the operation, 0 on success
+ */
+int32_t lr_mtmd_load_media_from_buffer(lr_mtmd *engine, const uint8_t *buf, size_t len) {
+
+    if ( !engine ) {
+        return GGML_STATUS_FAILED;
+    }
+    return engine->load_media_from_buffer(buf, len);
+}
+
+/**
+ * @brief Loads packed RGB pixels for the next prompt
+ *
+ * @param engine the engine
+ * @param rgb the pixels, 3 bytes each
+ * @param nx the width
+ * @param ny the height
+ *
+ * @return the status of the operation, 0 on success
+ */
+int32_t lr_mtmd_load_media_from_rgb(lr_mtmd *engine, const uint8_t *rgb, uint32_t nx, uint32_t ny) {
+
+    if ( !engine ) {
+        return GGML_STATUS_FAILED;
+    }
+    return engine->load_media_from_rgb(rgb, nx, ny);
+}
+
+/**
+ * @brief Evaluates & responds to a prompt
+ *
+ * Blocks until the response is complete, so call it from a background
+ * thread. The response arrives as spans, followed by an empty
+ * LR_MTMD_EVENT_DONE span.
+ *
+ * @param engine the engine
+ * @param prompt the prompt, which need not be null terminated
+ * @param len the number of bytes in the prompt
+ *
+ * @return the status of the operation, 0 on success
+ */
+int32_t lr_mtmd_evaluate(lr_mtmd *engine, const char *prompt, size_t len) {
+
+    if ( !engine || !prompt ) {
+        return GGML_STATUS_FAILED;
+    }
+    engine->prompt.assign(prompt, len);
+    int32_t res = engine->evaluate_and_respond(engine->prompt.data());
+    engine->emit(LR_MTMD_EVENT_DONE, NULL, 0);
+    return res;
+}
+
+/**
+ * @brief Stops the response being generated
+ *
+ * @param engine the engine
+ */
+void lr_mtmd_stop(lr_mtmd *engine) {
+
+    if ( engine ) {
+        engine->stop_generating();
+    }
+}
+
+/**
+ * @brief Returns whether a response is being generated
+ *
+ * @param engine the engine
+ *
+ * @return whether a response is being generated
+ */
+bool lr_mtmd_is_generating(lr_mtmd *engine) {
+
+    return engine && engine->is_generating();
+}
+
+/**
+ * @brief Clears the conversation
+ *
+ * @param engine the engine
+ *
+ * @return the status of the operation, 0 on success
+ */
+int32_t lr_mtmd_clear_history(lr_mtmd *engine) {
+
+    if ( !engine ) {
+        return GGML_STATUS_FAILED;
+    }
+    return engine->clear_history();
+}
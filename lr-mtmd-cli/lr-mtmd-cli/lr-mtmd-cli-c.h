@@ -0,0 +1,90 @@
+/**
+ *
+ * @file lr-mtmd-cli-c.h
+ *
+ * @brief C interface to lr_mtmd_cli for other language bindings
+ *
+ * An engine is an opaque handle. Generated text & other events are
+ * delivered as spans, a pointer & a length into the engine's own
+ * buffers, so nothing is allocated or boxed per token. They can be
+ * pushed to a callback as they are produced, or buffered & drained in
+ * batches from another thread.
+ *
+ * The engine shares the process-wide lr_mtmd_cli callback, so it must not
+ * be used alongside other users of lr_mtmd_cli in the same process.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_C_H
+#define LR_MTMD_CLI_C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped whenever a declaration below changes incompatibly
+#define LR_MTMD_ABI_VERSION     1
+
+// Event types, the first three are those of LlamarattiEvent
+#define LR_MTMD_EVENT_STATUS    0       // status text
+#define LR_MTMD_EVENT_RESPONSE  1       // piece of generated text
+#define LR_MTMD_EVENT_PROGRESS  2       // progress of a prompt evaluation
+#define LR_MTMD_EVENT_DONE      (-1)    // a request finished, the span is empty
+
+typedef struct lr_mtmd lr_mtmd;
+
+/**
+ * @struct lr_mtmd_span
+ *
+ * @brief An event & its text, which is not null terminated
+ *
+ */
+typedef struct {
+    int32_t event;
+    const char *ptr;
+    size_t len;
+} lr_mtmd_span;
+
+// Receives each span as it is produced, the text is only valid during the
+// call, return true to stop generating
+typedef bool (*lr_mtmd_span_fn)(void *user_data, lr_mtmd_span span);
+
+int32_t lr_mtmd_abi_version(void);
+
+lr_mtmd *lr_mtmd_create(void);
+
+void lr_mtmd_free(lr_mtmd *engine);
+
+int32_t lr_mtmd_init(lr_mtmd *engine,
+                     const char *argv[],
+                     int32_t argc,
+                     bool *is_vision_supported,
+                     bool *is_audio_supported);
+
+void lr_mtmd_set_span_callback(lr_mtmd *engine, lr_mtmd_span_fn fn, void *user_data);
+
+size_t lr_mtmd_drain(lr_mtmd *engine, lr_mtmd_span *spans, size_t max_spans, int32_t timeout_ms);
+
+int32_t lr_mtmd_load_media(lr_mtmd *engine, const char *media_path);
+
+int32_t lr_mtmd_load_media_from_buffer(lr_mtmd *engine, const uint8_t *buf, size_t len);
+
+int32_t lr_mtmd_load_media_from_rgb(lr_mtmd *engine, const uint8_t *rgb, uint32_t nx, uint32_t ny);
+
+int32_t lr_mtmd_evaluate(lr_mtmd *engine, const char *prompt, size_t len);
+
+void lr_mtmd_stop(lr_mtmd *engine);
+
+bool lr_mtmd_is_generating(lr_mtmd *engine);
+
+int32_t lr_mtmd_clear_history(lr_mtmd *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LR_MTMD_CLI_C_H
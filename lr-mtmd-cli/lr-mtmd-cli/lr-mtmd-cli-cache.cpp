@@ -0,0 +1,388 @@
+/**
+ *
+ * @file lr-mtmd-cli-cache.cpp
+ *
+ * @brief Exact response cache for deterministic requests
+ *
+ * Keeps the responses of earlier requests by a key that captures every
+ * input of the response, in memory & optionally in a directory
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <algorithm>
+
+#include "lr-mtmd-cli-cache.h"
+#include "lr-mtmd-cli-record.h"
+#include "lr-mtmd-cli-bytes.h"
+
+// What an entry costs in memory, roughly
+static size_t entry_bytes(const std::string &key, const lr_cached_response &response) {
+
+    size_t bytes = key.size() + response.tokens.size() * sizeof(int32_t);
+    for ( const std::string &piece : response.pieces ) {
+        bytes += piece.size() + sizeof(std::string);
+    }
+    return bytes;
+}
+
+/**
+ * @brief Constructor, the cache starts disabled
+ *
+ */
+lr_response_cache::lr_response_cache() {
+
+    _max_entries = 0;
+    _max_bytes = 0;
+    _bytes = 0;
+    _n_hits = 0;
+    _n_misses = 0;
+}
+
+/**
+ * @brief Sets the bounds of the cache & where it is kept on disk
+ *
+ * The bounds apply to the memory & the directory alike, entries over the
+ * new bounds are evicted from both
+ *
+ * @param max_entries the most responses kept, 0 disables the cache
+ * @param max_bytes the most bytes kept, 0 for no limit
+ * @param dir_path (optional) a directory that also keeps responses, created if needed
+ *
+ * @return the status of the operation, false if the directory can't be used
+ */
+bool lr_response_cache::configure(size_t max_entries, size_t max_bytes, const char *dir_path) {
+
+    std::string dir = dir_path ? dir_path : "";
+    while ( dir.size() > 1 && dir.back() == '/' ) {
+        dir.pop_back();
+    }
+
+    // Can we use the directory?
+    if ( !dir.empty() ) {
+        struct stat st;
+        if ( mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST ) {
+            return false;
+        }
+        if ( stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ) {
+            return false;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _max_entries = max_entries;
+        _max_bytes = max_bytes;
+        _dir_path = dir;
+        while ( !_entries.empty() &&
+                (_entries.size() > _max_entries || (_max_bytes && _bytes > _max_bytes)) ) {
+            _bytes -= _entries.back().bytes;
+            _index.erase(_entries.back().key);
+            _entries.pop_back();
+        }
+    }
+    if ( !dir.empty() ) {
+        prune_dir(dir, max_entries, max_bytes);
+    }
+    return true;
+}
+
+/**
+ * @brief Returns whether responses are kept anywhere
+ *
+ * @return whether the cache is enabled
+ */
+bool lr_response_cache::is_enabled() {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _max_entries > 0;
+}
+
+/**
+ * @brief Looks up a response, in memory & then on disk
+ *
+ * @param key the key
+ * @param response (returned) the response
+ *
+ * @return whether it was found
+ */
+bool lr_response_cache::find(const std::string &key, lr_cached_response &response) {
+
+    std::string dir_path;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if ( it != _index.end() ) {
+            _entries.splice(_entries.begin(), _entries, it->second);
+            response = it->second->response;
+            _n_hits++;
+            return true;
+        }
+        dir_path = _dir_path;
+    }
+
+    // Is it on disk? Then bring it back into memory
+    bool bFound = !dir_path.empty() && read_file(key, response);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if ( bFound ) {
+        insert(key, response);
+        _n_hits++;
+    } else {
+        _n_misses++;
+    }
+    return bFound;
+}
+
+/**
+ * @brief Keeps a response, on disk too if there is a directory
+ *
+ * @param key the key
+ * @param response the response
+ */
+void lr_response_cache::store(const std::string &key, const lr_cached_response &response) {
+
+    std::string dir_path;
+    size_t max_entries;
+    size_t max_bytes;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        insert(key, response);
+        dir_path = _dir_path;
+        max_entries = _max_entries;
+        max_bytes = _max_bytes;
+    }
+    if ( !dir_path.empty() && max_entries > 0 && write_file(key, response) ) {
+        prune_dir(dir_path, max_entries, max_bytes);
+    }
+}
+
+/**
+ * @brief Drops the responses kept in memory, those on disk are kept
+ *
+ */
+void lr_response_cache::clear() {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.clear();
+    _index.clear();
+    _bytes = 0;
+}
+
+/**
+ * @brief Returns how well the cache is doing
+ *
+ * @param n_hits (optional, returned) the lookups that found a response
+ * @param n_misses (optional, returned) the lookups that didn't
+ * @param n_entries (optional, returned) the responses in memory
+ * @param n_bytes (optional, returned) the bytes they take
+ */
+void lr_response_cache::get_stats(uint64_t *n_hits, uint64_t *n_misses, size_t *n_entries, size_t *n_bytes) {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if ( n_hits ) {
+        *n_hits = _n_hits;
+    }
+    if ( n_misses ) {
+        *n_misses = _n_misses;
+    }
+    if ( n_entries ) {
+        *n_entries = _entries.size();
+    }
+    if ( n_bytes ) {
+        *n_bytes = _bytes;
+    }
+}
+
+/**
+ * @brief Adds or refreshes an entry & evicts the least recently used ones
+ * over the bounds, the caller holds the lock
+ *
+ * @param key the key
+ * @param response the response
+ */
+void lr_response_cache::insert(const std::string &key, const lr_cached_response &response) {
+
+    size_t bytes = entry_bytes(key, response);
+    if ( !_max_entries || (_max_bytes && bytes > _max_bytes) ) {
+        return;
+    }
+
+    auto it = _index.find(key);
+    if ( it != _index.end() ) {
+        _bytes -= it->second->bytes;
+        _entries.erase(it->second);
+        _index.erase(it);
+    }
+
+    _entries.push_front({ key, response, bytes });
+    _index[key] = _entries.begin();
+    _bytes += bytes;
+
+    while ( _entries.size() > _max_entries || (_max_bytes && _bytes > _max_bytes) ) {
+        _bytes -= _entries.back().bytes;
+        _index.erase(_entries.back().key);
+        _entries.pop_back();
+    }
+}
+
+/**
+ * @brief Evicts the least recently used files over the bounds
+ *
+ * A file's modification time is when it was last written or read
+ *
+ * @param dir_path the directory
+ * @param max_entries the most files kept
+ * @param max_bytes the most bytes kept, 0 for no limit
+ */
+void lr_response_cache::prune_dir(const std::string &dir_path, size_t max_entries, size_t max_bytes) {
+
+    struct lr_cache_file {
+        std::string path;
+        size_t bytes;
+        time_t t_used;
+    };
+    std::vector<lr_cache_file> files;
+
+    DIR *dir = opendir(dir_path.c_str());
+    if ( !dir ) {
+        return;
+    }
+    struct dirent *ent;
+    while ( (ent = readdir(dir)) != NULL ) {
+
+        size_t len = strlen(ent->d_name);
+        if ( len < 4 || strcmp(ent->d_name + len - 4, ".lrc") != 0 ) {
+            continue;
+        }
+        std::string path = dir_path + "/" + ent->d_name;
+        struct stat st;
+        if ( stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) ) {
+            files.push_back({ path, (size_t)st.st_size, st.st_mtime });
+        }
+    }
+    closedir(dir);
+
+    // Most recently used first, keep them while they fit
+    std::sort(files.begin(), files.end(), [](const lr_cache_file &a, const lr_cache_file &b) {
+        return a.t_used > b.t_used;
+    });
+    size_t n_bytes = 0;
+    for ( size_t i=0; i<files.size(); i++ ) {
+        n_bytes += files[i].bytes;
+        if ( i >= max_entries || (max_bytes && n_bytes > max_bytes) ) {
+            remove(files[i].path.c_str());
+        }
+    }
+}
+
+/**
+ * @brief Returns the file that keeps a key's response
+ *
+ * @param key the key
+ *
+ * @return the path of the file
+ */
+std::string lr_response_cache::file_path(const std::string &key) const {
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".lrc", lr_record_hash(key.data(), key.size()));
+    return _dir_path + "/" + name;
+}
+
+/**
+ * @brief Reads a key's response from its file
+ *
+ * @param key the key
+ * @param response (returned) the response
+ *
+ * @return whether the file holds the key's response
+ */
+bool lr_response_cache::read_file(const std::string &key, lr_cached_response &response) const {
+
+    std::string path = file_path(key);
+    std::vector<uint8_t> buf;
+    if ( !lr_record_read_file(path.c_str(), buf) ||
+         buf.size() < LR_CACHE_MAGIC_SIZE ||
+         memcmp(buf.data(), LR_CACHE_MAGIC, LR_CACHE_MAGIC_SIZE) != 0 ) {
+        return false;
+    }
+
+    // Is it the same key & not just the same hash?
+    size_t pos = LR_CACHE_MAGIC_SIZE;
+    std::string file_key;
+    if ( !lr_get_string(buf, pos, file_key) || file_key != key ) {
+        return false;
+    }
+
+    uint32_t n_tokens;
+    if ( !lr_get(buf, pos, n_tokens) ||
+         (buf.size() - pos) / sizeof(int32_t) < n_tokens ) {
+        return false;
+    }
+    response.tokens.resize(n_tokens);
+    memcpy(response.tokens.data(), buf.data() + pos, n_tokens * sizeof(int32_t));
+    pos += n_tokens * sizeof(int32_t);
+
+    uint32_t n_pieces;
+    if ( !lr_get(buf, pos, n_pieces) ) {
+        return false;
+    }
+    response.pieces.clear();
+    for ( uint32_t i=0; i<n_pieces; i++ ) {
+        std::string piece;
+        if ( !lr_get_string(buf, pos, piece) ) {
+            return false;
+        }
+        response.pieces.push_back(std::move(piece));
+    }
+
+    // Mark it used, so it is evicted last
+    utime(path.c_str(), NULL);
+    return true;
+}
+
+/**
+ * @brief Writes a key's response to its file
+ *
+ * The file is replaced in one step, so a reader never sees half of it
+ *
+ * @param key the key
+ * @param response the response
+ *
+ * @return the status of the operation
+ */
+bool lr_response_cache::write_file(const std::string &key, const lr_cached_response &response) const {
+
+    std::vector<uint8_t> buf(LR_CACHE_MAGIC, LR_CACHE_MAGIC + LR_CACHE_MAGIC_SIZE);
+    lr_put_string(buf, key);
+    lr_put(buf, (uint32_t)response.tokens.size());
+    for ( int32_t token : response.tokens ) {
+        lr_put(buf, token);
+    }
+    lr_put(buf, (uint32_t)response.pieces.size());
+    for ( const std::string &piece : response.pieces ) {
+        lr_put_string(buf, piece);
+    }
+
+    std::string path = file_path(key);
+    std::string tmp_path = path + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "wb");
+    if ( !f ) {
+        return false;
+    }
+    bool bSuccess = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    bSuccess = (fclose(f) == 0) && bSuccess;
+
+    if ( !bSuccess || rename(tmp_path.c_str(), path.c_str()) != 0 ) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,101 @@
+/**
+ *
+ * @file lr-mtmd-cli-cache.h
+ *
+ * @brief Exact response cache for deterministic requests
+ *
+ * Keeps the responses of earlier requests by a key that captures every
+ * input of the response: the model, the sampler settings & seed, the
+ * media contents & the formatted prompt. Entries are kept in memory up to
+ * a count & a size, evicting the least recently used, & can also be
+ * written to a directory so they outlive the process. The directory has
+ * the same bounds, a file's modification time tells when it was last
+ * used. A response found in the directory is brought back into memory.
+ *
+ * Each file in the directory holds one entry: LR_CACHE_MAGIC, the key,
+ * the tokens & the text pieces of the response, as 32 bit lengths & host
+ * byte order numbers. The file is named after a hash of the key & the
+ * whole key is compared when it is read.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_CACHE_H
+#define LR_MTMD_CLI_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+#define LR_CACHE_MAGIC          "LRRSP001"
+#define LR_CACHE_MAGIC_SIZE     8
+
+/**
+ * @struct lr_cached_response
+ *
+ * @brief A response as it was generated & as it was passed to the callback
+ *
+ */
+struct lr_cached_response {
+    std::vector<int32_t> tokens;
+    std::vector<std::string> pieces;
+};
+
+/**
+ * @class lr_response_cache
+ *
+ * @brief Responses by key, safe to use from any thread
+ *
+ */
+class lr_response_cache {
+
+    struct lr_cache_entry {
+        std::string key;
+        lr_cached_response response;
+        size_t bytes;
+    };
+
+    // most recently used first
+    std::list<lr_cache_entry> _entries;
+    std::unordered_map<std::string, std::list<lr_cache_entry>::iterator> _index;
+
+    size_t _max_entries;
+    size_t _max_bytes;
+    size_t _bytes;
+    std::string _dir_path;
+
+    uint64_t _n_hits;
+    uint64_t _n_misses;
+
+    std::mutex _mutex;
+
+    void insert(const std::string &key, const lr_cached_response &response);
+
+    std::string file_path(const std::string &key) const;
+
+    bool read_file(const std::string &key, lr_cached_response &response) const;
+
+    bool write_file(const std::string &key, const lr_cached_response &response) const;
+
+    static void prune_dir(const std::string &dir_path, size_t max_entries, size_t max_bytes);
+
+public:
+
+    lr_response_cache();
+
+    bool configure(size_t max_entries, size_t max_bytes, const char *dir_path);
+
+    bool is_enabled();
+
+    bool find(const std::string &key, lr_cached_response &response);
+
+    void store(const std::string &key, const lr_cached_response &response);
+
+    void clear();
+
+    void get_stats(uint64_t *n_hits, uint64_t *n_misses, size_t *n_entries, size_t *n_bytes);
+};
+
+#endif  // LR_MTMD_CLI_CACHE_H
@@ -22,6 +22,9 @@ typedef enum {
     // Piece of generated text
     LlamarattiEventResponse=1,
     
+    // Progress of a prompt evaluation
+    LlamarattiEventProgress=2,
+    
     // Add more as needed...
     
 } LlamarattiEvent;
@@ -22,3 +22,29 @@ const char *gErrMtmdDecodeToken="{} | 􀇾 ERROR: Unable to decode token";
 const char *gErrMtmdLoadMedia="{} | 􀇾 ERROR: Unable to load media '{}'";
 const char *gErrMtmdGetCtx="{} | 􀇾 ERROR: Unable to get llama memory from context";
 const char *gErrMtmdRemoveTokSeq="{} | 􀇾 ERROR: Unable to remove token sequence";
+const char *gErrMtmdLoadAudioStream="{} | 􀇾 ERROR: Unable to stream audio '{}'";
+const char *gErrMtmdLoadFrames="{} | 􀇾 ERROR: Unable to load frames from '{}'";
+const char *gErrMtmdTraceDump="{} | 􀇾 ERROR: Unable to write trace to '{}'";
+const char *gErrMtmdEmbedContext="{} | 􀇾 ERROR: Unable to create embedding context";
+const char *gErrMtmdEmbed="{} | 􀇾 ERROR: Unable to embed '{}'";
+const char *gErrMtmdEmbedFile="{} | 􀇾 ERROR: Unable to map embeddings file '{}'";
+const char *gErrMtmdRestoreContext="{} | 􀇾 ERROR: Unable to restore the context released while idle";
+const char *gErrMtmdRecordOpen="{} | 􀇾 ERROR: Unable to start recording to '{}'";
+const char *gErrMtmdRecordMedia="{} | 􀇾 ERROR: Unable to record media '{}'";
+const char *gErrMtmdReplayOpen="{} | 􀇾 ERROR: Unable to read recording '{}'";
+const char *gErrMtmdReplayMedia="{} | 􀇾 ERROR: Unable to load recorded media {}";
+const char *gErrMtmdSampler="{} | 􀇾 ERROR: Unable to create sampler";
+const char *gErrMtmdResizeContext="{} | 􀇾 ERROR: Unable to resize the context to {} tokens";
+const char *gErrMtmdLoadAdapter="{} | 􀇾 ERROR: Unable to load LoRA adapter '{}'";
+const char *gErrMtmdSequences="{} | 􀇾 ERROR: Unable to create a context for {} sequences";
+const char *gErrMtmdForkSession="{} | 􀇾 ERROR: Unable to branch the conversation at turn {}";
+const char *gErrMtmdSession="{} | 􀇾 ERROR: There is no conversation with id {}";
+const char *gErrMtmdNoMessage="{} | 􀇾 ERROR: There is no message waiting for a response";
+const char *gErrMtmdRollback="{} | 􀇾 ERROR: Unable to roll back {} turns";
+const char *gErrMtmdResponseCache="{} | 􀇾 ERROR: Unable to use response cache directory '{}'";
+const char *gErrMtmdSessionsLost="{} | 􀇾 ERROR: Unable to restore {} conversations, they were dropped";
+const char *gErrMtmdContextFull="{} | 􀇾 ERROR: Not enough context left for {} responses";
+
+// Status strings
+const char *gMsgMtmdVadSavings="Voice activity detection removed {:.1f}s of {:.1f}s audio (~{} tokens)";
+const char *gMsgMtmdFrames="Frames: {} in, {} duplicates, {} subsampled, {} unreadable, {} loaded (~{} tokens)";
\ No newline at end of file
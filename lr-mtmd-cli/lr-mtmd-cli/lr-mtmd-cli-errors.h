@@ -23,6 +23,32 @@ extern const char *gErrMtmdDecodeToken;
 extern const char *gErrMtmdLoadMedia;
 extern const char *gErrMtmdGetCtx;
 extern const char *gErrMtmdRemoveTokSeq;
+extern const char *gErrMtmdLoadAudioStream;
+extern const char *gErrMtmdLoadFrames;
+extern const char *gErrMtmdTraceDump;
+extern const char *gErrMtmdEmbedContext;
+extern const char *gErrMtmdEmbed;
+extern const char *gErrMtmdEmbedFile;
+extern const char *gErrMtmdRestoreContext;
+extern const char *gErrMtmdRecordOpen;
+extern const char *gErrMtmdRecordMedia;
+extern const char *gErrMtmdReplayOpen;
+extern const char *gErrMtmdReplayMedia;
+extern const char *gErrMtmdSampler;
+extern const char *gErrMtmdResizeContext;
+extern const char *gErrMtmdLoadAdapter;
+extern const char *gErrMtmdSequences;
+extern const char *gErrMtmdForkSession;
+extern const char *gErrMtmdSession;
+extern const char *gErrMtmdNoMessage;
+extern const char *gErrMtmdRollback;
+extern const char *gErrMtmdResponseCache;
+extern const char *gErrMtmdSessionsLost;
+extern const char *gErrMtmdContextFull;
+
+// Status strings
+extern const char *gMsgMtmdVadSavings;
+extern const char *gMsgMtmdFrames;
 
 #endif // LR_MTMD_CLI_ERRORS_H
 
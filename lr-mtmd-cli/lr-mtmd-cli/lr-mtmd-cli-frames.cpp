@@ -0,0 +1,216 @@
+/**
+ *
+ * @file lr-mtmd-cli-frames.cpp
+ *
+ * @brief Image sequence helpers
+ *
+ * Perceptual hashing & selection of frames from image sequences such as
+ * extracted video frames or burst photos
+ *
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <string.h>
+#include <algorithm>
+
+#include "lr-mtmd-cli-frames.h"
+
+// Image types picked up when listing a directory of frames
+static const char *gFrameExts[] = { ".jpg", ".jpeg", ".png", ".bmp", ".gif", ".tga", ".ppm", ".pgm" };
+
+/**
+ * @brief Computes a 64 bit difference hash of an RGB image
+ *
+ * The image is reduced to a 9x8 grid of average luma values in a single
+ * pass, then each bit records whether a cell is brighter than its right
+ * neighbour. Small changes in scale, compression or exposure leave most
+ * bits unchanged.
+ *
+ * @param rgb the packed RGB pixels
+ * @param nx the image width
+ * @param ny the image height
+ *
+ * @return the hash, or 0 on error
+ */
+uint64_t lr_dhash_rgb(const unsigned char *rgb, uint32_t nx, uint32_t ny) {
+
+    // Did we get the parameters we need?
+    if ( !rgb || nx == 0 || ny == 0 ) {
+        return 0;
+    }
+
+    double sum[8][9] = {{0}};
+    uint32_t cnt[8][9] = {{0}};
+
+    for ( uint32_t y=0; y<ny; y++ ) {
+
+        uint32_t cy = (uint32_t)((uint64_t)y * 8 / ny);
+        const unsigned char *p = rgb + (size_t)y * nx * 3;
+
+        for ( uint32_t x=0; x<nx; x++, p+=3 ) {
+            uint32_t cx = (uint32_t)((uint64_t)x * 9 / nx);
+            sum[cy][cx] += 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+            cnt[cy][cx]++;
+        }
+    }
+
+    uint64_t hash = 0;
+    for ( int cy=0; cy<8; cy++ ) {
+        for ( int cx=0; cx<8; cx++ ) {
+            double l = cnt[cy][cx]     ? sum[cy][cx]     / cnt[cy][cx]     : 0.0;
+            double r = cnt[cy][cx + 1] ? sum[cy][cx + 1] / cnt[cy][cx + 1] : 0.0;
+            hash = (hash << 1) | (l > r ? 1 : 0);
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief Returns the number of differing bits between 2 hashes
+ *
+ * @return the Hamming distance
+ */
+int lr_hash_distance(uint64_t a, uint64_t b) {
+
+    return __builtin_popcountll(a ^ b);
+}
+
+/**
+ * @brief Orders file names so that embedded numbers compare by value
+ *
+ * frame_2.jpg sorts before frame_10.jpg
+ *
+ */
+static bool natural_less(const std::string &a, const std::string &b) {
+
+    size_t i = 0, j = 0;
+    while ( i < a.size() && j < b.size() ) {
+
+        if ( isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j]) ) {
+
+            size_t i0 = i, j0 = j;
+            while ( i < a.size() && isdigit((unsigned char)a[i]) ) i++;
+            while ( j < b.size() && isdigit((unsigned char)b[j]) ) j++;
+
+            // Compare the numbers without leading zeros, shorter is smaller
+            std::string na = a.substr(i0, i - i0);
+            std::string nb = b.substr(j0, j - j0);
+            na.erase(0, std::min(na.find_first_not_of('0'), na.size()));
+            nb.erase(0, std::min(nb.find_first_not_of('0'), nb.size()));
+            if ( na.size() != nb.size() ) {
+                return na.size() < nb.size();
+            }
+            if ( na != nb ) {
+                return na < nb;
+            }
+            continue;
+        }
+
+        if ( a[i] != b[j] ) {
+            return a[i] < b[j];
+        }
+        i++;
+        j++;
+    }
+    return a.size() - i < b.size() - j;
+}
+
+/**
+ * @brief Lists the image files in a directory in frame order
+ *
+ * @param dir_path the directory to list
+ * @param frame_paths (returned) the full paths of the frames
+ *
+ * @return the status of the operation
+ */
+bool lr_list_frames(const std::string &dir_path, std::vector<std::string> &frame_paths) {
+
+    frame_paths.clear();
+
+    DIR *dir = opendir(dir_path.c_str());
+    if ( !dir ) {
+        return false;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *ent;
+    while ( (ent = readdir(dir)) != NULL ) {
+
+        std::string name = ent->d_name;
+        if ( name.empty() || name[0] == '.' ) {
+            continue;
+        }
+
+        size_t dot = name.find_last_of('.');
+        if ( dot == std::string::npos ) {
+            continue;
+        }
+        std::string ext = name.substr(dot);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        for ( const char *supported : gFrameExts ) {
+            if ( ext == supported ) {
+                names.push_back(name);
+                break;
+            }
+        }
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end(), natural_less);
+
+    std::string sep = (!dir_path.empty() && dir_path.back() == '/') ? "" : "/";
+    for ( const std::string &name : names ) {
+        frame_paths.push_back(dir_path + sep + name);
+    }
+    return true;
+}
+
+/**
+ * @brief Picks evenly spaced frames that fit within a token budget
+ *
+ * The first & last frames are always candidates so that the selection
+ * spans the whole sequence
+ *
+ * @param frame_tokens the number of tokens each frame will use
+ * @param max_tokens the budget, 0 for no limit
+ *
+ * @return the indices of the selected frames, in order
+ */
+std::vector<size_t> lr_select_frames(const std::vector<size_t> &frame_tokens, size_t max_tokens) {
+
+    const size_t n = frame_tokens.size();
+    std::vector<size_t> picked;
+    if ( n == 0 ) {
+        return picked;
+    }
+
+    // No selection can hold more frames than the cheapest ones would allow
+    size_t k_max = n;
+    size_t min_tokens = *std::min_element(frame_tokens.begin(), frame_tokens.end());
+    if ( max_tokens > 0 && min_tokens > 0 ) {
+        k_max = std::min(n, max_tokens / min_tokens);
+    }
+
+    for ( size_t k=k_max; k>0; k-- ) {
+
+        picked.clear();
+        size_t total = 0;
+        for ( size_t i=0; i<k; i++ ) {
+            size_t idx = (k == 1) ? 0 : (i * (n - 1) + (k - 1) / 2) / (k - 1);
+            if ( !picked.empty() && picked.back() == idx ) {
+                continue;
+            }
+            picked.push_back(idx);
+            total += frame_tokens[idx];
+        }
+
+        if ( max_tokens == 0 || total <= max_tokens ) {
+            return picked;
+        }
+    }
+
+    picked.clear();
+    return picked;
+}
@@ -0,0 +1,30 @@
+/**
+ *
+ * @file lr-mtmd-cli-frames.h
+ *
+ * @brief Image sequence helpers
+ *
+ * Perceptual hashing & selection of frames from image sequences such as
+ * extracted video frames or burst photos
+ *
+ */
+
+#ifndef LR_MTMD_CLI_FRAMES_H
+#define LR_MTMD_CLI_FRAMES_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Frames whose hashes differ by this many bits or fewer are duplicates
+#define LR_FRAMES_DEFAULT_DUP_THRESHOLD     6
+
+uint64_t lr_dhash_rgb(const unsigned char *rgb, uint32_t nx, uint32_t ny);
+
+int lr_hash_distance(uint64_t a, uint64_t b);
+
+bool lr_list_frames(const std::string &dir_path, std::vector<std::string> &frame_paths);
+
+std::vector<size_t> lr_select_frames(const std::vector<size_t> &frame_tokens, size_t max_tokens);
+
+#endif  // LR_MTMD_CLI_FRAMES_H
@@ -0,0 +1,82 @@
+/**
+ *
+ * @file lr-mtmd-cli-image.cpp
+ *
+ * @brief Image resizing helpers
+ *
+ * Downscales decoded images before they reach the encoder, so that large
+ * photos can be fitted to an image token budget
+ *
+ */
+
+#include <algorithm>
+
+#include "lr-mtmd-cli-image.h"
+
+/**
+ * @brief Downscales a packed RGB image by area averaging
+ *
+ * Each destination pixel is the average of the source pixels it covers,
+ * which avoids the aliasing of point sampling at large reductions
+ *
+ * @param src the packed RGB pixels
+ * @param nx the source width
+ * @param ny the source height
+ * @param dst_nx the destination width, at most nx
+ * @param dst_ny the destination height, at most ny
+ * @param dst (returned) the packed RGB pixels of the downscaled image
+ *
+ * @return the status of the operation
+ */
+bool lr_downscale_rgb(const unsigned char *src,
+                      uint32_t nx,
+                      uint32_t ny,
+                      uint32_t dst_nx,
+                      uint32_t dst_ny,
+                      std::vector<unsigned char> &dst) {
+
+    // Did we get the parameters we need?
+    if ( !src ||
+         dst_nx == 0 || dst_ny == 0 ||
+         dst_nx > nx || dst_ny > ny ) {
+        return false;
+    }
+
+    dst.resize((size_t)dst_nx * dst_ny * 3);
+
+    // Source columns covered by each destination column
+    std::vector<uint32_t> x0(dst_nx), x1(dst_nx);
+    for ( uint32_t dx=0; dx<dst_nx; dx++ ) {
+        x0[dx] = (uint32_t)((uint64_t)dx * nx / dst_nx);
+        x1[dx] = (uint32_t)((uint64_t)(dx + 1) * nx / dst_nx);
+    }
+
+    std::vector<uint32_t> sum((size_t)dst_nx * 3);
+    for ( uint32_t dy=0; dy<dst_ny; dy++ ) {
+
+        uint32_t y0 = (uint32_t)((uint64_t)dy * ny / dst_ny);
+        uint32_t y1 = (uint32_t)((uint64_t)(dy + 1) * ny / dst_ny);
+
+        std::fill(sum.begin(), sum.end(), 0);
+        for ( uint32_t y=y0; y<y1; y++ ) {
+            const unsigned char *row = src + (size_t)y * nx * 3;
+            for ( uint32_t dx=0; dx<dst_nx; dx++ ) {
+                uint32_t *s = &sum[(size_t)dx * 3];
+                for ( uint32_t x=x0[dx]; x<x1[dx]; x++ ) {
+                    s[0] += row[x * 3];
+                    s[1] += row[x * 3 + 1];
+                    s[2] += row[x * 3 + 2];
+                }
+            }
+        }
+
+        unsigned char *out = &dst[(size_t)dy * dst_nx * 3];
+        for ( uint32_t dx=0; dx<dst_nx; dx++ ) {
+            uint32_t n = (x1[dx] - x0[dx]) * (y1 - y0);
+            for ( int c=0; c<3; c++ ) {
+                out[dx * 3 + c] = (unsigned char)((sum[(size_t)dx * 3 + c] + n / 2) / n);
+            }
+        }
+    }
+    return true;
+}
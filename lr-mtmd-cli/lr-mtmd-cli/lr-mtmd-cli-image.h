@@ -0,0 +1,31 @@
+/**
+ *
+ * @file lr-mtmd-cli-image.h
+ *
+ * @brief Image resizing helpers
+ *
+ * Downscales decoded images before they reach the encoder, so that large
+ * photos can be fitted to an image token budget
+ *
+ */
+
+#ifndef LR_MTMD_CLI_IMAGE_H
+#define LR_MTMD_CLI_IMAGE_H
+
+#include <stdint.h>
+#include <vector>
+
+// Smallest side an image is downscaled to
+#define LR_IMAGE_MIN_SIDE       32
+
+// Most downscaling attempts made to fit an image to its token budget
+#define LR_IMAGE_FIT_ATTEMPTS   6
+
+bool lr_downscale_rgb(const unsigned char *src,
+                      uint32_t nx,
+                      uint32_t ny,
+                      uint32_t dst_nx,
+                      uint32_t dst_ny,
+                      std::vector<unsigned char> &dst);
+
+#endif  // LR_MTMD_CLI_IMAGE_H
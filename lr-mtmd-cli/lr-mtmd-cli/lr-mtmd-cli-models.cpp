@@ -0,0 +1,442 @@
+/**
+ *
+ * @file lr-mtmd-cli-models.cpp
+ *
+ * @brief Indexes the GGUF models in a cache directory
+ *
+ * The index file starts with a line holding LR_MODELS_INDEX_MAGIC, then
+ * has a line per GGUF file with its fields separated by tabs. Projector
+ * pairings aren't stored, they are worked out again after each scan.
+ *
+ */
+
+#include "ggml.h"
+#include "gguf.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "lr-mtmd-cli-models.h"
+
+// How deep scan() follows subdirectories
+#define LR_MODELS_MAX_DEPTH     8
+
+// Reads a string value, empty if there isn't one
+static std::string get_str(const gguf_context *gctx, const std::string &key) {
+
+    int64_t id = gguf_find_key(gctx, key.c_str());
+    if ( id < 0 || gguf_get_kv_type(gctx, id) != GGUF_TYPE_STRING ) {
+        return "";
+    }
+    return gguf_get_val_str(gctx, id);
+}
+
+// Reads an integer value of any width, 0 if there isn't one
+static uint64_t get_uint(const gguf_context *gctx, const std::string &key) {
+
+    int64_t id = gguf_find_key(gctx, key.c_str());
+    if ( id < 0 ) {
+        return 0;
+    }
+    switch ( gguf_get_kv_type(gctx, id) ) {
+        case GGUF_TYPE_UINT32:  return gguf_get_val_u32(gctx, id);
+        case GGUF_TYPE_INT32:   return (uint64_t)std::max(0, gguf_get_val_i32(gctx, id));
+        case GGUF_TYPE_UINT64:  return gguf_get_val_u64(gctx, id);
+        case GGUF_TYPE_INT64:   return (uint64_t)std::max((int64_t)0, gguf_get_val_i64(gctx, id));
+        default:                return 0;
+    }
+}
+
+static bool get_bool(const gguf_context *gctx, const std::string &key) {
+
+    int64_t id = gguf_find_key(gctx, key.c_str());
+    return id >= 0 && gguf_get_kv_type(gctx, id) == GGUF_TYPE_BOOL && gguf_get_val_bool(gctx, id);
+}
+
+// Tabs & line breaks would split the index's fields
+static std::string sanitize(const std::string &s) {
+
+    std::string out = s;
+    std::replace(out.begin(), out.end(), '\t', ' ');
+    std::replace(out.begin(), out.end(), '\n', ' ');
+    std::replace(out.begin(), out.end(), '\r', ' ');
+    return out;
+}
+
+static std::string lowercase(std::string s) {
+
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+static std::string dir_name(const std::string &path) {
+
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? "" : path.substr(0, slash);
+}
+
+static std::string base_name(const std::string &path) {
+
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/**
+ * @brief Reads what a GGUF file's header says about it
+ *
+ * Only the metadata & tensor descriptions are read, not the weights
+ *
+ * @param path the path of the file
+ * @param info (returned) the description, path, size & mtime are left as they are
+ *
+ * @return the status of the operation
+ */
+bool lr_read_model_info(const char *path, lr_model_info &info) {
+
+    gguf_init_params gparams = { /* no_alloc */ true, /* ctx */ nullptr };
+    gguf_context *gctx = gguf_init_from_file(path, gparams);
+    if ( !gctx ) {
+        return false;
+    }
+
+    info.name = get_str(gctx, "general.name");
+    info.architecture = get_str(gctx, "general.architecture");
+    info.is_projector = info.architecture == "clip" ||
+                        gguf_find_key(gctx, "clip.has_vision_encoder") >= 0 ||
+                        gguf_find_key(gctx, "clip.has_audio_encoder") >= 0;
+
+    if ( info.is_projector ) {
+        info.has_vision = get_bool(gctx, "clip.has_vision_encoder");
+        info.has_audio = get_bool(gctx, "clip.has_audio_encoder");
+        info.projector_type = get_str(gctx, "clip.projector_type");
+        if ( info.projector_type.empty() ) {
+            info.projector_type = get_str(gctx, info.has_vision ? "clip.vision.projector_type" : "clip.audio.projector_type");
+        }
+        info.n_embd = (uint32_t)get_uint(gctx, "clip.vision.projection_dim");
+        if ( !info.n_embd ) {
+            info.n_embd = (uint32_t)get_uint(gctx, "clip.audio.projection_dim");
+        }
+    } else {
+        info.n_ctx_train = (uint32_t)get_uint(gctx, info.architecture + ".context_length");
+        info.n_embd = (uint32_t)get_uint(gctx, info.architecture + ".embedding_length");
+    }
+
+    // Count the parameters & find the type that holds most of them
+    std::map<int, uint64_t> type_bytes;
+    info.n_params = 0;
+    for ( int64_t i=0; i<gguf_get_n_tensors(gctx); i++ ) {
+        ggml_type type = gguf_get_tensor_type(gctx, i);
+        size_t bytes = gguf_get_tensor_size(gctx, i);
+        size_t type_size = ggml_type_size(type);
+        if ( type_size ) {
+            info.n_params += bytes / type_size * (uint64_t)ggml_blck_size(type);
+        }
+        type_bytes[type] += bytes;
+    }
+    auto most = std::max_element(type_bytes.begin(), type_bytes.end(),
+                                 [](const std::pair<const int, uint64_t> &a, const std::pair<const int, uint64_t> &b) {
+        return a.second < b.second;
+    });
+    info.quantization = most == type_bytes.end() ? "" : ggml_type_name((ggml_type)most->first);
+
+    gguf_free(gctx);
+    return true;
+}
+
+/**
+ * @brief Opens an index file, a missing one starts an empty index
+ *
+ * @param index_path the path of the index, also where save() writes
+ *
+ * @return the status of the operation, false if the file is damaged
+ */
+bool lr_model_index::load(const char *index_path) {
+
+    _index_path = index_path ? index_path : "";
+    _files.clear();
+
+    std::ifstream in(_index_path);
+    if ( !in ) {
+        return true;
+    }
+
+    std::string line;
+    if ( !std::getline(in, line) || line != LR_MODELS_INDEX_MAGIC ) {
+        return false;
+    }
+
+    while ( std::getline(in, line) ) {
+
+        std::vector<std::string> fields;
+        std::stringstream ss(line);
+        std::string field;
+        while ( std::getline(ss, field, '\t') ) {
+            fields.push_back(field);
+        }
+        if ( fields.size() < 13 ) {
+            _files.clear();
+            return false;
+        }
+
+        lr_model_info info;
+        info.path           = fields[0];
+        info.size           = strtoull(fields[1].c_str(), NULL, 10);
+        info.mtime          = strtoll(fields[2].c_str(), NULL, 10);
+        info.is_projector   = fields[3] == "1";
+        info.name           = fields[4];
+        info.architecture   = fields[5];
+        info.quantization   = fields[6];
+        info.n_params       = strtoull(fields[7].c_str(), NULL, 10);
+        info.n_ctx_train    = (uint32_t)strtoul(fields[8].c_str(), NULL, 10);
+        info.n_embd         = (uint32_t)strtoul(fields[9].c_str(), NULL, 10);
+        info.projector_type = fields[10];
+        info.has_vision     = fields[11] == "1";
+        info.has_audio      = fields[12] == "1";
+        _files[info.path] = info;
+    }
+    pair_projectors();
+    return true;
+}
+
+/**
+ * @brief Writes the index to the file it was loaded from
+ *
+ * The file is replaced in one step, so a reader never sees half of it
+ *
+ * @return the status of the operation
+ */
+bool lr_model_index::save() {
+
+    if ( _index_path.empty() ) {
+        return false;
+    }
+
+    std::string tmp_path = _index_path + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if ( !f ) {
+        return false;
+    }
+
+    bool bSuccess = fprintf(f, "%s\n", LR_MODELS_INDEX_MAGIC) > 0;
+    for ( const auto &it : _files ) {
+
+        const lr_model_info &info = it.second;
+        if ( info.path != sanitize(info.path) ) {
+            continue;
+        }
+        bSuccess = bSuccess &&
+                   fprintf(f, "%s\t%llu\t%lld\t%d\t%s\t%s\t%s\t%llu\t%u\t%u\t%s\t%d\t%d\n",
+                           info.path.c_str(),
+                           (unsigned long long)info.size,
+                           (long long)info.mtime,
+                           info.is_projector ? 1 : 0,
+                           sanitize(info.name).c_str(),
+                           sanitize(info.architecture).c_str(),
+                           sanitize(info.quantization).c_str(),
+                           (unsigned long long)info.n_params,
+                           info.n_ctx_train,
+                           info.n_embd,
+                           sanitize(info.projector_type).c_str(),
+                           info.has_vision ? 1 : 0,
+                           info.has_audio ? 1 : 0) > 0;
+    }
+    bSuccess = (fclose(f) == 0) && bSuccess;
+
+    if ( !bSuccess || rename(tmp_path.c_str(), _index_path.c_str()) != 0 ) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Brings the index up to date with the GGUF files in a directory
+ *
+ * Files whose size & modification time are unchanged keep their entries,
+ * new & changed files have their headers read & entries for files that
+ * are gone are dropped. Symbolic links are followed, as used by the
+ * Hugging Face cache. The index is saved if it was loaded from a file.
+ *
+ * @param dir_path the directory
+ * @param recursive whether to look in subdirectories
+ *
+ * @return the number of headers read, -1 if the directory can't be read
+ */
+int lr_model_index::scan(const char *dir_path, bool recursive/* = true*/) {
+
+    if ( !dir_path ) {
+        return -1;
+    }
+
+    std::string root = dir_path;
+    while ( root.size() > 1 && root.back() == '/' ) {
+        root.pop_back();
+    }
+
+    int n_read = 0;
+    std::map<std::string, lr_model_info> files;
+    std::vector<std::pair<std::string, int>> dirs = { { root, 0 } };
+    bool bOpened = false;
+
+    while ( !dirs.empty() ) {
+
+        std::pair<std::string, int> dir_depth = dirs.back();
+        dirs.pop_back();
+
+        DIR *dir = opendir(dir_depth.first.c_str());
+        if ( !dir ) {
+            continue;
+        }
+        bOpened = true;
+
+        struct dirent *ent;
+        while ( (ent = readdir(dir)) != NULL ) {
+
+            std::string name = ent->d_name;
+            if ( name.empty() || name[0] == '.' ) {
+                continue;
+            }
+            std::string path = dir_depth.first + "/" + name;
+
+            struct stat st;
+            if ( stat(path.c_str(), &st) != 0 ) {
+                continue;
+            }
+            if ( S_ISDIR(st.st_mode) ) {
+                if ( recursive && dir_depth.second < LR_MODELS_MAX_DEPTH ) {
+                    dirs.push_back({ path, dir_depth.second + 1 });
+                }
+                continue;
+            }
+            if ( !S_ISREG(st.st_mode) ||
+                 name.size() < 5 ||
+                 lowercase(name.substr(name.size() - 5)) != ".gguf" ) {
+                continue;
+            }
+
+            // Is the entry we have still current?
+            auto it = _files.find(path);
+            if ( it != _files.end() &&
+                 it->second.size == (uint64_t)st.st_size &&
+                 it->second.mtime == (int64_t)st.st_mtime ) {
+                files[path] = it->second;
+                continue;
+            }
+
+            lr_model_info info;
+            info.path = path;
+            info.size = (uint64_t)st.st_size;
+            info.mtime = (int64_t)st.st_mtime;
+            if ( lr_read_model_info(path.c_str(), info) ) {
+                files[path] = info;
+                n_read++;
+            }
+        }
+        closedir(dir);
+    }
+
+    if ( !bOpened ) {
+        return -1;
+    }
+
+    // Keep the entries of other directories & of subdirectories we didn't
+    // look in, replace those of the directories scanned
+    std::string prefix = root + "/";
+    int max_depth = recursive ? LR_MODELS_MAX_DEPTH : 0;
+    for ( auto it = _files.begin(); it != _files.end(); ) {
+        if ( it->first.compare(0, prefix.size(), prefix) == 0 &&
+             std::count(it->first.begin() + prefix.size(), it->first.end(), '/') <= max_depth ) {
+            it = _files.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    _files.insert(files.begin(), files.end());
+
+    pair_projectors();
+    if ( !_index_path.empty() ) {
+        save();
+    }
+    return n_read;
+}
+
+/**
+ * @brief Pairs each model with the projector that suits it best
+ *
+ * A projector suits a model when it projects to the model's embedding
+ * size. Of those, one in the same directory is preferred, then the one
+ * whose file name shares the longest start with the model's.
+ *
+ */
+void lr_model_index::pair_projectors() {
+
+    for ( auto &it : _files ) {
+
+        lr_model_info &model = it.second;
+        model.projector_path.clear();
+        if ( model.is_projector || !model.n_embd ) {
+            continue;
+        }
+
+        std::string model_dir = dir_name(model.path);
+        std::string model_base = lowercase(base_name(model.path));
+        size_t best_score = 0;
+        for ( const auto &proj_it : _files ) {
+
+            const lr_model_info &proj = proj_it.second;
+            if ( !proj.is_projector || proj.n_embd != model.n_embd ) {
+                continue;
+            }
+
+            std::string proj_base = lowercase(base_name(proj.path));
+            size_t n_common = 0;
+            while ( n_common < model_base.size() &&
+                    n_common < proj_base.size() &&
+                    model_base[n_common] == proj_base[n_common] ) {
+                n_common++;
+            }
+            size_t score = 1 + n_common + (dir_name(proj.path) == model_dir ? 1 << 16 : 0);
+            if ( score > best_score ) {
+                best_score = score;
+                model.projector_path = proj.path;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Returns the models, in path order
+ *
+ * @return the models, each with its paired projector if any
+ */
+std::vector<lr_model_info> lr_model_index::models() const {
+
+    std::vector<lr_model_info> models;
+    for ( const auto &it : _files ) {
+        if ( !it.second.is_projector ) {
+            models.push_back(it.second);
+        }
+    }
+    return models;
+}
+
+/**
+ * @brief Returns the multimodal projectors, in path order
+ *
+ * @return the projectors
+ */
+std::vector<lr_model_info> lr_model_index::projectors() const {
+
+    std::vector<lr_model_info> projectors;
+    for ( const auto &it : _files ) {
+        if ( it.second.is_projector ) {
+            projectors.push_back(it.second);
+        }
+    }
+    return projectors;
+}
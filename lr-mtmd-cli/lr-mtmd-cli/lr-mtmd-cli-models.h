@@ -0,0 +1,82 @@
+/**
+ *
+ * @file lr-mtmd-cli-models.h
+ *
+ * @brief Indexes the GGUF models in a cache directory
+ *
+ * Reads only the metadata & tensor descriptions at the start of each GGUF
+ * file, never the weights, to describe models & multimodal projectors &
+ * to pair them by their metadata rather than by file names. The index is
+ * kept in a file & a file is only read again when its size or
+ * modification time changes, so listing a directory that was indexed
+ * before costs a stat per file.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_MODELS_H
+#define LR_MTMD_CLI_MODELS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#define LR_MODELS_INDEX_MAGIC   "LRIDX001"
+
+/**
+ * @struct lr_model_info
+ *
+ * @brief What the header of a GGUF file says about it
+ *
+ */
+struct lr_model_info {
+    std::string path;
+    uint64_t size  = 0;
+    int64_t  mtime = 0;
+
+    bool is_projector = false;
+    std::string name;               // general.name
+    std::string architecture;       // general.architecture, clip for projectors
+    std::string quantization;       // the tensor type holding most of the weights
+    uint64_t n_params    = 0;
+    uint32_t n_ctx_train = 0;       // models only
+    uint32_t n_embd      = 0;       // models, or the size projectors project to
+
+    // projectors only
+    std::string projector_type;
+    bool has_vision = false;
+    bool has_audio  = false;
+
+    // models only, the projector paired with it, if any
+    std::string projector_path;
+};
+
+/**
+ * @class lr_model_index
+ *
+ * @brief The models & projectors found in a directory
+ *
+ */
+class lr_model_index {
+
+    std::string _index_path;
+    std::map<std::string, lr_model_info> _files;
+
+    void pair_projectors();
+
+public:
+
+    bool load(const char *index_path);
+
+    bool save();
+
+    int scan(const char *dir_path, bool recursive = true);
+
+    std::vector<lr_model_info> models() const;
+
+    std::vector<lr_model_info> projectors() const;
+};
+
+bool lr_read_model_info(const char *path, lr_model_info &info);
+
+#endif  // LR_MTMD_CLI_MODELS_H
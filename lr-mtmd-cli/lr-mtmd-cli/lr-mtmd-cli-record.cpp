@@ -0,0 +1,572 @@
+/**
+ *
+ * @file lr-mtmd-cli-record.cpp
+ *
+ * @brief Session recording for replay
+ *
+ * Writes everything needed to re-run a session to a compact binary file:
+ * the init arguments & sampling seed, each media item's content hash &
+ * bytes, the prompts with how each was answered, the generated tokens,
+ * the timings of each stage & the sampler & adapter changes in between.
+ * Media is stored once per content hash, so repeated images cost a few
+ * bytes each.
+ *
+ */
+
+#include <string.h>
+
+#include "lr-mtmd-cli-record.h"
+#include "lr-mtmd-cli-bytes.h"
+
+/**
+ * @brief Hashes bytes with 64 bit FNV-1a
+ *
+ * @param data the bytes
+ * @param len the number of bytes
+ *
+ * @return the hash
+ */
+uint64_t lr_record_hash(const void *data, size_t len) {
+
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for ( size_t i=0; i<len; i++ ) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Appends sampler settings to a payload, field by field
+ *
+ */
+static void put_sampling(std::vector<uint8_t> &payload, const lr_sampling &sampling) {
+
+    lr_put(payload, sampling.temp);
+    lr_put(payload, (int32_t)sampling.top_k);
+    lr_put(payload, sampling.top_p);
+    lr_put(payload, sampling.min_p);
+    lr_put(payload, sampling.penalty_repeat);
+    lr_put(payload, sampling.penalty_freq);
+    lr_put(payload, sampling.penalty_present);
+    lr_put(payload, (int32_t)sampling.penalty_last_n);
+    lr_put(payload, sampling.seed);
+    lr_put(payload, (int32_t)sampling.n_predict);
+}
+
+/**
+ * @brief Reads sampler settings written by put_sampling()
+ *
+ */
+static bool get_sampling(const std::vector<uint8_t> &payload, size_t &pos, lr_sampling &sampling) {
+
+    int32_t top_k, penalty_last_n, n_predict;
+    if ( !lr_get(payload, pos, sampling.temp) ||
+         !lr_get(payload, pos, top_k) ||
+         !lr_get(payload, pos, sampling.top_p) ||
+         !lr_get(payload, pos, sampling.min_p) ||
+         !lr_get(payload, pos, sampling.penalty_repeat) ||
+         !lr_get(payload, pos, sampling.penalty_freq) ||
+         !lr_get(payload, pos, sampling.penalty_present) ||
+         !lr_get(payload, pos, penalty_last_n) ||
+         !lr_get(payload, pos, sampling.seed) ||
+         !lr_get(payload, pos, n_predict) ) {
+        return false;
+    }
+    sampling.top_k = top_k;
+    sampling.penalty_last_n = penalty_last_n;
+    sampling.n_predict = n_predict;
+    return true;
+}
+
+/**
+ * @brief Reads a whole file
+ *
+ * @param path the path of the file
+ * @param bytes (returned) the contents
+ *
+ * @return the status of the operation
+ */
+bool lr_record_read_file(const char *path, std::vector<uint8_t> &bytes) {
+
+    FILE *f = fopen(path, "rb");
+    if ( !f ) {
+        return false;
+    }
+    bool bSuccess = fseek(f, 0, SEEK_END) == 0;
+    long len = bSuccess ? ftell(f) : -1;
+    bSuccess = len >= 0 && fseek(f, 0, SEEK_SET) == 0;
+    if ( bSuccess ) {
+        bytes.resize((size_t)len);
+        bSuccess = fread(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    }
+    fclose(f);
+    return bSuccess;
+}
+
+/**
+ * @brief Constructor
+ *
+ */
+lr_recorder::lr_recorder() {
+
+    _file = NULL;
+    _n_prompts = 0;
+}
+
+/**
+ * @brief Destructor
+ *
+ */
+lr_recorder::~lr_recorder() {
+
+    close();
+}
+
+/**
+ * @brief Starts a new session file, replacing any existing one
+ *
+ * @param path the path of the file
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::open(const char *path) {
+
+    close();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _file = fopen(path, "wb");
+    if ( !_file ) {
+        return false;
+    }
+    if ( fwrite(LR_RECORD_MAGIC, 1, LR_RECORD_MAGIC_SIZE, _file) != LR_RECORD_MAGIC_SIZE ) {
+        fclose(_file);
+        _file = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Finishes the session file
+ *
+ */
+void lr_recorder::close() {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if ( _file ) {
+        fclose(_file);
+        _file = NULL;
+    }
+    _hashes.clear();
+    _n_prompts = 0;
+}
+
+/**
+ * @brief Appends a record
+ *
+ * @param type the record type
+ * @param payload the record payload
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write(uint8_t type, const std::vector<uint8_t> &payload) {
+
+    if ( !_file ) {
+        return false;
+    }
+    uint32_t size = (uint32_t)payload.size();
+    bool bSuccess = fwrite(&type, 1, 1, _file) == 1 &&
+                    fwrite(&size, sizeof(size), 1, _file) == 1 &&
+                    (payload.empty() || fwrite(payload.data(), 1, payload.size(), _file) == payload.size());
+
+    // Flush each record so a crash still leaves a usable file
+    return fflush(_file) == 0 && bSuccess;
+}
+
+/**
+ * @brief Records the init arguments & the sampling seed
+ *
+ * @param args the arguments passed to init
+ * @param seed the seed the sampler was created with
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_init(const std::vector<std::string> &args, uint32_t seed) {
+
+    std::vector<uint8_t> payload;
+    lr_put(payload, seed);
+    lr_put(payload, (uint32_t)args.size());
+    for ( const std::string &arg : args ) {
+        lr_put_string(payload, arg);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_INIT, payload);
+}
+
+/**
+ * @brief Records a media item, its bytes only the first time they are seen
+ *
+ * @param kind how the media was loaded
+ * @param data the media bytes
+ * @param len the number of bytes
+ * @param a the width of RGB media, the window of streamed audio in ms
+ * @param b the height of RGB media
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_media(uint8_t kind, const void *data, size_t len, uint32_t a/* = 0*/, uint32_t b/* = 0*/) {
+
+    uint64_t hash = lr_record_hash(data, len);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint8_t has_bytes = _hashes.insert(hash).second ? 1 : 0;
+
+    std::vector<uint8_t> payload;
+    lr_put(payload, kind);
+    lr_put(payload, hash);
+    lr_put(payload, a);
+    lr_put(payload, b);
+    lr_put(payload, has_bytes);
+    if ( has_bytes ) {
+        payload.insert(payload.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    }
+    return write(LR_RECORD_MEDIA, payload);
+}
+
+/**
+ * @brief Records the text of a request
+ *
+ * @param text the prompt
+ * @param request (optional, returned) the request's place among the prompts, for write_answer()
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_prompt(const std::string &text, uint32_t *request/* = NULL*/) {
+
+    std::vector<uint8_t> payload(text.begin(), text.end());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if ( request ) {
+        *request = _n_prompts;
+    }
+    _n_prompts++;
+    return write(LR_RECORD_PROMPT, payload);
+}
+
+/**
+ * @brief Records which request the next tokens & timings belong to
+ *
+ * Only needed when requests are answered after later ones are recorded,
+ * otherwise they belong to the last prompt
+ *
+ * @param request the request's place among the prompts, from write_prompt()
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_answer(uint32_t request) {
+
+    std::vector<uint8_t> payload;
+    lr_put(payload, request);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_ANSWER, payload);
+}
+
+/**
+ * @brief Records the tokens generated for the last request
+ *
+ * @param tokens the generated tokens
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_tokens(const std::vector<int32_t> &tokens) {
+
+    std::vector<uint8_t> payload((const uint8_t *)tokens.data(),
+                                 (const uint8_t *)(tokens.data() + tokens.size()));
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_TOKENS, payload);
+}
+
+/**
+ * @brief Records the timings of the last request
+ *
+ * @param timings stage names & their milliseconds, or counts
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_timings(const std::vector<std::pair<std::string, double>> &timings) {
+
+    std::vector<uint8_t> payload;
+    lr_put(payload, (uint32_t)timings.size());
+    for ( const auto &timing : timings ) {
+        lr_put_string(payload, timing.first);
+        lr_put(payload, timing.second);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_TIMINGS, payload);
+}
+
+/**
+ * @brief Records how the next prompt is answered
+ *
+ * @param call the call that answers it, see lr_record_call
+ * @param n_responses the number of responses asked for
+ * @param sampling the sampler settings of the request with the seed it used, NULL if it had none
+ * @param scales (optional) the adapter scales of the request, by adapter id
+ * @param n_scales the number of scales
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_request(uint8_t call, uint32_t n_responses, const lr_sampling *sampling,
+                                const float *scales/* = NULL*/, int n_scales/* = 0*/) {
+
+    std::vector<uint8_t> payload;
+    lr_put(payload, call);
+    lr_put(payload, n_responses);
+    lr_put(payload, (uint8_t)(sampling ? 1 : 0));
+    if ( sampling ) {
+        put_sampling(payload, *sampling);
+    }
+
+    // -1 when the request kept the session's adapters
+    lr_put(payload, (int32_t)(scales ? n_scales : -1));
+    for ( int i=0; scales && i<n_scales; i++ ) {
+        lr_put(payload, scales[i]);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_REQUEST, payload);
+}
+
+/**
+ * @brief Records new sampler settings for the session
+ *
+ * @param sampling the settings with the seed the sampler ended up using
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_sampling(const lr_sampling &sampling) {
+
+    std::vector<uint8_t> payload;
+    put_sampling(payload, sampling);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_SAMPLING, payload);
+}
+
+/**
+ * @brief Records an adapter being loaded or its session scale changing
+ *
+ * @param adapter_id the id of the adapter
+ * @param scale the session scale, unused when the adapter is loaded
+ * @param path (optional) the path of the adapter when it is loaded
+ *
+ * @return the status of the operation
+ */
+bool lr_recorder::write_adapter(int32_t adapter_id, float scale, const std::string &path/* = ""*/) {
+
+    std::vector<uint8_t> payload;
+    lr_put(payload, adapter_id);
+    lr_put(payload, scale);
+    lr_put_string(payload, path);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return write(LR_RECORD_ADAPTER, payload);
+}
+
+/**
+ * @brief Constructor
+ *
+ */
+lr_record_reader::lr_record_reader() {
+
+    _file = NULL;
+}
+
+/**
+ * @brief Destructor
+ *
+ */
+lr_record_reader::~lr_record_reader() {
+
+    if ( _file ) {
+        fclose(_file);
+    }
+}
+
+/**
+ * @brief Opens a session file & checks it is one
+ *
+ * @param path the path of the file
+ *
+ * @return the status of the operation
+ */
+bool lr_record_reader::open(const char *path) {
+
+    if ( _file ) {
+        fclose(_file);
+    }
+    _media.clear();
+
+    _file = fopen(path, "rb");
+    if ( !_file ) {
+        return false;
+    }
+    char magic[LR_RECORD_MAGIC_SIZE];
+    return fread(magic, 1, sizeof(magic), _file) == sizeof(magic) &&
+           memcmp(magic, LR_RECORD_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * @brief Reads the next record
+ *
+ * @param rec (returned) the record
+ *
+ * @return 1 if a record was read, 0 at the end of the file, -1 if the file is damaged
+ */
+int lr_record_reader::next(lr_record &rec) {
+
+    if ( !_file ) {
+        return -1;
+    }
+
+    rec = lr_record();
+    uint32_t size;
+    if ( fread(&rec.type, 1, 1, _file) != 1 ) {
+        return feof(_file) ? 0 : -1;
+    }
+    if ( fread(&size, sizeof(size), 1, _file) != 1 ||
+         size > LR_RECORD_MAX_PAYLOAD ) {
+        return -1;
+    }
+    std::vector<uint8_t> payload(size);
+    if ( size && fread(payload.data(), 1, size, _file) != size ) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    switch ( rec.type ) {
+
+        case LR_RECORD_INIT: {
+            uint32_t n_args;
+            if ( !lr_get(payload, pos, rec.seed) ||
+                 !lr_get(payload, pos, n_args) ) {
+                return -1;
+            }
+            for ( uint32_t i=0; i<n_args; i++ ) {
+                std::string arg;
+                if ( !lr_get_string(payload, pos, arg) ) {
+                    return -1;
+                }
+                rec.args.push_back(arg);
+            }
+            break;
+        }
+
+        case LR_RECORD_MEDIA: {
+            uint8_t has_bytes;
+            if ( !lr_get(payload, pos, rec.kind) ||
+                 !lr_get(payload, pos, rec.hash) ||
+                 !lr_get(payload, pos, rec.a) ||
+                 !lr_get(payload, pos, rec.b) ||
+                 !lr_get(payload, pos, has_bytes) ) {
+                return -1;
+            }
+
+            // Repeated media refers back to the first copy
+            if ( has_bytes ) {
+                rec.bytes.assign(payload.begin() + pos, payload.end());
+                _media[rec.hash] = rec.bytes;
+            } else {
+                auto it = _media.find(rec.hash);
+                if ( it == _media.end() ) {
+                    return -1;
+                }
+                rec.bytes = it->second;
+            }
+            break;
+        }
+
+        case LR_RECORD_PROMPT:
+            rec.text.assign(payload.begin(), payload.end());
+            break;
+
+        case LR_RECORD_TOKENS:
+            if ( size % sizeof(int32_t) ) {
+                return -1;
+            }
+            rec.tokens.resize(size / sizeof(int32_t));
+            if ( size ) {
+                memcpy(rec.tokens.data(), payload.data(), size);
+            }
+            break;
+
+        case LR_RECORD_TIMINGS: {
+            uint32_t n_timings;
+            if ( !lr_get(payload, pos, n_timings) ) {
+                return -1;
+            }
+            for ( uint32_t i=0; i<n_timings; i++ ) {
+                std::pair<std::string, double> timing;
+                if ( !lr_get_string(payload, pos, timing.first) ||
+                     !lr_get(payload, pos, timing.second) ) {
+                    return -1;
+                }
+                rec.timings.push_back(timing);
+            }
+            break;
+        }
+
+        case LR_RECORD_ANSWER:
+            if ( !lr_get(payload, pos, rec.request) ) {
+                return -1;
+            }
+            break;
+
+        case LR_RECORD_REQUEST: {
+            uint8_t has_sampling;
+            int32_t n_scales;
+            if ( !lr_get(payload, pos, rec.call) ||
+                 !lr_get(payload, pos, rec.n_responses) ||
+                 !lr_get(payload, pos, has_sampling) ||
+                 (has_sampling && !get_sampling(payload, pos, rec.sampling)) ||
+                 !lr_get(payload, pos, n_scales) ) {
+                return -1;
+            }
+            rec.has_sampling = has_sampling != 0;
+            rec.has_scales = n_scales >= 0;
+            for ( int32_t i=0; i<n_scales; i++ ) {
+                float scale;
+                if ( !lr_get(payload, pos, scale) ) {
+                    return -1;
+                }
+                rec.scales.push_back(scale);
+            }
+            break;
+        }
+
+        case LR_RECORD_SAMPLING:
+            if ( !get_sampling(payload, pos, rec.sampling) ) {
+                return -1;
+            }
+            break;
+
+        case LR_RECORD_ADAPTER:
+            if ( !lr_get(payload, pos, rec.adapter_id) ||
+                 !lr_get(payload, pos, rec.scale) ||
+                 !lr_get_string(payload, pos, rec.text) ) {
+                return -1;
+            }
+            break;
+
+        default:
+            // Skip types added by later versions
+            break;
+    }
+    return 1;
+}
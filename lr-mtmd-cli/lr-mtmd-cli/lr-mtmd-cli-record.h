@@ -0,0 +1,188 @@
+/**
+ *
+ * @file lr-mtmd-cli-record.h
+ *
+ * @brief Session recording for replay
+ *
+ * Writes everything needed to re-run a session to a compact binary file:
+ * the init arguments & sampling seed, each media item's content hash &
+ * bytes, the prompts with how each was answered, the generated tokens,
+ * the timings of each stage & the sampler & adapter changes in between.
+ * Media is stored once per content hash, so repeated images cost a few
+ * bytes each.
+ *
+ * The file starts with LR_RECORD_MAGIC, followed by records of a one
+ * byte type, a 32 bit payload size & the payload. Numbers are stored in
+ * host byte order.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_RECORD_H
+#define LR_MTMD_CLI_RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+
+#include "lr-mtmd-cli.h"
+
+#define LR_RECORD_MAGIC         "LRREC001"
+#define LR_RECORD_MAGIC_SIZE    8
+
+// Largest payload accepted when reading, guards against damaged files
+#define LR_RECORD_MAX_PAYLOAD   (1u << 30)
+
+// Record types
+typedef enum {
+    LR_RECORD_INIT = 1,     // seed, then the init arguments
+    LR_RECORD_MEDIA,        // a media item, see lr_record_media_kind
+    LR_RECORD_PROMPT,       // the text of a request
+    LR_RECORD_TOKENS,       // the tokens generated for the last request
+    LR_RECORD_TIMINGS,      // named stage timings & counts of the last request
+    LR_RECORD_ANSWER,       // the request the next tokens & timings belong to, by prompt order
+    LR_RECORD_REQUEST,      // how the next prompt is answered, a turn when missing
+    LR_RECORD_SAMPLING,     // the session's sampler settings changed
+    LR_RECORD_ADAPTER,      // an adapter was loaded or its session scale changed
+} lr_record_type;
+
+// Which call answered a request, so it is answered the same way on replay
+typedef enum {
+    LR_CALL_TURN = 1,       // evaluate_and_respond()
+    LR_CALL_ONCE,           // evaluate_and_respond_once()
+    LR_CALL_N,              // evaluate_and_respond_n()
+} lr_record_call;
+
+// How a media item was loaded, so it is loaded the same way on replay
+typedef enum {
+    LR_MEDIA_FILE = 1,      // encoded file bytes
+    LR_MEDIA_RGB,           // packed RGB pixels, nx by ny
+    LR_MEDIA_PCM,           // mono float samples
+    LR_MEDIA_STREAM,        // encoded audio file streamed in windows of a ms
+    LR_MEDIA_FRAME,         // packed RGB pixels, nx by ny, used as they are
+} lr_record_media_kind;
+
+/**
+ * @struct lr_record
+ *
+ * @brief A record read back from a file, only the fields of its type are set
+ *
+ */
+struct lr_record {
+    uint8_t type = 0;
+
+    // LR_RECORD_INIT
+    uint32_t seed = 0;
+    std::vector<std::string> args;
+
+    // LR_RECORD_MEDIA, bytes are filled in from an earlier record when repeated
+    uint8_t kind = 0;
+    uint64_t hash = 0;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    std::vector<uint8_t> bytes;
+
+    // LR_RECORD_PROMPT
+    std::string text;
+
+    // LR_RECORD_TOKENS
+    std::vector<int32_t> tokens;
+
+    // LR_RECORD_TIMINGS
+    std::vector<std::pair<std::string, double>> timings;
+
+    // LR_RECORD_ANSWER
+    uint32_t request = 0;
+
+    // LR_RECORD_REQUEST, the settings & scales only when the request had its own
+    uint8_t call = LR_CALL_TURN;
+    uint32_t n_responses = 1;
+    bool has_sampling = false;
+    bool has_scales = false;
+    std::vector<float> scales;
+
+    // LR_RECORD_REQUEST & LR_RECORD_SAMPLING
+    lr_sampling sampling;
+
+    // LR_RECORD_ADAPTER, text holds the path of a newly loaded adapter
+    int32_t adapter_id = 0;
+    float scale = 0.0f;
+};
+
+/**
+ * @class lr_recorder
+ *
+ * @brief Appends records to a session file, safe to use from any thread
+ *
+ */
+class lr_recorder {
+
+    FILE *_file;
+    std::set<uint64_t> _hashes;
+    uint32_t _n_prompts;
+    std::mutex _mutex;
+
+    bool write(uint8_t type, const std::vector<uint8_t> &payload);
+
+public:
+
+    lr_recorder();
+
+    ~lr_recorder();
+
+    bool open(const char *path);
+
+    void close();
+
+    bool is_open() const { return _file != NULL; }
+
+    bool write_init(const std::vector<std::string> &args, uint32_t seed);
+
+    bool write_media(uint8_t kind, const void *data, size_t len, uint32_t a = 0, uint32_t b = 0);
+
+    bool write_prompt(const std::string &text, uint32_t *request = NULL);
+
+    bool write_answer(uint32_t request);
+
+    bool write_tokens(const std::vector<int32_t> &tokens);
+
+    bool write_timings(const std::vector<std::pair<std::string, double>> &timings);
+
+    bool write_request(uint8_t call, uint32_t n_responses, const lr_sampling *sampling,
+                       const float *scales = NULL, int n_scales = 0);
+
+    bool write_sampling(const lr_sampling &sampling);
+
+    bool write_adapter(int32_t adapter_id, float scale, const std::string &path = "");
+};
+
+/**
+ * @class lr_record_reader
+ *
+ * @brief Reads the records of a session file in order
+ *
+ */
+class lr_record_reader {
+
+    FILE *_file;
+    std::map<uint64_t, std::vector<uint8_t>> _media;
+
+public:
+
+    lr_record_reader();
+
+    ~lr_record_reader();
+
+    bool open(const char *path);
+
+    int next(lr_record &rec);
+};
+
+uint64_t lr_record_hash(const void *data, size_t len);
+
+bool lr_record_read_file(const char *path, std::vector<uint8_t> &bytes);
+
+#endif  // LR_MTMD_CLI_RECORD_H
@@ -0,0 +1,446 @@
+/**
+ *
+ * @file lr-mtmd-cli-replay.cpp
+ *
+ * @brief Replays recorded sessions & compares them
+ *
+ * Re-runs a session recorded with lr_mtmd_cli::set_recording() against
+ * the current build, recording the replay alongside, then reports the
+ * timing differences of each request & any divergence in the generated
+ * tokens. Two recordings of the same session, e.g. from two builds, can
+ * also be compared directly.
+ *
+ */
+
+#include "log.h"
+#include "ggml.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <format>
+#include <string>
+#include <vector>
+
+#include "lr-mtmd-cli.h"
+#include "lr-mtmd-cli-errors.h"
+#include "lr-mtmd-cli-record.h"
+#include "lr-mtmd-cli-replay.h"
+
+// A request & its outcome as recorded
+struct lr_replay_request {
+    std::string prompt;
+    std::vector<int32_t> tokens;
+    std::vector<std::pair<std::string, double>> timings;
+};
+
+/**
+ * @brief Passes a line of the report on to the log & the status callback
+ *
+ * @param cli the instance the callback is given, NULL to only log
+ * @param msg the line
+ *
+ */
+static void report(lr_mtmd_cli *cli, const std::string &msg) {
+
+    LOG_INF("%s\n", msg.c_str());
+    if ( cli && lr_mtmd_cli_callback ) {
+        lr_mtmd_cli_callback(cli, LlamarattiEventStatus, msg.c_str());
+    }
+}
+
+/**
+ * @brief Reports an error
+ *
+ * @param cli the instance the callback is given, NULL to only log
+ * @param fmt the error format, taking the function & a detail
+ * @param func the reporting function
+ * @param detail what the error is about
+ *
+ */
+static void report_error(lr_mtmd_cli *cli, const char *fmt, const char *func, const std::string &detail) {
+
+    auto args = std::make_format_args(func, detail);
+    std::string err=std::vformat(fmt, args);
+    LOG_ERR("%s\n", err.c_str());
+    if ( cli && lr_mtmd_cli_callback ) {
+        lr_mtmd_cli_callback(cli, LlamarattiEventStatus, err.c_str());
+    }
+}
+
+/**
+ * @brief Reads the requests of a recording
+ *
+ * @param path the recording
+ * @param seed (returned) the sampling seed
+ * @param requests (returned) the requests in order
+ *
+ * @return the status of the operation
+ */
+static bool read_requests(const char *path, uint32_t &seed, std::vector<lr_replay_request> &requests) {
+
+    lr_record_reader reader;
+    if ( !reader.open(path) ) {
+        return false;
+    }
+
+    // Answers belong to the last prompt unless the recording says otherwise
+    lr_record rec;
+    int res;
+    size_t answer = 0;
+    while ( (res = reader.next(rec)) > 0 ) {
+        switch ( rec.type ) {
+            case LR_RECORD_INIT:
+                seed = rec.seed;
+                break;
+            case LR_RECORD_PROMPT:
+                requests.emplace_back();
+                requests.back().prompt = rec.text;
+                answer = requests.size() - 1;
+                break;
+            case LR_RECORD_ANSWER:
+                answer = rec.request;
+                break;
+            case LR_RECORD_TOKENS:
+                if ( answer < requests.size() ) {
+                    requests[answer].tokens = rec.tokens;
+                }
+                break;
+            case LR_RECORD_TIMINGS:
+                if ( answer < requests.size() ) {
+                    requests[answer].timings = rec.timings;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return res == 0;
+}
+
+/**
+ * @brief Looks up a timing by name
+ *
+ * @param timings the timings of a request
+ * @param name the stage name
+ * @param value (returned) the timing
+ *
+ * @return whether the timing was found
+ */
+static bool find_timing(const std::vector<std::pair<std::string, double>> &timings,
+                        const std::string &name,
+                        double &value) {
+
+    for ( const auto &timing : timings ) {
+        if ( timing.first == name ) {
+            value = timing.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Formats the change of a timing
+ *
+ */
+static std::string format_change(const std::string &name, double expected, double actual) {
+
+    double pct = expected != 0.0 ? (actual - expected) * 100.0 / expected : 0.0;
+    auto args = std::make_format_args(name, expected, actual, pct);
+    return std::vformat("{} {:.1f} -> {:.1f} ({:+.1f}%)", args);
+}
+
+/**
+ * @brief Compares two recordings of the same session request by request
+ *
+ * Reports the timings of each request & where its generated tokens first
+ * differ, followed by the totals of each timing.
+ *
+ * @param expected_path the reference recording
+ * @param actual_path the recording to compare with it
+ * @param result (returned, optional) a summary of the comparison
+ * @param cli (optional) the instance whose callback receives the report, it is only logged without one
+ *
+ * @return GGML_STATUS_SUCCESS if no request diverged
+ */
+int lr_record_compare(const char *expected_path,
+                      const char *actual_path,
+                      lr_replay_result *result/* = NULL*/,
+                      lr_mtmd_cli *cli/* = NULL*/) {
+
+    // Did we get the parameters we need?
+    if ( !expected_path || !actual_path ) {
+        return GGML_STATUS_FAILED;
+    }
+
+    // Can we read both recordings?
+    uint32_t expected_seed = 0, actual_seed = 0;
+    std::vector<lr_replay_request> expected, actual;
+    if ( !read_requests(expected_path, expected_seed, expected) ) {
+        report_error(cli, gErrMtmdReplayOpen, __func__, expected_path);
+        return GGML_STATUS_FAILED;
+    }
+    if ( !read_requests(actual_path, actual_seed, actual) ) {
+        report_error(cli, gErrMtmdReplayOpen, __func__, actual_path);
+        return GGML_STATUS_FAILED;
+    }
+
+    if ( expected_seed != actual_seed ) {
+        auto args = std::make_format_args(expected_seed, actual_seed);
+        report(cli, std::vformat("Seeds differ, {} vs {}, responses may diverge", args));
+    }
+
+    lr_replay_result summary;
+    summary.n_requests = (int)std::min(expected.size(), actual.size());
+    std::vector<std::pair<std::string, std::pair<double, double>>> totals;
+
+    for ( int ind=0; ind<summary.n_requests; ind++ ) {
+
+        const lr_replay_request &exp = expected[ind];
+        const lr_replay_request &act = actual[ind];
+        int req_num = ind + 1;
+        std::string line = std::vformat("Request {}:", std::make_format_args(req_num));
+
+        // Timings, in the order they were recorded
+        for ( const auto &timing : exp.timings ) {
+            double value;
+            if ( !find_timing(act.timings, timing.first, value) ) {
+                continue;
+            }
+            line += " " + format_change(timing.first, timing.second, value) + ",";
+
+            auto it = std::find_if(totals.begin(), totals.end(),
+                                   [&](const auto &t) { return t.first == timing.first; });
+            if ( it == totals.end() ) {
+                totals.push_back({ timing.first, { 0.0, 0.0 } });
+                it = totals.end() - 1;
+            }
+            it->second.first += timing.second;
+            it->second.second += value;
+        }
+
+        // Where do the responses first differ?
+        size_t n_common = std::min(exp.tokens.size(), act.tokens.size());
+        size_t first = 0;
+        while ( first < n_common && exp.tokens[first] == act.tokens[first] ) {
+            first++;
+        }
+        if ( first == n_common && exp.tokens.size() == act.tokens.size() ) {
+            size_t n_tokens = exp.tokens.size();
+            line += std::vformat(" {} tokens identical", std::make_format_args(n_tokens));
+        } else {
+            int32_t exp_token = first < exp.tokens.size() ? exp.tokens[first] : -1;
+            int32_t act_token = first < act.tokens.size() ? act.tokens[first] : -1;
+            line += std::vformat(" tokens diverge at {} ({} vs {})", std::make_format_args(first, exp_token, act_token));
+            if ( summary.first_diverged_request < 0 ) {
+                summary.first_diverged_request = req_num;
+                summary.first_diverged_token = (int)first;
+            }
+            summary.n_diverged++;
+        }
+        if ( exp.prompt != act.prompt ) {
+            line += ", prompts differ";
+        }
+        report(cli, line);
+    }
+
+    if ( expected.size() != actual.size() ) {
+        size_t n_expected = expected.size(), n_actual = actual.size();
+        report(cli, std::vformat("Request counts differ, {} vs {}", std::make_format_args(n_expected, n_actual)));
+    }
+
+    std::string line = std::vformat("Total: {} requests, {} diverged",
+                                    std::make_format_args(summary.n_requests, summary.n_diverged));
+    for ( const auto &total : totals ) {
+        line += ", " + format_change(total.first, total.second.first, total.second.second);
+    }
+    report(cli, line);
+
+    if ( result ) {
+        *result = summary;
+    }
+    return summary.n_diverged == 0 && expected.size() == actual.size() ? GGML_STATUS_SUCCESS : GGML_STATUS_FAILED;
+}
+
+/**
+ * @brief Writes streamed audio to a temporary file it can be streamed from
+ *
+ * @param bytes the encoded audio
+ * @param path (returned) the temporary file
+ *
+ * @return the status of the operation
+ */
+static bool write_temp_file(const std::vector<uint8_t> &bytes, std::string &path) {
+
+    const char *tmp_dir = getenv("TMPDIR");
+    path = std::string(tmp_dir && *tmp_dir ? tmp_dir : "/tmp") + "/lr-replay-XXXXXX";
+    int fd = mkstemp(path.data());
+    if ( fd < 0 ) {
+        return false;
+    }
+    bool bSuccess = write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size();
+    close(fd);
+    if ( !bSuccess ) {
+        unlink(path.c_str());
+    }
+    return bSuccess;
+}
+
+/**
+ * @brief Re-runs a recorded session & compares the replay with it
+ *
+ * The model is loaded with the recorded init arguments & seed, each
+ * media item is loaded the way it was recorded & each prompt is answered
+ * in order by the call that answered it, with the same sampler settings,
+ * seed & adapter scales. Sampler & adapter changes are made where they
+ * were recorded. Requests that were pipelined are replayed one at a
+ * time. The replay is recorded to replay_path & compared with the
+ * original using lr_record_compare().
+ *
+ * This loads a model of its own, so run it on its own rather than beside
+ * another lr_mtmd_cli.
+ *
+ * @param record_path the recording to replay
+ * @param replay_path where to record the replay
+ * @param result (returned, optional) a summary of the comparison
+ * @param user_callback callback function for receiving events
+ *
+ * @return GGML_STATUS_SUCCESS if the replay matched the recording
+ */
+int lr_mtmd_cli_replay(const char *record_path,
+                       const char *replay_path,
+                       lr_replay_result *result/* = NULL*/,
+                       bool (*user_callback)(void *, LlamarattiEvent, const char *)/* = NULL*/) {
+
+    // Did we get the parameters we need?
+    if ( !record_path || !replay_path ) {
+        return GGML_STATUS_FAILED;
+    }
+
+    // Does the recording start with the init record?
+    lr_record_reader reader;
+    lr_record rec;
+    if ( !reader.open(record_path) ||
+         reader.next(rec) != 1 ||
+         rec.type != LR_RECORD_INIT ) {
+        report_error(NULL, gErrMtmdReplayOpen, __func__, record_path);
+        return GGML_STATUS_FAILED;
+    }
+
+    // The recorded arguments, with the seed the sampler ended up using
+    std::vector<std::string> args = rec.args;
+    args.push_back("--seed");
+    args.push_back(std::to_string(rec.seed));
+    std::vector<char *> argv;
+    for ( std::string &arg : args ) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(NULL);
+
+    // Can we load the model?
+    lr_mtmd_cli cli;
+    bool is_vision_supported = false;
+    bool is_audio_supported = false;
+    int ret = cli.init(argv.data(), (int)args.size(), &is_vision_supported, &is_audio_supported, user_callback);
+    if ( ret ) {
+        return ret;
+    }
+
+    // Can we record the replay?
+    ret = cli.set_recording((char *)replay_path);
+    if ( ret ) {
+        return ret;
+    }
+
+    // Prompts without a request record of their own are turns
+    std::vector<std::string> temp_files;
+    lr_record request;
+    int res;
+    while ( (res = reader.next(rec)) > 0 ) {
+
+        if ( rec.type == LR_RECORD_MEDIA ) {
+
+            int status = GGML_STATUS_FAILED;
+            switch ( rec.kind ) {
+                case LR_MEDIA_FILE:
+                    status = cli.load_media_from_buffer(rec.bytes.data(), rec.bytes.size());
+                    break;
+                case LR_MEDIA_RGB:
+                case LR_MEDIA_FRAME:
+                    if ( rec.bytes.size() == (size_t)rec.a * rec.b * 3 ) {
+                        status = cli.load_media_from_rgb(rec.bytes.data(), rec.a, rec.b, rec.kind == LR_MEDIA_RGB);
+                    }
+                    break;
+                case LR_MEDIA_PCM:
+                    status = cli.load_media_from_pcm((const float *)rec.bytes.data(), rec.bytes.size() / sizeof(float));
+                    break;
+                case LR_MEDIA_STREAM: {
+                    std::string path;
+                    if ( write_temp_file(rec.bytes, path) ) {
+                        temp_files.push_back(path);
+                        status = cli.load_audio_stream(path.data(), rec.a / 1000.0f);
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            // The request goes ahead without it & shows up as diverged
+            if ( status ) {
+                char hash[17];
+                snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)rec.hash);
+                report_error(&cli, gErrMtmdReplayMedia, __func__, hash);
+            }
+
+        } else if ( rec.type == LR_RECORD_REQUEST ) {
+
+            request = rec;
+
+        } else if ( rec.type == LR_RECORD_PROMPT ) {
+
+            // Failed requests are recorded too, so carry on
+            const lr_sampling *sampling = request.has_sampling ? &request.sampling : NULL;
+            const float *scales = request.has_scales ? request.scales.data() : NULL;
+            int n_scales = (int)request.scales.size();
+            if ( request.call == LR_CALL_ONCE ) {
+                cli.evaluate_and_respond_once(rec.text.data(), sampling, scales, n_scales);
+            } else if ( request.call == LR_CALL_N ) {
+                std::vector<std::string> responses;
+                cli.evaluate_and_respond_n(rec.text.data(), (int)request.n_responses, responses, sampling);
+            } else {
+                cli.evaluate_and_respond(rec.text.data(), sampling, scales, n_scales);
+            }
+            request = lr_record();
+
+        } else if ( rec.type == LR_RECORD_SAMPLING ) {
+
+            cli.set_sampling(rec.sampling);
+
+        } else if ( rec.type == LR_RECORD_ADAPTER ) {
+
+            // Loaded adapters get the same ids as long as they load in the same order
+            if ( !rec.text.empty() ) {
+                cli.load_adapter(rec.text.data());
+            } else {
+                cli.set_adapter_scale(rec.adapter_id, rec.scale);
+            }
+        }
+    }
+
+    cli.set_recording(NULL);
+    cli.deinit();
+    for ( const std::string &path : temp_files ) {
+        unlink(path.c_str());
+    }
+
+    if ( res < 0 ) {
+        report_error(&cli, gErrMtmdReplayOpen, __func__, record_path);
+    }
+
+    ret = lr_record_compare(record_path, replay_path, result, &cli);
+    return res < 0 ? GGML_STATUS_FAILED : ret;
+}
@@ -0,0 +1,44 @@
+/**
+ *
+ * @file lr-mtmd-cli-replay.h
+ *
+ * @brief Replays recorded sessions & compares them
+ *
+ * Re-runs a session recorded with lr_mtmd_cli::set_recording() against
+ * the current build, recording the replay alongside, then reports the
+ * timing differences of each request & any divergence in the generated
+ * tokens. Two recordings of the same session, e.g. from two builds, can
+ * also be compared directly.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_REPLAY_H
+#define LR_MTMD_CLI_REPLAY_H
+
+#include <stdbool.h>
+#include "lr-mtmd-cli-callback.h"
+
+/**
+ * @struct lr_replay_result
+ *
+ * @brief Summary of a comparison between two recordings
+ *
+ */
+struct lr_replay_result {
+    int n_requests = 0;
+    int n_diverged = 0;
+    int first_diverged_request = -1;  // 1 based, -1 if none diverged
+    int first_diverged_token = -1;    // within that request's response
+};
+
+int lr_mtmd_cli_replay(const char *record_path,
+                       const char *replay_path,
+                       lr_replay_result *result = NULL,
+                       bool (*user_callback)(void *, LlamarattiEvent, const char *) = NULL);
+
+int lr_record_compare(const char *expected_path,
+                      const char *actual_path,
+                      lr_replay_result *result = NULL,
+                      class lr_mtmd_cli *cli = NULL);
+
+#endif  // LR_MTMD_CLI_REPLAY_H
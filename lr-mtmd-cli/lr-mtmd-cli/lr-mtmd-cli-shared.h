@@ -14,4 +14,16 @@
 // Utility Macros
 #define is_valid_string(s) (((s)!=NULL)&&(strlen(s)>0))
 
+// Embedding extraction, an item must fit in a single decode
+#define LR_EMBD_MAX_TOKENS  4096
+#define LR_EMBD_MAX_SEQS    16
+
+// Most alternative responses generated together from one prompt evaluation
+#define LR_MAX_RESPONSES    16
+
+// Most conversations kept aside by fork_session()
+#define LR_MAX_SESSIONS     32
+
+// The sequences above are reserved on first use, see lr_mtmd_cli::init()
+
 #endif  // LR_MTMD_CLI_SHARED_H
@@ -0,0 +1,118 @@
+/**
+ *
+ * @file lr-mtmd-cli-stop.cpp
+ *
+ * @brief Stop string matching
+ *
+ * Matches any number of stop strings against generated text one byte at
+ * a time using an Aho-Corasick automaton, so a stop string is found as
+ * soon as its last byte arrives, even when it spans several tokens
+ *
+ */
+
+#include <deque>
+#include <algorithm>
+
+#include "lr-mtmd-cli-stop.h"
+
+/**
+ * @brief Constructor, matches nothing until patterns are set
+ *
+ */
+lr_stop_matcher::lr_stop_matcher() {
+
+    set_patterns({});
+}
+
+/**
+ * @brief Builds the automaton for a set of stop strings
+ *
+ * Empty strings are ignored. Where several stop strings end on the same
+ * byte, the longest one is reported.
+ *
+ * @param patterns the stop strings
+ *
+ */
+void lr_stop_matcher::set_patterns(const std::vector<std::string> &patterns) {
+
+    _patterns.clear();
+    _nodes.assign(1, lr_stop_node());
+    std::fill(_nodes[0].next, _nodes[0].next + 256, -1);
+    _nodes[0].fail = 0;
+    _nodes[0].match = -1;
+    _nodes[0].depth = 0;
+    _state = 0;
+
+    // Build the trie
+    for ( const std::string &pattern : patterns ) {
+
+        if ( pattern.empty() ) {
+            continue;
+        }
+
+        int32_t node = 0;
+        for ( unsigned char c : pattern ) {
+            if ( _nodes[node].next[c] < 0 ) {
+                lr_stop_node child;
+                std::fill(child.next, child.next + 256, -1);
+                child.fail = 0;
+                child.match = -1;
+                child.depth = _nodes[node].depth + 1;
+                _nodes[node].next[c] = (int32_t)_nodes.size();
+                _nodes.push_back(child);
+            }
+            node = _nodes[node].next[c];
+        }
+        if ( _nodes[node].match < 0 ) {
+            _nodes[node].match = (int32_t)_patterns.size();
+            _patterns.push_back(pattern);
+        }
+    }
+
+    // Resolve failure links & missing transitions breadth first
+    std::deque<int32_t> queue;
+    for ( int c=0; c<256; c++ ) {
+        int32_t child = _nodes[0].next[c];
+        if ( child < 0 ) {
+            _nodes[0].next[c] = 0;
+        } else {
+            _nodes[child].fail = 0;
+            queue.push_back(child);
+        }
+    }
+
+    while ( !queue.empty() ) {
+
+        int32_t node = queue.front();
+        queue.pop_front();
+
+        // A node inherits the match of its longest proper suffix
+        int32_t fail = _nodes[node].fail;
+        if ( _nodes[node].match < 0 ) {
+            _nodes[node].match = _nodes[fail].match;
+        }
+
+        for ( int c=0; c<256; c++ ) {
+            int32_t child = _nodes[node].next[c];
+            if ( child < 0 ) {
+                _nodes[node].next[c] = _nodes[fail].next[c];
+            } else {
+                _nodes[child].fail = _nodes[fail].next[c];
+                queue.push_back(child);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Advances the automaton by one byte
+ *
+ * @param c the next byte of the generated text
+ *
+ * @return the index of the stop string ending at this byte, -1 if none
+ */
+int lr_stop_matcher::feed(unsigned char c) {
+
+    _state = _nodes[_state].next[c];
+    return _nodes[_state].match;
+}
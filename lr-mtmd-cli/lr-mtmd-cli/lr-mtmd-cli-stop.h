@@ -0,0 +1,63 @@
+/**
+ *
+ * @file lr-mtmd-cli-stop.h
+ *
+ * @brief Stop string matching
+ *
+ * Matches any number of stop strings against generated text one byte at
+ * a time using an Aho-Corasick automaton, so a stop string is found as
+ * soon as its last byte arrives, even when it spans several tokens
+ *
+ */
+
+#ifndef LR_MTMD_CLI_STOP_H
+#define LR_MTMD_CLI_STOP_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * @class lr_stop_matcher
+ *
+ * @brief Incremental multi-pattern matcher over a byte stream
+ *
+ * The automaton is built with every transition resolved, so each byte
+ * costs a single table lookup. depth() tells the caller how many of the
+ * most recent bytes could still turn out to be the start of a stop
+ * string & should be held back rather than shown.
+ *
+ */
+class lr_stop_matcher {
+
+    struct lr_stop_node {
+        int32_t next[256];
+        int32_t fail;
+        int32_t match;
+        size_t depth;
+    };
+
+    std::vector<lr_stop_node> _nodes;
+    std::vector<std::string> _patterns;
+    int32_t _state;
+
+public:
+
+    lr_stop_matcher();
+
+    void set_patterns(const std::vector<std::string> &patterns);
+
+    bool empty() const { return _patterns.empty(); }
+
+    void reset() { _state = 0; }
+
+    int feed(unsigned char c);
+
+    size_t depth() const { return _nodes[_state].depth; }
+
+    const std::string &pattern(int ind) const { return _patterns[ind]; }
+
+    const std::vector<std::string> &patterns() const { return _patterns; }
+};
+
+#endif  // LR_MTMD_CLI_STOP_H
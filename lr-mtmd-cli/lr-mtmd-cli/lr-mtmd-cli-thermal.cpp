@@ -0,0 +1,264 @@
+/**
+ *
+ * @file lr-mtmd-cli-thermal.cpp
+ *
+ * @brief Throttles generation when the system runs hot
+ *
+ * Polls the thermal zones under a sysfs directory & takes temperatures
+ * reported by the host, & turns the hottest recent one into a throttling
+ * level with hysteresis
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <algorithm>
+#include <chrono>
+
+#include "lr-mtmd-cli-thermal.h"
+
+static int64_t now_ms() {
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Reads the hottest of the thermal zones under a sysfs directory
+ *
+ * Each thermal_zone* subdirectory holds a temp file in millidegrees
+ * Celsius
+ *
+ * @param path the directory, such as /sys/class/thermal
+ * @param temp_c (returned) the hottest temperature in Celsius
+ *
+ * @return whether any zone could be read
+ */
+bool lr_read_thermal_zones(const char *path, float *temp_c) {
+
+    if ( !path || !temp_c ) {
+        return false;
+    }
+
+    DIR *dir = opendir(path);
+    if ( !dir ) {
+        return false;
+    }
+
+    bool bFound = false;
+    struct dirent *ent;
+    while ( (ent = readdir(dir)) != NULL ) {
+
+        if ( strncmp(ent->d_name, "thermal_zone", 12) != 0 ) {
+            continue;
+        }
+        std::string temp_path = std::string(path) + "/" + ent->d_name + "/temp";
+        FILE *f = fopen(temp_path.c_str(), "r");
+        if ( !f ) {
+            continue;
+        }
+
+        // Disabled zones fail to read or report nonsense
+        long milli_c;
+        if ( fscanf(f, "%ld", &milli_c) == 1 && milli_c > -273000 ) {
+            float zone_c = milli_c / 1000.0f;
+            *temp_c = bFound ? std::max(*temp_c, zone_c) : zone_c;
+            bFound = true;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    return bFound;
+}
+
+/**
+ * @brief Constructor, the governor starts stopped
+ *
+ */
+lr_thermal_governor::lr_thermal_governor() {
+
+    _level = 0;
+    _temp_c = NAN;
+    _sensor_c = NAN;
+    _reported_c = NAN;
+    _t_reported_ms = 0;
+    _running = false;
+}
+
+/**
+ * @brief Destructor
+ *
+ */
+lr_thermal_governor::~lr_thermal_governor() {
+
+    stop();
+}
+
+/**
+ * @brief Starts polling, or changes the settings if already started
+ *
+ * A directory without thermal zones leaves the governor relying on the
+ * temperatures reported by the host
+ *
+ * @param path (optional) the sysfs thermal directory, LR_THERMAL_PATH if NULL
+ * @param params when & how hard to throttle
+ */
+void lr_thermal_governor::start(const char *path, const lr_thermal_params &params) {
+
+    stop();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _path = path ? path : LR_THERMAL_PATH;
+    _params = params;
+    _running = true;
+    _thread = std::thread(&lr_thermal_governor::poll_loop, this);
+}
+
+/**
+ * @brief Stops polling & throttling
+ *
+ */
+void lr_thermal_governor::stop() {
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running = false;
+    }
+    _cv.notify_all();
+    if ( _thread.joinable() ) {
+        _thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sensor_c = NAN;
+    _reported_c = NAN;
+    _temp_c = NAN;
+    _level = 0;
+}
+
+/**
+ * @brief Returns whether the governor is started
+ *
+ * @return whether it is started
+ */
+bool lr_thermal_governor::is_running() {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _running;
+}
+
+/**
+ * @brief Takes a temperature measured by the host
+ *
+ * It counts for LR_THERMAL_REPORT_SECS, alongside the thermal zones
+ *
+ * @param temp_c the temperature in Celsius
+ */
+void lr_thermal_governor::report(float temp_c) {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if ( !_running ) {
+        return;
+    }
+    _reported_c = temp_c;
+    _t_reported_ms = now_ms();
+    update();
+}
+
+/**
+ * @brief Scales a thread count or batch size for the throttling level
+ *
+ * @param n the value when not throttled
+ * @param n_min the smallest value to return
+ *
+ * @return the value to use now
+ */
+int lr_thermal_governor::scale(int n, int n_min) const {
+
+    int level = _level.load();
+    if ( !level ) {
+        return n;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    float share = 1.0f - (1.0f - _params.min_scale) * level / LR_THERMAL_LEVELS;
+    return std::min(n, std::max(n_min, (int)lroundf(n * share)));
+}
+
+/**
+ * @brief Returns the pause to take after each decode
+ *
+ * @return the pause in milliseconds, 0 when not throttled
+ */
+float lr_thermal_governor::pause_ms() const {
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _params.max_pause_ms * _level.load() / LR_THERMAL_LEVELS;
+}
+
+/**
+ * @brief Reads the thermal zones until stopped
+ *
+ */
+void lr_thermal_governor::poll_loop() {
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while ( _running ) {
+
+        // Read the sensors without holding up reports & lookups
+        std::string path = _path;
+        lock.unlock();
+        float sensor_c;
+        bool bRead = lr_read_thermal_zones(path.c_str(), &sensor_c);
+        lock.lock();
+
+        _sensor_c = bRead ? sensor_c : NAN;
+        update();
+
+        auto poll = std::chrono::milliseconds((int64_t)(std::max(0.1f, _params.poll_secs) * 1000.0f));
+        _cv.wait_for(lock, poll, [this]() { return !_running; });
+    }
+}
+
+/**
+ * @brief Sets the level from the hottest recent reading, the caller holds the lock
+ *
+ */
+void lr_thermal_governor::update() {
+
+    float temp_c = _sensor_c;
+    if ( !isnan(_reported_c) &&
+         now_ms() - _t_reported_ms <= (int64_t)(LR_THERMAL_REPORT_SECS * 1000.0f) ) {
+        temp_c = isnan(temp_c) ? _reported_c : std::max(temp_c, _reported_c);
+    }
+    _temp_c = temp_c;
+    if ( isnan(temp_c) ) {
+        _level = 0;
+        return;
+    }
+
+    // Rise straight away, ease off only once cooled past the hysteresis
+    int level = _level.load();
+    _level = std::max(level_for(temp_c), std::min(level, level_for(temp_c + _params.hysteresis_c)));
+}
+
+/**
+ * @brief Returns the level a temperature calls for, ignoring hysteresis
+ *
+ * @param temp_c the temperature in Celsius
+ *
+ * @return the level, 0 to LR_THERMAL_LEVELS
+ */
+int lr_thermal_governor::level_for(float temp_c) const {
+
+    if ( temp_c < _params.warm_c ) {
+        return 0;
+    }
+    if ( _params.hot_c <= _params.warm_c ) {
+        return LR_THERMAL_LEVELS;
+    }
+    float step = (_params.hot_c - _params.warm_c) / (LR_THERMAL_LEVELS - 1);
+    int level = 1 + (int)floorf((temp_c - _params.warm_c) / step);
+    return std::min(level, LR_THERMAL_LEVELS);
+}
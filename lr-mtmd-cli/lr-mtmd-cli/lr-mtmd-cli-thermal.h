@@ -0,0 +1,105 @@
+/**
+ *
+ * @file lr-mtmd-cli-thermal.h
+ *
+ * @brief Throttles generation when the system runs hot
+ *
+ * A background thread polls the thermal zones under a sysfs directory,
+ * /sys/class/thermal on Linux, & the host may report temperatures of its
+ * own, such as the battery temperature on macOS. The hottest recent
+ * reading sets a throttling level: none below the warm threshold, the
+ * most at the hot threshold & evenly spaced levels between them. A level
+ * is only eased off once the temperature has dropped a little below the
+ * threshold that raised it, so the level doesn't flap about a threshold.
+ *
+ * Each level takes a share of the threads & batch size away & adds a
+ * pause after each decode, the engine applies them between decodes.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_THERMAL_H
+#define LR_MTMD_CLI_THERMAL_H
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define LR_THERMAL_PATH         "/sys/class/thermal"
+#define LR_THERMAL_LEVELS       4
+
+// How long a temperature reported by the host is trusted
+#define LR_THERMAL_REPORT_SECS  10.0f
+
+/**
+ * @struct lr_thermal_params
+ *
+ * @brief When & how hard to throttle
+ *
+ */
+struct lr_thermal_params {
+    float warm_c       = 70.0f;     // throttling starts
+    float hot_c        = 90.0f;     // throttling is at its most
+    float hysteresis_c = 5.0f;      // how far below its threshold a level eases off
+    float poll_secs    = 1.0f;
+    float min_scale    = 0.25f;     // share of threads & batch kept at the most throttling
+    float max_pause_ms = 40.0f;     // pause after each decode at the most throttling
+};
+
+/**
+ * @class lr_thermal_governor
+ *
+ * @brief Turns temperatures into a throttling level, safe to use from any thread
+ *
+ */
+class lr_thermal_governor {
+
+    std::string _path;
+    lr_thermal_params _params;
+
+    std::atomic<int> _level;
+    std::atomic<float> _temp_c;
+
+    float _sensor_c;
+    float _reported_c;
+    int64_t _t_reported_ms;
+
+    std::thread _thread;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _running;
+
+    void poll_loop();
+
+    void update();
+
+    int level_for(float temp_c) const;
+
+public:
+
+    lr_thermal_governor();
+
+    ~lr_thermal_governor();
+
+    void start(const char *path, const lr_thermal_params &params);
+
+    void stop();
+
+    bool is_running();
+
+    void report(float temp_c);
+
+    int level() const { return _level.load(); }
+
+    float temperature() const { return _temp_c.load(); }
+
+    int scale(int n, int n_min) const;
+
+    float pause_ms() const;
+};
+
+bool lr_read_thermal_zones(const char *path, float *temp_c);
+
+#endif  // LR_MTMD_CLI_THERMAL_H
@@ -0,0 +1,262 @@
+/**
+ *
+ * @file lr-mtmd-cli-trace.cpp
+ *
+ * @brief Lightweight span tracing
+ *
+ * Records timed spans into per-thread buffers & writes them out in the
+ * Chrome trace event format, which can be opened in Perfetto or
+ * chrome://tracing. Tracing is off by default & costs a single atomic
+ * load per span while disabled.
+ *
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#include "lr-mtmd-cli-trace.h"
+
+std::atomic<bool> gTraceEnabled(false);
+
+// A completed span
+struct lr_trace_event {
+    const char *name;
+    int64_t start_us;
+    int64_t dur_us;
+    int64_t arg;
+};
+
+// The spans recorded by one thread, only that thread appends to it so the
+// mutex is only ever contended while a trace is being written or cleared
+struct lr_trace_buffer {
+    int tid = 0;
+    std::string name;
+    std::mutex mutex;
+    std::vector<lr_trace_event> events;
+    size_t n_dropped = 0;
+    bool exited = false;
+};
+
+// A thread's name & its buffer, the buffer is only made once the thread
+// records a span
+struct lr_trace_thread {
+    std::string name;
+    std::shared_ptr<lr_trace_buffer> buffer;
+
+    ~lr_trace_thread();
+};
+
+// Buffers of finished threads are kept until the next trace starts, so
+// their spans can still be written
+static std::mutex gTraceMutex;
+static std::vector<std::shared_ptr<lr_trace_buffer>> gTraceBuffers;
+static std::atomic<int64_t> gTraceEpochUs(0);
+static int gTraceNextTid = 1;
+
+static thread_local lr_trace_thread tTraceThread;
+
+/**
+ * @brief Destructor, lets go of the thread's buffer as the thread exits
+ *
+ */
+lr_trace_thread::~lr_trace_thread() {
+
+    if ( !buffer ) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(gTraceMutex);
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+
+    // Nothing to write? Then drop it now
+    if ( buffer->events.empty() && !buffer->n_dropped ) {
+        gTraceBuffers.erase(std::remove(gTraceBuffers.begin(), gTraceBuffers.end(), buffer), gTraceBuffers.end());
+    } else {
+        buffer->exited = true;
+    }
+}
+
+/**
+ * @brief Returns the steady clock time in microseconds
+ *
+ */
+static int64_t steady_us() {
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Returns the calling thread's buffer, registering it on first use
+ *
+ */
+static lr_trace_buffer *thread_buffer() {
+
+    if ( !tTraceThread.buffer ) {
+        auto buffer = std::make_shared<lr_trace_buffer>();
+        buffer->name = tTraceThread.name;
+        std::lock_guard<std::mutex> lock(gTraceMutex);
+        buffer->tid = gTraceNextTid++;
+        gTraceBuffers.push_back(buffer);
+        tTraceThread.buffer = buffer;
+    }
+    return tTraceThread.buffer.get();
+}
+
+/**
+ * @brief Writes a string as a JSON string literal
+ *
+ */
+static void write_json_string(FILE *fp, const char *s) {
+
+    fputc('"', fp);
+    for ( ; s && *s; s++ ) {
+        unsigned char c = (unsigned char)*s;
+        if ( c == '"' || c == '\\' ) {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if ( c < 0x20 ) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/**
+ * @brief Starts or stops recording spans
+ *
+ * Starting discards any spans from a previous trace, along with the
+ * buffers of the threads that have since finished
+ *
+ * @param enabled whether to record spans
+ *
+ */
+void lr_trace_enable(bool enabled) {
+
+    std::lock_guard<std::mutex> lock(gTraceMutex);
+
+    if ( enabled && !gTraceEnabled.load() ) {
+        gTraceBuffers.erase(std::remove_if(gTraceBuffers.begin(), gTraceBuffers.end(),
+                                           [](const std::shared_ptr<lr_trace_buffer> &buffer) {
+                                               std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+                                               return buffer->exited;
+                                           }), gTraceBuffers.end());
+        for ( auto &buffer : gTraceBuffers ) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            buffer->events.clear();
+            buffer->n_dropped = 0;
+        }
+        gTraceEpochUs.store(steady_us());
+    }
+    gTraceEnabled.store(enabled);
+}
+
+/**
+ * @brief Names the calling thread in the trace
+ *
+ * Cheap while tracing is off, the thread only gets a buffer once it
+ * records a span
+ *
+ * @param name the thread name
+ *
+ */
+void lr_trace_set_thread_name(const char *name) {
+
+    tTraceThread.name = name ? name : "";
+    if ( tTraceThread.buffer ) {
+        std::lock_guard<std::mutex> lock(tTraceThread.buffer->mutex);
+        tTraceThread.buffer->name = tTraceThread.name;
+    }
+}
+
+/**
+ * @brief Returns the microseconds elapsed since tracing started
+ *
+ */
+int64_t lr_trace_now_us() {
+
+    return steady_us() - gTraceEpochUs.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Appends a completed span to the calling thread's buffer
+ *
+ * @param name the span name
+ * @param start_us when the span started
+ * @param end_us when the span ended
+ * @param arg an optional value shown with the span, -1 for none
+ *
+ */
+void lr_trace_record(const char *name, int64_t start_us, int64_t end_us, int64_t arg) {
+
+    lr_trace_buffer *buffer = thread_buffer();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+
+    if ( buffer->events.size() >= LR_TRACE_MAX_EVENTS_PER_THREAD ) {
+        buffer->n_dropped++;
+        return;
+    }
+    buffer->events.push_back({ name, start_us, end_us - start_us, arg });
+}
+
+/**
+ * @brief Writes the recorded spans as Chrome trace event JSON
+ *
+ * @param path the file to write
+ *
+ * @return the status of the operation
+ */
+bool lr_trace_dump(const char *path) {
+
+    // Did we get the parameters we need?
+    if ( !path || !*path ) {
+        return false;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if ( !fp ) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(gTraceMutex);
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"lr-mtmd-cli\"}}");
+
+    for ( auto &buffer : gTraceBuffers ) {
+
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+
+        std::string name = buffer->name.empty() ? "thread " + std::to_string(buffer->tid) : buffer->name;
+        fprintf(fp, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", buffer->tid);
+        write_json_string(fp, name.c_str());
+        fprintf(fp, "}}");
+
+        for ( const lr_trace_event &event : buffer->events ) {
+            fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"name\":",
+                    buffer->tid, (long long)event.start_us, (long long)event.dur_us);
+            write_json_string(fp, event.name);
+            if ( event.arg >= 0 ) {
+                fprintf(fp, ",\"args\":{\"n\":%lld}", (long long)event.arg);
+            }
+            fprintf(fp, "}");
+        }
+
+        if ( buffer->n_dropped ) {
+            fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"name\":\"dropped\",\"args\":{\"n\":%zu}}",
+                    buffer->tid, (long long)lr_trace_now_us(), buffer->n_dropped);
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    bool bSuccess = !ferror(fp);
+    bSuccess = (fclose(fp) == 0) && bSuccess;
+    return bSuccess;
+}
@@ -0,0 +1,81 @@
+/**
+ *
+ * @file lr-mtmd-cli-trace.h
+ *
+ * @brief Lightweight span tracing
+ *
+ * Records timed spans into per-thread buffers & writes them out in the
+ * Chrome trace event format, which can be opened in Perfetto or
+ * chrome://tracing. Tracing is off by default & costs a single atomic
+ * load per span while disabled.
+ *
+ */
+
+#ifndef LR_MTMD_CLI_TRACE_H
+#define LR_MTMD_CLI_TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Most spans kept per thread, later spans are counted as dropped
+#define LR_TRACE_MAX_EVENTS_PER_THREAD  (1 << 20)
+
+extern std::atomic<bool> gTraceEnabled;
+
+void lr_trace_enable(bool enabled);
+
+bool lr_trace_dump(const char *path);
+
+void lr_trace_set_thread_name(const char *name);
+
+int64_t lr_trace_now_us();
+
+void lr_trace_record(const char *name, int64_t start_us, int64_t end_us, int64_t arg);
+
+/**
+ * @class lr_trace_span
+ *
+ * @brief Records the lifetime of a scope as a trace span
+ *
+ * The name must be a string literal, or otherwise outlive the trace
+ *
+ */
+class lr_trace_span {
+
+    const char *_name;
+    int64_t _start_us;
+    int64_t _arg;
+
+public:
+
+    explicit lr_trace_span(const char *name, int64_t arg = -1) {
+        _name = name;
+        _arg = arg;
+        _start_us = gTraceEnabled.load(std::memory_order_relaxed) ? lr_trace_now_us() : -1;
+    }
+
+    ~lr_trace_span() {
+        end();
+    }
+
+    // Ends the span before the scope does
+    void end() {
+        if ( _start_us >= 0 ) {
+            lr_trace_record(_name, _start_us, lr_trace_now_us(), _arg);
+            _start_us = -1;
+        }
+    }
+
+    void set_arg(int64_t arg) { _arg = arg; }
+
+    lr_trace_span(const lr_trace_span &) = delete;
+    lr_trace_span &operator=(const lr_trace_span &) = delete;
+};
+
+#define LR_TRACE_CONCAT_(a, b)  a##b
+#define LR_TRACE_CONCAT(a, b)   LR_TRACE_CONCAT_(a, b)
+
+// Traces the rest of the enclosing scope
+#define LR_TRACE_SCOPE(...)     lr_trace_span LR_TRACE_CONCAT(_lr_trace_span_, __LINE__)(__VA_ARGS__)
+
+#endif  // LR_MTMD_CLI_TRACE_H
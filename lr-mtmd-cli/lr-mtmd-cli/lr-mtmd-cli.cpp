@@ -22,18 +22,41 @@
 #include "chat.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
+#include "gguf.h"
 
 #include <vector>
+#include <memory>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <chrono>
 #include <limits.h>
+#include <string.h>
+#include <math.h>
 #include <cinttypes>
 
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lr-mtmd-cli-shared.h"
 #include "lr-mtmd-cli-callback.h"
 #include "lr-mtmd-cli.h"
 #include "lr-mtmd-cli-errors.h"
+#include "lr-mtmd-cli-audio.h"
+#include "lr-mtmd-cli-frames.h"
+#include "lr-mtmd-cli-trace.h"
+#include "lr-mtmd-cli-stop.h"
+#include "lr-mtmd-cli-image.h"
+#include "lr-mtmd-cli-record.h"
+#include "lr-mtmd-cli-cache.h"
+#include "lr-mtmd-cli-thermal.h"
 
 // Callback used by the class
 bool (*lr_mtmd_cli_callback)(void *,
@@ -51,6 +74,21 @@ void dump_params( int argc, char **argv );
  * @brief mtmd_cli_context
  *
  */
+// A message queued for pipelined evaluation, its media are tokenized &
+// encoded on the encoder thread while earlier messages are decoded
+struct lr_pipeline_request {
+    int id       = 0;
+    bool add_bos = false;
+    std::string prompt;
+    mtmd::bitmaps bitmaps;
+    mtmd::input_chunks chunks;
+    std::vector<float>  embd;
+    std::vector<size_t> offsets;
+    int32_t status = 0;
+    bool encoded   = false;
+    uint32_t record_request = UINT32_MAX;   // see lr_recorder::write_answer()
+};
+
 struct mtmd_cli_context {
     
     mtmd::context_ptr ctx_vision;
@@ -62,9 +100,36 @@ struct mtmd_cli_context {
     common_sampler    * smpl;
     llama_batch         batch;
     int                 n_batch;
+    int                 n_batch_full;
 
     mtmd::bitmaps bitmaps;
 
+    // one entry per media marker in the pending message, a null entry
+    // refers to the next bitmap, otherwise audio is streamed in windows
+    std::vector<std::shared_ptr<lr_audio_stream>> media;
+
+    // optional voice activity detection applied to audio before encoding
+    bool use_vad = false;
+    lr_vad_params vad;
+    double vad_secs_in  = 0.0;
+    double vad_secs_out = 0.0;
+
+    // per image token & prefill latency budgets, larger images are downscaled
+    // before encoding (0 = no limit)
+    int   image_max_tokens     = 0;
+    float image_max_latency_ms = 0.0f;
+
+    // prefill cost measured on earlier messages, converts latency to tokens
+    double prefill_ms_per_token = 0.0;
+
+    // size & token count of the last image added
+    uint32_t last_image_nx     = 0;
+    uint32_t last_image_ny     = 0;
+    size_t   last_image_tokens = 0;
+
+    // image token counts by bitmap size, preprocessing depends only on the size
+    std::map<std::pair<uint32_t, uint32_t>, size_t> image_token_cache;
+
     // note: we know that gemma3 template is "linear", meaning each turn is completely separated to another
     // so here we don't need to keep track of chat history
     common_chat_templates_ptr tmpls;
@@ -72,17 +137,133 @@ struct mtmd_cli_context {
     // support for legacy templates (models not having EOT token)
     llama_tokens antiprompt_tokens;
 
+    // text that ends generation as soon as it appears in the output
+    lr_stop_matcher stop;
+
     int n_threads    = 1;
     llama_pos n_past = 0;
 
+    // what the vision context was created with, so it can be recreated
+    std::string model_path;
+    std::string mmproj_path;
+    bool mmproj_use_gpu  = false;
+    int verbosity        = 0;
+    int n_threads_total  = 1;
+    int n_threads_vision = 1;
+
+    // the projector is loaded on first use & may be unloaded when idle
+    std::mutex vision_mutex;
+    // the projector's compute state is shared, so a tokenize, or an encode &
+    // the read of its output, holds this while the encoder thread may run
+    std::mutex encoder_mutex;
+    bool supports_vision = false;
+    bool supports_audio  = false;
+    float projector_idle_secs = 0.0f;
+
+    // calls in progress & when the last one finished, see activity
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    std::thread idle_thread;
+    bool idle_running        = false;
+    int n_active             = 0;
+    int64_t t_last_active_ms = 0;
+
+    // the language context is released when idle & rebuilt by the next call,
+    // the state of every conversation is kept in kv_saved meanwhile & those
+    // that can't be put back are counted in n_sessions_lost
+    llama_context_params cparams;
+    float context_idle_secs = 0.0f;
+    bool context_released   = false;
+    std::vector<uint8_t> kv_saved;
+    int n_sessions_lost     = 0;
+
+    // LoRA adapters of the base model & their session scales, an adapter
+    // with a scale of 0 is loaded but detached, ids index lora_adapters
+    std::vector<common_adapter_lora_info> lora_adapters;
+    std::vector<llama_adapter_lora_ptr> lora_loaded;
+
+    // session recording for replay, see lr-mtmd-cli-record.h, request_call
+    // is the call the next prompt is recorded as answered by
+    lr_recorder recorder;
+    uint8_t request_call = LR_CALL_TURN;
+    std::vector<std::string> init_args;
+    common_params_sampling sampling;
+    double record_media_ms = 0.0;
+
+    // the tokens generated for the last request
+    llama_tokens response_tokens;
+
+    // responses of deterministic requests, see lr-mtmd-cli-cache.h, the
+    // text passed to the callback is kept in response_pieces while set &
+    // response_complete tells whether the response ended by itself
+    lr_response_cache response_cache;
+    std::vector<std::string> * response_pieces = nullptr;
+    bool response_complete = false;
+
+    // where each turn of the conversation starts, so it can be branched or
+    // cut back without evaluating it again
+    struct turn {
+        llama_pos n_past_prompt   = 0;                 // before the user's message
+        llama_pos n_past_response = 0;                 // after it, where the response starts
+        llama_token prompt_token  = LLAMA_TOKEN_NULL;  // the message's last token
+        llama_tokens response;
+    };
+    std::vector<turn> turns;
+    llama_token last_prompt_token = LLAMA_TOKEN_NULL;
+
+    // conversations put aside by fork_session(), each keeps its cells in a
+    // sequence of its own above those used by evaluate_and_respond_n(),
+    // sharing them with the others until either side changes
+    struct sampler_deleter {
+        void operator()(common_sampler * s) const { common_sampler_free(s); }
+    };
+    struct session {
+        llama_seq_id seq_id = -1;
+        llama_pos n_past    = 0;
+        std::vector<turn> turns;
+        std::unique_ptr<common_sampler, sampler_deleter> smpl;
+        llama_tokens response_tokens;
+        std::string context;
+        bool is_first_msg   = true;
+    };
+    std::map<int, session> sessions;
+    int session_id      = 0;
+    int session_next_id = 1;
+
+    // lowers the decode threads & the batch size & paces decode while the
+    // system runs hot, see lr-mtmd-cli-thermal.h, the generating thread
+    // applies the governor's level between decodes
+    lr_thermal_governor thermal;
+    int n_threads_applied        = 0;
+    llama_context * lctx_applied = nullptr;
+
+    // pipelined evaluation, the encoder thread prepares queued requests in order
+    std::thread encoder_thread;
+    std::mutex pipeline_mutex;
+    std::condition_variable pipeline_cv;
+    std::deque<std::shared_ptr<lr_pipeline_request>> pipeline;
+    std::atomic<bool> pipeline_running{false};
+    int pipeline_next_id  = 1;
+
     mtmd_cli_context(common_params & params) : llama_init(common_init_from_params(params)) {
         model = llama_init.model.get();
         lctx = llama_init.context.get();
+        model_path = params.model.path;
+        cparams = common_context_params_to_llama(params);
+        lora_adapters = params.lora_adapters;
+        if (params.lora_init_without_apply) {
+            for (auto & la : lora_adapters) {
+                la.scale = 0.0f;
+            }
+        }
         vocab = llama_model_get_vocab(model);
         smpl = common_sampler_init(model, params.sampling);
+        sampling = params.sampling;
         n_threads = params.cpuparams.n_threads;
+        n_threads_total = n_threads;
         batch = llama_batch_init(1, 0, 1); // batch for next token generation
         n_batch = params.n_batch;
+        n_batch_full = n_batch;
 
         if (!model || !lctx) {
             throw std::runtime_error("Invalid parameters");
@@ -102,6 +283,8 @@ struct mtmd_cli_context {
 
         init_vision_context(params);
 
+        stop.set_patterns(params.antiprompt);
+
         // load antiprompt tokens for legacy templates
         if (params.chat_template == "vicuna") {
             antiprompt_tokens = common_tokenize(lctx, "ASSISTANT:", false, true);
@@ -111,19 +294,27 @@ struct mtmd_cli_context {
     }
 
     ~mtmd_cli_context() {
+        thermal.stop();
+        stop_idle_thread();
+        stop_pipeline();
         llama_batch_free(batch);
         common_sampler_free(smpl);
     }
 
     void init_vision_context(common_params & params) {
         const char * clip_path = params.mmproj.path.c_str();
-        mtmd_context_params mparams = mtmd_context_params_default();
-        mparams.use_gpu = params.mmproj_use_gpu;
-        mparams.print_timings = true;
-        mparams.n_threads = params.cpuparams.n_threads;
-        mparams.verbosity = params.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
-        ctx_vision.reset(mtmd_init_from_file(clip_path, model, mparams));
-        if (!ctx_vision.get()) {
+        mmproj_path = params.mmproj.path;
+        mmproj_use_gpu = params.mmproj_use_gpu;
+        verbosity = params.verbosity;
+        n_threads_vision = params.cpuparams.n_threads;
+        t_last_active_ms = ggml_time_ms();
+
+        // defer loading when the projector's header tells us what it supports
+        if (probe_projector(mmproj_path, supports_vision, supports_audio)) {
+            LOG_INF("%s: projector will be loaded on first use (vision %d, audio %d)\n", __func__, supports_vision, supports_audio);
+            return;
+        }
+        if (!create_vision_context(params.cpuparams.n_threads)) {
             
             auto args = std::make_format_args(__func__, clip_path);
             std::string err=std::vformat(gErrMtmdLoadVisionModel, args);
@@ -131,6 +322,716 @@ struct mtmd_cli_context {
             lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
             throw std::runtime_error(err.c_str());
         }
+        supports_vision = mtmd_support_vision(ctx_vision.get());
+        supports_audio  = mtmd_support_audio(ctx_vision.get());
+    }
+
+    // reads which encoders a projector holds from its GGUF header only
+    static bool probe_projector(const std::string & path, bool & has_vision, bool & has_audio) {
+        gguf_init_params gparams = { /* no_alloc */ true, /* ctx */ nullptr };
+        gguf_context * gctx = gguf_init_from_file(path.c_str(), gparams);
+        if (!gctx) {
+            return false;
+        }
+        int64_t key_vision = gguf_find_key(gctx, "clip.has_vision_encoder");
+        int64_t key_audio  = gguf_find_key(gctx, "clip.has_audio_encoder");
+        bool found = key_vision >= 0 || key_audio >= 0;
+        has_vision = key_vision >= 0 && gguf_get_val_bool(gctx, key_vision);
+        has_audio  = key_audio  >= 0 && gguf_get_val_bool(gctx, key_audio);
+        gguf_free(gctx);
+        return found;
+    }
+
+    // the projector, loaded if needed, nullptr if it can't be, callers hold
+    // an activity so the idle thread doesn't unload it while in use
+    mtmd_context * vision() {
+        std::lock_guard<std::mutex> lock(vision_mutex);
+        if (!ctx_vision) {
+            LR_TRACE_SCOPE("load_projector");
+            const int64_t t_start_ms = ggml_time_ms();
+            if (!create_vision_context(n_threads_vision)) {
+                return nullptr;
+            }
+            LOG_INF("%s: projector loaded in %" PRId64 " ms\n", __func__, ggml_time_ms() - t_start_ms);
+        }
+        return ctx_vision.get();
+    }
+
+    // mtmd_tokenize on the projector, -1 if it can't be loaded
+    int32_t tokenize(mtmd_input_chunks * chunks, const mtmd_input_text * text,
+                     const mtmd_bitmap ** bitmaps, size_t n_bitmaps) {
+        mtmd_context * mctx = vision();
+        if (!mctx) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> encoding(encoder_mutex);
+        return mtmd_tokenize(mctx, chunks, text, bitmaps, n_bitmaps);
+    }
+
+    void unload_vision() {
+        std::lock_guard<std::mutex> lock(vision_mutex);
+        if (ctx_vision) {
+            ctx_vision.reset();
+            LOG_INF("%s: projector unloaded while idle\n", __func__);
+        }
+    }
+
+    // saves the KV cells of the conversations & frees the context's buffers,
+    // the whole state is saved so the sessions still share their cells
+    void release_context() {
+        LR_TRACE_SCOPE("release_context");
+        kv_saved.clear();
+        if (n_past > 0 || !sessions.empty()) {
+            kv_saved.resize(llama_state_get_size(lctx));
+            kv_saved.resize(llama_state_get_data(lctx, kv_saved.data(), kv_saved.size()));
+            kv_saved.shrink_to_fit();
+        }
+        llama_init.context.reset();
+        lctx = nullptr;
+        lctx_applied = nullptr;
+        context_released = true;
+        LOG_INF("%s: context released, %zu bytes of state kept for %d tokens\n", __func__, kv_saved.size(), n_past);
+    }
+
+    // rebuilds a released context & puts the conversation back
+    bool restore_context() {
+        LR_TRACE_SCOPE("restore_context");
+        const int64_t t_start_ms = ggml_time_ms();
+        cparams.n_threads       = n_threads;
+        cparams.n_threads_batch = n_threads;
+        llama_init.context.reset(llama_init_from_model(model, cparams));
+        lctx = llama_init.context.get();
+        if (!lctx) {
+            return false;
+        }
+        if (!lora_adapters.empty()) {
+            common_set_adapter_lora(lctx, lora_adapters);
+        }
+        if (!kv_saved.empty() &&
+            llama_state_set_data(lctx, kv_saved.data(), kv_saved.size()) != kv_saved.size()) {
+            LOG_WRN("%s: unable to restore the conversations, starting over\n", __func__);
+            llama_memory_clear(llama_get_memory(lctx), true);
+            n_sessions_lost += (int) sessions.size() + (n_past > 0 ? 1 : 0);
+            n_past = 0;
+            turns.clear();
+            sessions.clear();
+        }
+        // the conversation was cleared while released
+        if (n_past == 0) {
+            llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
+        }
+        kv_saved.clear();
+        kv_saved.shrink_to_fit();
+        context_released = false;
+        LOG_INF("%s: context restored in %" PRId64 " ms\n", __func__, ggml_time_ms() - t_start_ms);
+        return true;
+    }
+
+    // recreates the context with a new size, the model & projector are kept,
+    // as is the conversation if asked & it fits, otherwise it starts over
+    bool resize_context(uint32_t n_ctx, bool keep_history) {
+        LR_TRACE_SCOPE("resize_context", (int64_t) n_ctx);
+        const uint32_t n_ctx_old = llama_n_ctx(lctx);
+        const llama_pos n_past_old = n_past;
+        const std::vector<turn> turns_old = turns;
+
+        // a conversation that isn't kept is set aside in case the old context comes back
+        std::vector<uint8_t> kv_old;
+        if (n_past > 0 && (!keep_history || n_past >= (llama_pos) n_ctx)) {
+            kv_old.resize(llama_state_seq_get_size(lctx, 0));
+            kv_old.resize(llama_state_seq_get_data(lctx, kv_old.data(), kv_old.size(), 0));
+            llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
+            n_past = 0;
+            turns.clear();
+        }
+        release_context();
+        cparams.n_ctx = n_ctx;
+        if (restore_context()) {
+            fit_batch();
+            return true;
+        }
+
+        // put the old context back
+        LOG_WRN("%s: unable to create a context of %u tokens, keeping %u\n", __func__, n_ctx, n_ctx_old);
+        cparams.n_ctx = n_ctx_old;
+        if (restore_context()) {
+            fit_batch();
+            if (!kv_old.empty() &&
+                llama_state_seq_set_data(lctx, kv_old.data(), kv_old.size(), 0) == kv_old.size()) {
+                n_past = n_past_old;
+                turns  = turns_old;
+            }
+        }
+        return false;
+    }
+
+    // recreates the context with a sequence for every alternative response
+    // & conversation set aside, on one KV cache so copies share their cells,
+    // the conversations are carried over. Done on first use unless init was
+    // given as many sequences with a unified KV cache
+    bool reserve_sequences() {
+        const uint32_t n_seq = LR_MAX_RESPONSES + LR_MAX_SESSIONS;
+        if (llama_n_seq_max(lctx) >= n_seq) {
+            return true;
+        }
+        LR_TRACE_SCOPE("reserve_sequences", (int64_t) n_seq);
+        const uint32_t n_seq_old = cparams.n_seq_max;
+        const bool kv_unified_old = cparams.kv_unified;
+        release_context();
+        cparams.n_seq_max  = n_seq;
+        cparams.kv_unified = true;
+        if (restore_context()) {
+            LOG_INF("%s: context rebuilt with %u sequences\n", __func__, n_seq);
+            return true;
+        }
+
+        // put the old context back
+        LOG_WRN("%s: unable to create a context with %u sequences, keeping %u\n", __func__, n_seq, n_seq_old);
+        cparams.n_seq_max  = n_seq_old;
+        cparams.kv_unified = kv_unified_old;
+        restore_context();
+        return false;
+    }
+
+    // keeps the batch size within what the context takes, a smaller context
+    // takes smaller batches
+    void fit_batch() {
+        n_batch_full = std::min((int) cparams.n_batch, (int) llama_n_batch(lctx));
+        n_batch = std::min(n_batch, n_batch_full);
+    }
+
+    // marks the start of a turn, before its message is evaluated
+    void begin_turn() {
+        turn t;
+        t.n_past_prompt   = n_past;
+        t.n_past_response = n_past;
+        turns.push_back(t);
+    }
+
+    // marks where the turn's response starts, once its message is evaluated
+    void end_prompt() {
+        turns.back().n_past_response = n_past;
+        turns.back().prompt_token    = n_past > turns.back().n_past_prompt ? last_prompt_token : LLAMA_TOKEN_NULL;
+    }
+
+    // drops a turn whose message couldn't be evaluated & any cells it left
+    void discard_turn() {
+        llama_memory_seq_rm(llama_get_memory(lctx), 0, turns.back().n_past_prompt, -1);
+        n_past = turns.back().n_past_prompt;
+        turns.pop_back();
+    }
+
+    // remembers the last text token of a prompt, so its logits can be recomputed
+    void set_last_prompt_token(const mtmd_input_chunks * chunks) {
+        last_prompt_token = LLAMA_TOKEN_NULL;
+        const size_t n_chunks = mtmd_input_chunks_size(chunks);
+        if (n_chunks > 0) {
+            const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, n_chunks - 1);
+            size_t n_tokens = 0;
+            const llama_token * tokens = nullptr;
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+            }
+            if (n_tokens > 0) {
+                last_prompt_token = tokens[n_tokens - 1];
+            }
+        }
+    }
+
+    // whether the conversation can be cut back to pos, models with a sliding
+    // window only keep its last cells unless run with --swa-full
+    bool can_truncate(llama_pos pos) {
+        const int32_t n_swa = llama_model_n_swa(model);
+        if (pos >= n_past || n_swa <= 0) {
+            return true;
+        }
+        return llama_memory_seq_pos_min(llama_get_memory(lctx), 0) <= std::max(0, pos - n_swa);
+    }
+
+    // cuts the conversation back to pos, keeping n_turns turns, & rebuilds
+    // the session sampler's history from the responses that are left
+    bool truncate(llama_pos pos, size_t n_turns) {
+        if (!can_truncate(pos) || !llama_memory_seq_rm(llama_get_memory(lctx), 0, pos, -1)) {
+            return false;
+        }
+        n_past = pos;
+        turns.resize(n_turns);
+        if (!turns.empty() && turns.back().n_past_response >= pos) {
+            turns.back().response.clear();
+        }
+        common_sampler_reset(smpl);
+        accept_history(smpl);
+        response_tokens = turns.empty() ? llama_tokens() : turns.back().response;
+        return true;
+    }
+
+    // feeds the responses of every turn to a sampler, so its repetition
+    // penalties carry on from the conversation
+    void accept_history(common_sampler * s) const {
+        for (const turn & t : turns) {
+            for (llama_token token : t.response) {
+                common_sampler_accept(s, token, true);
+            }
+        }
+    }
+
+    // a free sequence for a session put aside, -1 if there are too many
+    llama_seq_id free_session_seq() const {
+        for (llama_seq_id seq = LR_MAX_RESPONSES; seq < LR_MAX_RESPONSES + LR_MAX_SESSIONS; seq++) {
+            bool used = false;
+            for (const auto & it : sessions) {
+                used = used || it.second.seq_id == seq;
+            }
+            if (!used) {
+                return seq;
+            }
+        }
+        return -1;
+    }
+
+    // puts a copy of the active conversation aside as session id in seq
+    void park_session(int id, llama_seq_id seq, const std::string & context, bool is_first_msg) {
+        llama_memory_t mem = llama_get_memory(lctx);
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        llama_memory_seq_cp(mem, 0, seq, -1, -1);
+        session & s = sessions[id];
+        s.seq_id = seq;
+        s.n_past = n_past;
+        s.turns  = turns;
+        s.smpl.reset(common_sampler_clone(smpl));
+        s.response_tokens = response_tokens;
+        s.context         = context;
+        s.is_first_msg    = is_first_msg;
+    }
+
+    // makes session id, put aside by park_session(), the active conversation
+    // again in place of the active one, which is dropped
+    void unpark_session(int id, std::string & context, bool & is_first_msg) {
+        session & s = sessions[id];
+        llama_memory_t mem = llama_get_memory(lctx);
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        llama_memory_seq_cp(mem, s.seq_id, 0, -1, -1);
+        llama_memory_seq_rm(mem, s.seq_id, -1, -1);
+
+        n_past = s.n_past;
+        turns.swap(s.turns);
+        common_sampler_free(smpl);
+        smpl = s.smpl.release();
+        response_tokens.swap(s.response_tokens);
+        context.swap(s.context);
+        is_first_msg = s.is_first_msg;
+        sessions.erase(id);
+    }
+
+    // drops a session put aside & its cells, callers hold an activity so the
+    // context is there to drop them from
+    void drop_session(int id) {
+        auto it = sessions.find(id);
+        if (it == sessions.end()) {
+            return;
+        }
+        llama_memory_seq_rm(llama_get_memory(lctx), it->second.seq_id, -1, -1);
+        sessions.erase(it);
+    }
+
+    // makes session id the active conversation & puts the active one aside
+    // in its place, the cells are swapped through a sequence only used
+    // during evaluate_and_respond_n()
+    void swap_session(int id, std::string & context, bool & is_first_msg) {
+        session & s = sessions[id];
+        llama_memory_t mem = llama_get_memory(lctx);
+        const llama_seq_id seq_tmp = 1;
+        llama_memory_seq_rm(mem, seq_tmp, -1, -1);
+        llama_memory_seq_cp(mem, 0, seq_tmp, -1, -1);
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        llama_memory_seq_cp(mem, s.seq_id, 0, -1, -1);
+        llama_memory_seq_rm(mem, s.seq_id, -1, -1);
+        llama_memory_seq_cp(mem, seq_tmp, s.seq_id, -1, -1);
+        llama_memory_seq_rm(mem, seq_tmp, -1, -1);
+
+        std::swap(n_past, s.n_past);
+        turns.swap(s.turns);
+        common_sampler * smpl_active = smpl;
+        smpl = s.smpl.release();
+        s.smpl.reset(smpl_active);
+        response_tokens.swap(s.response_tokens);
+        context.swap(s.context);
+        std::swap(is_first_msg, s.is_first_msg);
+
+        sessions[session_id] = std::move(s);
+        sessions.erase(id);
+        session_id = id;
+    }
+
+    // marks the engine busy for the lifetime of a call, nothing is released
+    // by the idle thread while any call is in progress & a context released
+    // while idle is rebuilt first, lctx stays null if that fails
+    struct activity {
+        mtmd_cli_context & ctx;
+        activity(mtmd_cli_context & c) : ctx(c) {
+            std::lock_guard<std::mutex> lock(ctx.idle_mutex);
+            ctx.n_active++;
+            if (ctx.context_released) {
+                ctx.restore_context();
+            }
+        }
+        ~activity() {
+            std::lock_guard<std::mutex> lock(ctx.idle_mutex);
+            ctx.n_active--;
+            ctx.t_last_active_ms = ggml_time_ms();
+        }
+    };
+
+    // runs the idle thread while any idle policy is set
+    void update_idle_thread() {
+        bool needed;
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            needed = projector_idle_secs > 0.0f || context_idle_secs > 0.0f;
+        }
+        if (needed && !idle_thread.joinable()) {
+            idle_running = true;
+            idle_thread = std::thread(&mtmd_cli_context::idle_loop, this);
+        } else if (!needed) {
+            stop_idle_thread();
+        }
+    }
+
+    void stop_idle_thread() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            idle_running = false;
+        }
+        idle_cv.notify_all();
+        if (idle_thread.joinable()) {
+            idle_thread.join();
+        }
+    }
+
+    // releases what has gone unused for longer than its idle period
+    void idle_loop() {
+        lr_trace_set_thread_name("idle");
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        while (idle_running) {
+            idle_cv.wait_for(lock, std::chrono::seconds(1));
+            if (!idle_running || n_active > 0) {
+                continue;
+            }
+            double idle_secs = (ggml_time_ms() - t_last_active_ms) / 1000.0;
+            if (projector_idle_secs > 0.0f && idle_secs >= projector_idle_secs) {
+                unload_vision();
+            }
+            if (context_idle_secs > 0.0f && idle_secs >= context_idle_secs) {
+                unload_vision();
+                if (!context_released && lctx) {
+                    release_context();
+                }
+            }
+        }
+    }
+
+    // loads an adapter for the base model, detached until given a scale
+    int load_adapter(const std::string & path) {
+        llama_adapter_lora_ptr adapter(llama_adapter_lora_init(model, path.c_str()));
+        if (!adapter) {
+            return -1;
+        }
+        common_adapter_lora_info info;
+        info.path  = path;
+        info.scale = 0.0f;
+        info.ptr   = adapter.get();
+        lora_loaded.push_back(std::move(adapter));
+        lora_adapters.push_back(info);
+        return (int) lora_adapters.size() - 1;
+    }
+
+    // applies adapters to the context, those with a scale of 0 are detached
+    void apply_adapters(std::vector<common_adapter_lora_info> & adapters) {
+        if (lctx) {
+            common_set_adapter_lora(lctx, adapters);
+        }
+    }
+
+    // applies adapter scales for a single request, the session's are put
+    // back when it goes out of scope, adapters without a scale are detached
+    struct adapter_override {
+        mtmd_cli_context & ctx;
+        bool active;
+        adapter_override(mtmd_cli_context & c, const float * scales, int n_scales) : ctx(c), active(scales != nullptr) {
+            if (!active) {
+                return;
+            }
+            std::vector<common_adapter_lora_info> adapters = ctx.lora_adapters;
+            for (size_t i = 0; i < adapters.size(); i++) {
+                adapters[i].scale = (int) i < n_scales ? scales[i] : 0.0f;
+            }
+            ctx.apply_adapters(adapters);
+        }
+        ~adapter_override() {
+            if (active) {
+                ctx.apply_adapters(ctx.lora_adapters);
+            }
+        }
+    };
+
+    // a sampler with the given settings & the rest as given at init
+    common_sampler * create_sampler(const lr_sampling & settings, common_params_sampling & sparams) {
+        sparams = sampling;
+        sparams.temp            = settings.temp;
+        sparams.top_k           = settings.top_k;
+        sparams.top_p           = settings.top_p;
+        sparams.min_p           = settings.min_p;
+        sparams.penalty_repeat  = settings.penalty_repeat;
+        sparams.penalty_freq    = settings.penalty_freq;
+        sparams.penalty_present = settings.penalty_present;
+        sparams.penalty_last_n  = settings.penalty_last_n;
+        sparams.seed            = settings.seed;
+        return common_sampler_init(model, sparams);
+    }
+
+    // called between the steps of a prefill with the chunks & tokens done so
+    // far out of the total, returns false to stop it
+    typedef std::function<bool(size_t n_chunks_done, size_t n_chunks, size_t n_tokens_done, size_t n_tokens)> prefill_fn;
+
+    // where a prefill is up to
+    struct prefill_state {
+        size_t n_chunks      = 1;
+        size_t n_tokens      = 0;
+        size_t n_chunks_done = 0;
+        size_t n_tokens_done = 0;
+        bool stopped         = false;
+    };
+
+    // adopts the thermal governor's thread count & batch size, only call it
+    // between decodes, clear lctx_applied to have the thread count set again
+    void apply_thermal() {
+        n_batch = thermal.scale(n_batch_full, std::min(n_batch_full, 32));
+        int n = thermal.scale(n_threads, 1);
+        if (lctx && (lctx != lctx_applied || n != n_threads_applied)) {
+            llama_set_n_threads(lctx, n, n);
+            if (lctx == lctx_applied) {
+                LOG_INF("%s: %d threads, batches of %d at %.1f C\n", __func__, n, n_batch, thermal.temperature());
+            }
+            lctx_applied = lctx;
+            n_threads_applied = n;
+        }
+    }
+
+    // paces decode while the system runs hot
+    void thermal_pause() {
+        float pause_ms = thermal.pause_ms();
+        if (pause_ms > 0.0f) {
+            LR_TRACE_SCOPE("thermal_pause");
+            std::this_thread::sleep_for(std::chrono::microseconds((int64_t) (pause_ms * 1000.0f)));
+        }
+    }
+
+    // decodes text tokens in sub-batches of n_batch, asking progress whether
+    // to go on after each one
+    int32_t decode_tokens(const llama_token * tokens, size_t n_tokens, llama_pos & pos, bool logits_last,
+                          prefill_state & state, const prefill_fn & progress) {
+        apply_thermal();
+        const size_t n_sub = (size_t) n_batch;
+        llama_batch text_batch = llama_batch_init(n_batch, 0, 1);
+        int32_t ret = 0;
+        for (size_t i = 0; i < n_tokens && ret == 0 && !state.stopped; i += n_sub) {
+            size_t n = std::min(n_tokens - i, n_sub);
+            if (i > 0) {
+                thermal_pause();
+            }
+            common_batch_clear(text_batch);
+            for (size_t j = 0; j < n; j++) {
+                common_batch_add(text_batch, tokens[i + j], pos + (llama_pos) j, {0}, logits_last && i + j == n_tokens - 1);
+            }
+            LR_TRACE_SCOPE("decode_text", (int64_t) n);
+            ret = llama_decode(lctx, text_batch);
+            if (ret == 0) {
+                pos += (llama_pos) n;
+                state.n_tokens_done += n;
+                state.stopped = !progress(state.n_chunks_done, state.n_chunks, state.n_tokens_done, state.n_tokens);
+            }
+        }
+        llama_batch_free(text_batch);
+        return ret;
+    }
+
+    // evaluates a prompt without media using the plain tokenizer, a prefill
+    // that fails or is stopped leaves the cache & pos as they were
+    int32_t eval_text(const std::string & prompt, bool add_bos, llama_pos & pos, const prefill_fn & progress) {
+        llama_tokens tokens;
+        {
+            LR_TRACE_SCOPE("tokenize");
+            tokens = common_tokenize(lctx, prompt, add_bos, true);
+        }
+        last_prompt_token = tokens.empty() ? LLAMA_TOKEN_NULL : tokens.back();
+        const llama_pos pos_start = pos;
+        prefill_state state;
+        state.n_tokens = tokens.size();
+        int32_t ret = decode_tokens(tokens.data(), tokens.size(), pos, true, state, progress);
+        if (ret != 0 || state.stopped) {
+            llama_memory_seq_rm(llama_get_memory(lctx), 0, pos_start, -1);
+            pos = pos_start;
+        }
+        return ret;
+    }
+
+    // evaluates chunks like mtmd_helper_eval_chunks, except that progress is
+    // asked whether to go on after each text sub-batch & each media chunk's
+    // encode & decode, a prefill that fails or is stopped leaves the cache &
+    // *new_n_past as they were
+    int32_t eval_chunks(const mtmd_input_chunks * chunks, llama_pos n_past_in, bool logits_last,
+                        llama_pos * new_n_past, const prefill_fn & progress) {
+        const size_t n_chunks = mtmd_input_chunks_size(chunks);
+        llama_pos pos = n_past_in;
+        prefill_state state;
+        state.n_chunks = n_chunks;
+        state.n_tokens = mtmd_helper_get_n_tokens(chunks);
+        int32_t ret = 0;
+        for (size_t i = 0; i < n_chunks && ret == 0 && !state.stopped; i++) {
+            const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, i);
+            state.n_chunks_done = i;
+            if (i > 0) {
+                thermal_pause();
+            }
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                size_t n_tokens = 0;
+                const llama_token * tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+                ret = decode_tokens(tokens, n_tokens, pos, logits_last && i == n_chunks - 1, state, progress);
+                continue;
+            }
+            std::lock_guard<std::mutex> encoding(encoder_mutex);
+            {
+                LR_TRACE_SCOPE("encode_chunk", (int64_t) mtmd_input_chunk_get_n_tokens(chunk));
+                ret = mtmd_encode_chunk(vision(), chunk);
+            }
+            if (ret != 0 ||
+                (state.stopped = !progress(i, n_chunks, state.n_tokens_done, state.n_tokens))) {
+                continue;
+            }
+            LR_TRACE_SCOPE("decode_chunk", (int64_t) mtmd_input_chunk_get_n_tokens(chunk));
+            llama_pos pos_next;
+            ret = mtmd_helper_decode_image_chunk(vision(), lctx, chunk, mtmd_get_output_embd(vision()),
+                                                 pos, 0, n_batch, &pos_next);
+            if (ret == 0) {
+                pos = pos_next;
+                state.n_tokens_done += mtmd_input_chunk_get_n_tokens(chunk);
+                state.stopped = !progress(i + 1, n_chunks, state.n_tokens_done, state.n_tokens);
+            }
+        }
+        if (ret != 0 || state.stopped) {
+            llama_memory_seq_rm(llama_get_memory(lctx), 0, n_past_in, -1);
+            pos = n_past_in;
+        }
+        *new_n_past = pos;
+        return ret;
+    }
+
+    bool create_vision_context(int n_threads_encoder) {
+        mtmd_context_params mparams = mtmd_context_params_default();
+        mparams.use_gpu = mmproj_use_gpu;
+        mparams.print_timings = true;
+        mparams.n_threads = n_threads_encoder;
+        mparams.verbosity = verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
+        ctx_vision.reset(mtmd_init_from_file(mmproj_path.c_str(), model, mparams));
+        n_threads_vision = n_threads_encoder;
+        return ctx_vision.get() != nullptr;
+    }
+
+    // the threads are fixed when the projector is created, so a loaded one
+    // picks them up the next time it is loaded rather than being reloaded
+    void set_vision_threads(int n_threads_encoder) {
+        std::lock_guard<std::mutex> lock(vision_mutex);
+        if (ctx_vision && n_threads_encoder != n_threads_vision) {
+            LOG_INF("%s: projector keeps %d threads until it is next loaded\n", __func__, n_threads_vision);
+        }
+        n_threads_vision = n_threads_encoder;
+    }
+
+    std::string format_chat(const common_chat_msg & msg) {
+        common_chat_templates_inputs tmpl_inputs;
+        tmpl_inputs.messages = {msg};
+        tmpl_inputs.add_generation_prompt = true;
+        tmpl_inputs.use_jinja = false; // jinja is buggy here
+        LR_TRACE_SCOPE("apply_template");
+        auto formatted_chat = common_chat_templates_apply(tmpls.get(), tmpl_inputs);
+        LOG_DBG("formatted_chat.prompt: %s\n", formatted_chat.prompt.c_str());
+        return formatted_chat.prompt;
+    }
+
+    void start_pipeline() {
+        pipeline_running = true;
+        encoder_thread = std::thread(&mtmd_cli_context::encoder_loop, this);
+    }
+
+    // stops the encoder thread, requests still queued are dropped
+    void stop_pipeline() {
+        {
+            std::lock_guard<std::mutex> lock(pipeline_mutex);
+            pipeline_running = false;
+            pipeline.clear();
+        }
+        pipeline_cv.notify_all();
+        if (encoder_thread.joinable()) {
+            encoder_thread.join();
+        }
+    }
+
+    void encoder_loop() {
+        lr_trace_set_thread_name("encoder");
+        while (true) {
+            std::shared_ptr<lr_pipeline_request> req;
+            {
+                std::unique_lock<std::mutex> lock(pipeline_mutex);
+                pipeline_cv.wait(lock, [this, &req] {
+                    for (auto & r : pipeline) {
+                        if (!r->encoded) {
+                            req = r;
+                            break;
+                        }
+                    }
+                    return !pipeline_running || req;
+                });
+                if (!pipeline_running) {
+                    return;
+                }
+            }
+
+            {
+                activity busy(*this);
+                LR_TRACE_SCOPE("encode_request", req->id);
+                mtmd_input_text text;
+                text.text          = req->prompt.c_str();
+                text.add_special   = req->add_bos;
+                text.parse_special = true;
+                req->chunks.ptr.reset(mtmd_input_chunks_init());
+                auto bitmaps_c_ptr = req->bitmaps.c_ptr();
+                req->status = tokenize(req->chunks.ptr.get(), &text, bitmaps_c_ptr.data(), bitmaps_c_ptr.size());
+                if (req->status == 0) {
+                    req->status = encode_media_chunks(req->chunks.ptr.get(), 0, req->chunks.size(), req->embd, req->offsets);
+                }
+                req->bitmaps.entries.clear();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(pipeline_mutex);
+                req->encoded = true;
+            }
+            pipeline_cv.notify_all();
+        }
+    }
+
+    // waits for the oldest queued request to be encoded & takes it off the queue
+    std::shared_ptr<lr_pipeline_request> next_request() {
+        std::unique_lock<std::mutex> lock(pipeline_mutex);
+        pipeline_cv.wait(lock, [this] {
+            return !pipeline_running || pipeline.empty() || pipeline.front()->encoded;
+        });
+        if (!pipeline_running || pipeline.empty()) {
+            return nullptr;
+        }
+        auto req = pipeline.front();
+        pipeline.pop_front();
+        return req;
     }
 
     bool check_antiprompt(const llama_tokens & generated_tokens) {
@@ -145,87 +1046,483 @@ struct mtmd_cli_context {
     }
 
     bool load_media(const std::string & fname) {
-        mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(ctx_vision.get(), fname.c_str()));
+        return add_bitmap(mtmd::bitmap(mtmd_helper_bitmap_init_from_file(vision(), fname.c_str())));
+    }
+
+    // queues a decoded bitmap for the next message
+    bool add_bitmap(mtmd::bitmap && bmp, bool fit_budget = true) {
         if (!bmp.ptr) {
             return false;
         }
+        if (use_vad && mtmd_bitmap_is_audio(bmp.ptr.get())) {
+            trim_audio(bmp);
+        }
+        if (fit_budget && !mtmd_bitmap_is_audio(bmp.ptr.get())) {
+            fit_image(bmp);
+        }
         bitmaps.entries.push_back(std::move(bmp));
+        media.push_back(nullptr);
         return true;
     }
-};
 
-/**
- * @brief Constructor
- *
- */
-lr_mtmd_cli::lr_mtmd_cli() {
-    
-    _vctx=NULL;
-    _is_generating=false;
-    _is_interrupted=false;
-    _is_first_msg=false;
-    _n_predict=0;
-    lr_mtmd_cli_callback=NULL;
-    _context="";
-}
+    // decodes media files on a pool of worker threads, each worker takes the
+    // next file not yet claimed, returns the number of workers used
+    int decode_files(char * paths[], int n, std::vector<mtmd::bitmap> & out) {
+        out.clear();
+        out.resize(n);
+        std::atomic<int> next(0);
 
-/**
- * @brief Destructor
- *
- */
-lr_mtmd_cli::~lr_mtmd_cli() {
-    
-    deinit();
-}
+        auto worker = [&]() {
+            int ind;
+            while ((ind = next++) < n) {
+                LR_TRACE_SCOPE("decode_media", ind);
+                if (is_valid_string(paths[ind])) {
+                    out[ind].ptr.reset(mtmd_helper_bitmap_init_from_file(vision(), paths[ind]));
+                }
+            }
+        };
 
-/**
- * @brief Initializes this adapter
- *
- * @param argv - the arguments for llama.cpp
- * @param argc - the count of arguments for llama.cpp
- * @param is_vision_supported - (returned) whether vision is supported
- * @param is_audio_supported - (returned) whether audio is supported
- * @param user_callback - callback function for receiving events
- *
- * @return The status of the operation
- */
-int lr_mtmd_cli::init(char *argv[],
-                      int argc,
-                      bool *is_vision_supported,
-                      bool *is_audio_supported,
-                      bool (*user_callback)(void *,LlamarattiEvent, const char *)) {
-    
-#if 1
-    dump_params(argc,argv);
-#endif
-    
-    // Did the user provide their own callback?
-    if ( user_callback ) {
-        // Yes, use it
-        lr_mtmd_cli_callback = user_callback;
-        LOG_INF("Using user-supplied events callback\n");
-        
-    } else {
-        // No, use default
-        lr_mtmd_cli_callback = default_lr_mtmd_cli_callback;
-        LOG_INF("Using default events callback\n");
+        int n_workers = std::min(n, std::max(1, (int) std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+        for (int ind = 1; ind < n_workers; ind++) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (std::thread & t : workers) {
+            t.join();
+        }
+        return n_workers;
     }
 
-    // Did we get the parameters we need?
-    if ( argv == NULL ||
-         argc < 3 ||
-         is_vision_supported == NULL ||
-         is_audio_supported == NULL ) {
-        
-        // No, outta here...
-        auto args = std::make_format_args(__func__);
-        std::string err=std::vformat(gErrMtmdParams, args);
-        LOG_ERR("%s\n", err.c_str());
-        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+    // mean pooled embedding of one bitmap, decoded on its own in sequence 0 of
+    // ectx, averaged over the media chunks weighted by their token counts
+    bool embed_media(llama_context * ectx, const mtmd_bitmap * bmp, std::vector<float> & embd) {
+        mtmd_input_text text;
+        text.text          = mtmd_default_marker();
+        text.add_special   = false;
+        text.parse_special = true;
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        std::lock_guard<std::mutex> encoding(encoder_mutex);
+        if (mtmd_tokenize(vision(), chunks.ptr.get(), &text, &bmp, 1)) {
+            return false;
+        }
 
-        return GGML_STATUS_FAILED;
+        const size_t n_embd = llama_model_n_embd(model);
+        embd.assign(n_embd, 0.0f);
+        size_t n_total = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const mtmd_input_chunk * chunk = chunks[i];
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                continue;
+            }
+            // the whole chunk has to be pooled in a single decode
+            size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+            if (n_tokens > LR_EMBD_MAX_TOKENS) {
+                LOG_ERR("%s: media chunk of %zu tokens exceeds %d\n", __func__, n_tokens, LR_EMBD_MAX_TOKENS);
+                return false;
+            }
+            llama_pos new_n_past;
+            if (mtmd_encode_chunk(vision(), chunk) ||
+                mtmd_helper_decode_image_chunk(vision(), ectx, chunk, mtmd_get_output_embd(vision()),
+                                               0, 0, LR_EMBD_MAX_TOKENS, &new_n_past)) {
+                return false;
+            }
+            const float * pooled = llama_get_embeddings_seq(ectx, 0);
+            if (!pooled) {
+                return false;
+            }
+            for (size_t k = 0; k < n_embd; k++) {
+                embd[k] += pooled[k] * n_tokens;
+            }
+            n_total += n_tokens;
+            llama_memory_clear(llama_get_memory(ectx), true);
+        }
+        if (n_total == 0) {
+            return false;
+        }
+        for (float & v : embd) {
+            v /= n_total;
+        }
+        return true;
     }
-    
+
+    // keeps a running average of the prefill cost, short prompts are too noisy
+    void update_prefill_rate(size_t n_tokens, int64_t t_ms) {
+        if (n_tokens < 64 || t_ms <= 0) {
+            return;
+        }
+        double rate = (double) t_ms / n_tokens;
+        prefill_ms_per_token = prefill_ms_per_token > 0.0 ? 0.7 * prefill_ms_per_token + 0.3 * rate : rate;
+    }
+
+    // the most tokens an image may use, 0 for no limit
+    size_t image_token_budget() {
+        size_t budget = image_max_tokens;
+        if (image_max_latency_ms > 0.0f && prefill_ms_per_token > 0.0) {
+            size_t n_latency = std::max((size_t) 1, (size_t) (image_max_latency_ms / prefill_ms_per_token));
+            budget = budget ? std::min(budget, n_latency) : n_latency;
+        }
+        return budget;
+    }
+
+    // downscales an image until it fits the token budget, for models whose
+    // token count doesn't depend on the image size it is left unchanged
+    void fit_image(mtmd::bitmap & bmp) {
+        uint32_t nx = mtmd_bitmap_get_nx(bmp.ptr.get());
+        uint32_t ny = mtmd_bitmap_get_ny(bmp.ptr.get());
+        size_t budget = image_token_budget();
+
+        // without a budget the token count is only worked out when asked for
+        last_image_nx     = nx;
+        last_image_ny     = ny;
+        last_image_tokens = 0;
+        if (budget == 0) {
+            return;
+        }
+
+        size_t n_tokens = image_tokens(bmp.ptr.get());
+        if (n_tokens > budget) {
+            const unsigned char * src = mtmd_bitmap_get_data(bmp.ptr.get());
+            std::vector<unsigned char> rgb;
+            mtmd::bitmap fitted;
+            size_t n_fitted = n_tokens;
+
+            // tokens grow with the area, so start from the square root of the ratio
+            double scale = sqrt((double) budget / n_tokens);
+            for (int attempt = 0; attempt < LR_IMAGE_FIT_ATTEMPTS && n_fitted > budget; attempt++, scale *= 0.85) {
+                uint32_t sx = std::min(nx, std::max((uint32_t) LR_IMAGE_MIN_SIDE, (uint32_t) (nx * scale)));
+                uint32_t sy = std::min(ny, std::max((uint32_t) LR_IMAGE_MIN_SIDE, (uint32_t) (ny * scale)));
+                if (!lr_downscale_rgb(src, nx, ny, sx, sy, rgb)) {
+                    break;
+                }
+                mtmd::bitmap candidate(sx, sy, rgb.data());
+                size_t n_candidate = candidate.ptr ? image_tokens(candidate.ptr.get()) : 0;
+                if (n_candidate == 0 || n_candidate >= n_fitted) {
+                    break;
+                }
+                fitted.ptr = std::move(candidate.ptr);
+                n_fitted = n_candidate;
+                if (sx == LR_IMAGE_MIN_SIDE || sy == LR_IMAGE_MIN_SIDE) {
+                    break;
+                }
+            }
+
+            if (fitted.ptr) {
+                LOG_INF("%s: image %ux%u (%zu tokens) downscaled to %ux%u (%zu tokens), budget %zu\n", __func__,
+                        nx, ny, n_tokens, mtmd_bitmap_get_nx(fitted.ptr.get()), mtmd_bitmap_get_ny(fitted.ptr.get()), n_fitted, budget);
+                bmp.ptr = std::move(fitted.ptr);
+                n_tokens = n_fitted;
+            } else {
+                LOG_WRN("%s: image %ux%u (%zu tokens) can't be fitted to %zu tokens\n", __func__, nx, ny, n_tokens, budget);
+            }
+        }
+
+        last_image_nx     = mtmd_bitmap_get_nx(bmp.ptr.get());
+        last_image_ny     = mtmd_bitmap_get_ny(bmp.ptr.get());
+        last_image_tokens = n_tokens;
+    }
+
+    // replaces an audio bitmap with its speech-only samples
+    void trim_audio(mtmd::bitmap & bmp) {
+        int rate = mtmd_get_audio_bitrate(vision());
+        const float * pcm = (const float *) mtmd_bitmap_get_data(bmp.ptr.get());
+        size_t n_samples = mtmd_bitmap_get_nx(bmp.ptr.get());
+        std::vector<float> speech;
+        if (rate <= 0 || lr_vad_trim(pcm, n_samples, rate, vad, speech) == 0) {
+            LOG_WRN("%s: no speech detected, keeping all %zu samples\n", __func__, n_samples);
+            return;
+        }
+        vad_secs_in  += (double) n_samples / rate;
+        vad_secs_out += (double) speech.size() / rate;
+        bmp.ptr.reset(mtmd_bitmap_init_from_audio(speech.size(), speech.data()));
+    }
+
+    // number of tokens a bitmap will occupy once encoded, without encoding it
+    size_t image_tokens(const mtmd_bitmap * bmp) {
+        auto key = std::make_pair(mtmd_bitmap_get_nx(bmp), mtmd_bitmap_get_ny(bmp));
+        auto it = image_token_cache.find(key);
+        if (it != image_token_cache.end()) {
+            return it->second;
+        }
+        mtmd_input_text text;
+        text.text          = mtmd_default_marker();
+        text.add_special   = false;
+        text.parse_special = true;
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        if (tokenize(chunks.ptr.get(), &text, &bmp, 1)) {
+            return 0;
+        }
+        size_t n_tokens = mtmd_helper_get_n_tokens(chunks.ptr.get());
+        image_token_cache[key] = n_tokens;
+        return n_tokens;
+    }
+
+    static size_t count_audio_tokens(const mtmd_input_chunks * chunks) {
+        size_t n_tokens = 0;
+        for (size_t i = 0; i < mtmd_input_chunks_size(chunks); i++) {
+            const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, i);
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_AUDIO) {
+                n_tokens += mtmd_input_chunk_get_n_tokens(chunk);
+            }
+        }
+        return n_tokens;
+    }
+
+    // encodes the media chunks in [first, last) back to back into one buffer,
+    // offsets[i] locates the embeddings of chunk i
+    int32_t encode_media_chunks(const mtmd_input_chunks * chunks, size_t first, size_t last,
+                                std::vector<float> & embd, std::vector<size_t> & offsets) {
+        const size_t n_embd = llama_model_n_embd(model);
+
+        offsets.resize(mtmd_input_chunks_size(chunks), 0);
+        size_t n_floats = 0;
+        for (size_t i = first; i < last; i++) {
+            const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, i);
+            if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                offsets[i] = n_floats;
+                n_floats += mtmd_input_chunk_get_n_tokens(chunk) * n_embd;
+            }
+        }
+        embd.resize(n_floats);
+
+        for (size_t i = first; i < last; i++) {
+            const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, i);
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                continue;
+            }
+            LR_TRACE_SCOPE("encode_chunk", (int64_t) mtmd_input_chunk_get_n_tokens(chunk));
+            std::lock_guard<std::mutex> encoding(encoder_mutex);
+            int32_t ret = mtmd_encode_chunk(vision(), chunk);
+            if (ret) {
+                LOG_ERR("%s: failed to encode chunk %zu\n", __func__, i);
+                return ret;
+            }
+            memcpy(embd.data() + offsets[i], mtmd_get_output_embd(vision()),
+                   mtmd_input_chunk_get_n_tokens(chunk) * n_embd * sizeof(float));
+        }
+        return 0;
+    }
+
+    // decodes the chunks in [first, last) into the KV cache, media chunks from
+    // the embeddings produced by encode_media_chunks, the helpers only read the
+    // projector's settings so this runs alongside the encoder thread
+    int32_t decode_chunks(const mtmd_input_chunks * chunks, size_t first, size_t last,
+                          std::vector<float> & embd, const std::vector<size_t> & offsets,
+                          llama_pos & pos, bool logits_last) {
+        const size_t n_chunks = mtmd_input_chunks_size(chunks);
+        for (size_t i = first; i < last; i++) {
+            const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, i);
+            LR_TRACE_SCOPE("decode_chunk", (int64_t) mtmd_input_chunk_get_n_tokens(chunk));
+            llama_pos pos_next;
+            int32_t ret;
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                ret = mtmd_helper_eval_chunk_single(vision(), lctx, chunk, pos, 0, n_batch,
+                                                    logits_last && i == n_chunks - 1, &pos_next);
+            } else {
+                ret = mtmd_helper_decode_image_chunk(vision(), lctx, chunk, embd.data() + offsets[i],
+                                                     pos, 0, n_batch, &pos_next);
+            }
+            if (ret) {
+                return ret;
+            }
+            pos = pos_next;
+        }
+        return 0;
+    }
+
+    bool load_audio_stream(const std::string & fname, float window_secs) {
+        int rate = mtmd_get_audio_bitrate(vision());
+        if (rate <= 0) {
+            return false;
+        }
+        auto stream = std::make_shared<lr_audio_stream>();
+        if (!stream->open(fname, rate, window_secs)) {
+            return false;
+        }
+        LOG_INF("%s: streaming '%s' in %zu windows of %.1fs\n", __func__, fname.c_str(), stream->n_windows(), window_secs);
+        media.push_back(std::move(stream));
+        return true;
+    }
+
+    // everything a response depends on: the model files & how they were
+    // loaded, the adapters, the sampler settings, the stop strings, the
+    // media & the formatted prompt
+    std::string response_key(const std::string & prompt, const lr_sampling & settings,
+                             const float * adapter_scales, int n_adapter_scales, bool add_bos) {
+        std::string key;
+        auto put = [&key](const void * data, size_t len) {
+            key.append((const char *) data, len);
+        };
+        auto put_str = [&](const std::string & str) {
+            uint32_t len = (uint32_t) str.size();
+            put(&len, sizeof(len));
+            key += str;
+        };
+        uint32_t n_args = (uint32_t) init_args.size();
+        put(&n_args, sizeof(n_args));
+        for (const auto & arg : init_args) {
+            put_str(arg);
+        }
+        for (const std::string & path : { model_path, mmproj_path }) {
+            struct stat st;
+            int64_t file_id[2] = { 0, 0 };
+            if (stat(path.c_str(), &st) == 0) {
+                file_id[0] = (int64_t) st.st_size;
+                file_id[1] = (int64_t) st.st_mtime;
+            }
+            put(file_id, sizeof(file_id));
+        }
+        for (size_t i = 0; i < lora_adapters.size(); i++) {
+            float scale = lora_adapters[i].scale;
+            if (adapter_scales) {
+                scale = (int) i < n_adapter_scales ? adapter_scales[i] : 0.0f;
+            }
+            put_str(lora_adapters[i].path);
+            put(&scale, sizeof(scale));
+        }
+        const float settings_f[] = { settings.temp, settings.top_p, settings.min_p,
+                                     settings.penalty_repeat, settings.penalty_freq, settings.penalty_present };
+        const int64_t settings_i[] = { settings.top_k, settings.penalty_last_n, settings.n_predict,
+                                       (int64_t) settings.seed, add_bos ? 1 : 0 };
+        put(settings_f, sizeof(settings_f));
+        put(settings_i, sizeof(settings_i));
+        uint32_t n_stop = (uint32_t) stop.patterns().size();
+        put(&n_stop, sizeof(n_stop));
+        for (const auto & pattern : stop.patterns()) {
+            put_str(pattern);
+        }
+        uint32_t n_bitmaps = (uint32_t) bitmaps.entries.size();
+        put(&n_bitmaps, sizeof(n_bitmaps));
+        for (const auto & bmp : bitmaps.entries) {
+            const mtmd_bitmap * b = bmp.ptr.get();
+            const uint64_t media_id[4] = { mtmd_bitmap_is_audio(b) ? 1u : 0u, mtmd_bitmap_get_nx(b), mtmd_bitmap_get_ny(b),
+                                           lr_record_hash(mtmd_bitmap_get_data(b), mtmd_bitmap_get_n_bytes(b)) };
+            put(media_id, sizeof(media_id));
+        }
+        put_str(prompt);
+        return key;
+    }
+
+    bool has_streams() const {
+        for (const auto & m : media) {
+            if (m) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void clear_media() {
+        for (auto & m : media) {
+            if (m) {
+                m->cancel();
+            }
+        }
+        media.clear();
+        bitmaps.entries.clear();
+        vad_secs_in = 0.0;
+        vad_secs_out = 0.0;
+    }
+};
+
+/**
+ * @brief Checks sampler settings are in range
+ *
+ * @param sampling the settings
+ *
+ * @return whether the settings are valid
+ */
+static bool is_valid_sampling(const lr_sampling &sampling) {
+    
+    return sampling.temp >= 0.0f &&
+           sampling.top_p >= 0.0f && sampling.top_p <= 1.0f &&
+           sampling.min_p >= 0.0f && sampling.min_p <= 1.0f &&
+           sampling.penalty_repeat > 0.0f &&
+           sampling.penalty_last_n >= -1 &&
+           sampling.n_predict != 0 && sampling.n_predict >= -1;
+}
+
+/**
+ * @brief Constructor
+ *
+ */
+lr_mtmd_cli::lr_mtmd_cli() {
+    
+    _vctx=NULL;
+    _is_generating=false;
+    _is_interrupted=false;
+    _is_first_msg=false;
+    _n_predict=0;
+    _vad_secs_saved=0.0f;
+    _vad_tokens_saved=0;
+    lr_mtmd_cli_callback=NULL;
+    _context="";
+}
+
+/**
+ * @brief Destructor
+ *
+ */
+lr_mtmd_cli::~lr_mtmd_cli() {
+    
+    deinit();
+}
+
+/**
+ * @brief Initializes this adapter
+ *
+ * evaluate_and_respond_n(), evaluate_and_respond_once() & fork_session()
+ * need LR_MAX_RESPONSES + LR_MAX_SESSIONS sequences on a unified KV
+ * cache, the context is rebuilt with them the first time one is called.
+ * Pass --parallel 48 --kv-unified to create it with them instead. The KV
+ * cache keeps its size, but the logits buffer grows by a row of the
+ * vocabulary per sequence, around 29 MB for a 150k token vocabulary.
+ *
+ * @param argv - the arguments for llama.cpp
+ * @param argc - the count of arguments for llama.cpp
+ * @param is_vision_supported - (returned) whether vision is supported
+ * @param is_audio_supported - (returned) whether audio is supported
+ * @param user_callback - callback function for receiving events
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::init(char *argv[],
+                      int argc,
+                      bool *is_vision_supported,
+                      bool *is_audio_supported,
+                      bool (*user_callback)(void *,LlamarattiEvent, const char *)) {
+    
+#if 1
+    dump_params(argc,argv);
+#endif
+    
+    // Did the user provide their own callback?
+    if ( user_callback ) {
+        // Yes, use it
+        lr_mtmd_cli_callback = user_callback;
+        LOG_INF("Using user-supplied events callback\n");
+        
+    } else {
+        // No, use default
+        lr_mtmd_cli_callback = default_lr_mtmd_cli_callback;
+        LOG_INF("Using default events callback\n");
+    }
+
+    // Did we get the parameters we need?
+    if ( argv == NULL ||
+         argc < 3 ||
+         is_vision_supported == NULL ||
+         is_audio_supported == NULL ) {
+        
+        // No, outta here...
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+
+        return GGML_STATUS_FAILED;
+    }
+    
     _is_interrupted = false;
     
     ggml_time_init();
@@ -270,52 +1567,3336 @@ int lr_mtmd_cli::init(char *argv[],
     }
     
     mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    ctx->init_args.assign(argv, argv + argc);
     
     // Initialize instance members
     _n_predict = params.n_predict < 0 ? INT_MAX : params.n_predict;
     _is_first_msg = true;
     _context.clear();
     
-    *is_vision_supported = mtmd_support_vision(ctx->ctx_vision.get());
-    *is_audio_supported = mtmd_support_audio(ctx->ctx_vision.get());
+    *is_vision_supported = ctx->supports_vision;
+    *is_audio_supported = ctx->supports_audio;
+    
+    LOG_INF("Successfully initialized\n");
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Uninitializes this adapter
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::deinit() {
+    
+    if ( _vctx ) {
+        
+        // Cast to required mtmd_cli_context
+        mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+        delete ctx;
+        _vctx=ctx=NULL;
+        LOG_INF("Successfully uninitialized\n");
+    }
+    return GGML_STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Evaluates a chat message
+ *
+ * @param vmsg pointer to a mtmd_cli_context structure
+ * @param add_bos add
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::eval_message(void *vmsg, bool add_bos/* = false*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx || !vmsg ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Cast to required common_chat_msg
+    common_chat_msg *msg=(common_chat_msg *)vmsg;
+    
+    // Use the threads & batch size the temperature allows
+    ctx->apply_thermal();
+    
+    std::string formatted_prompt = ctx->format_chat(*msg);
+
+    mtmd_input_text text;
+    text.text          = formatted_prompt.c_str();
+    text.add_special   = add_bos;
+    text.parse_special = true;
+
+    // Were we stopped before we started? The caller drops the turn
+    if (_is_interrupted) {
+        lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+        return GGML_STATUS_ABORTED;
+    }
+    
+    // Is any of the media streamed?
+    if (ctx->has_streams()) {
+        if ( !load_projector() ) {
+            return GGML_STATUS_FAILED;
+        }
+        int ret = eval_segmented(formatted_prompt, add_bos);
+        ctx->clear_media();
+        if (ret == GGML_STATUS_SUCCESS) {
+            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+        }
+        return ret;
+    }
+    
+    // Text only turns don't need the projector
+    if (ctx->bitmaps.entries.empty() && ctx->media.empty()) {
+        
+        llama_pos new_n_past = ctx->n_past;
+        const int64_t t_eval_ms = ggml_time_ms();
+        const int64_t t_prefill_us = ggml_time_us();
+        int32_t res = ctx->eval_text(formatted_prompt, add_bos, new_n_past,
+                                     [&](size_t n_chunks_done, size_t n_chunks, size_t n_tokens_done, size_t n_tokens) {
+            return prefill_progress(n_chunks_done, n_chunks, n_tokens_done, n_tokens, t_prefill_us);
+        });
+        if (res) {
+            
+            auto args = std::make_format_args(__func__, res);
+            std::string err=std::vformat(gErrMtmdEvalPrompt, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            
+            return res;
+        }
+        
+        // Were we stopped part way through? The partial prompt is already gone,
+        // the caller drops the turn
+        if (_is_interrupted) {
+            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+            return GGML_STATUS_ABORTED;
+        }
+        
+        ctx->update_prefill_rate((size_t)(new_n_past - ctx->n_past), ggml_time_ms() - t_eval_ms);
+        ctx->n_past = new_n_past;
+        
+        lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+        
+        return GGML_STATUS_SUCCESS;
+    }
+    
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    mtmd::input_chunks chunks(mtmd_input_chunks_init());
+    auto bitmaps_c_ptr = ctx->bitmaps.c_ptr();
+    lr_trace_span trace_tokenize("tokenize");
+    int32_t res = ctx->tokenize(chunks.ptr.get(), // output
+                                &text, // text
+                                bitmaps_c_ptr.data(),
+                                bitmaps_c_ptr.size());
+    trace_tokenize.end();
+    if (res) {
+        
+        auto args = std::make_format_args(__func__, res);
+        std::string err=std::vformat(gErrMtmdTokenize, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+
+        return res;
+    }
+
+    if (ctx->use_vad) {
+        report_vad_savings(mtmd_cli_context::count_audio_tokens(chunks.ptr.get()));
+    }
+    ctx->set_last_prompt_token(chunks.ptr.get());
+    ctx->clear_media();
+
+    const size_t n_prompt_tokens = mtmd_helper_get_n_tokens(chunks.ptr.get());
+    const int64_t t_eval_ms = ggml_time_ms();
+    LR_TRACE_SCOPE("eval_chunks", (int64_t) n_prompt_tokens);
+    llama_pos new_n_past;
+    const int64_t t_prefill_us = ggml_time_us();
+    res = ctx->eval_chunks(chunks.ptr.get(), ctx->n_past, true, &new_n_past,
+                           [&](size_t n_chunks_done, size_t n_chunks, size_t n_tokens_done, size_t n_tokens) {
+        return prefill_progress(n_chunks_done, n_chunks, n_tokens_done, n_tokens, t_prefill_us);
+    });
+    if (res) {
+        
+        auto args = std::make_format_args(__func__, res);
+        std::string err=std::vformat(gErrMtmdEvalPrompt, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return res;
+    }
+    
+    // Were we stopped part way through? The partial prompt is already gone,
+    // the caller drops the turn
+    if (_is_interrupted) {
+        lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+        return GGML_STATUS_ABORTED;
+    }
+
+    ctx->n_past = new_n_past;
+    ctx->update_prefill_rate(n_prompt_tokens, ggml_time_ms() - t_eval_ms);
+
+    lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Evaluates a formatted prompt one media marker at a time
+ *
+ * Each marker is tokenized & evaluated with its own media, so streamed
+ * audio is encoded window by window while the next window is decoded
+ * in the background. Only the decoded windows waiting for the encoder
+ * are held in memory.
+ *
+ * @param prompt the formatted chat prompt
+ * @param add_bos whether to add the BOS token
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::eval_segmented(const std::string &prompt, bool add_bos) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    const std::string marker = mtmd_default_marker();
+    const llama_pos n_past_start = ctx->n_past;
+    
+    size_t bitmap_idx = 0;
+    size_t media_idx = 0;
+    size_t pos = 0;
+    size_t n_audio_tokens = 0;
+    bool add_special = add_bos;
+    int32_t res = 0;
+    
+    // Tokenizes & evaluates some text together with (at most) one bitmap
+    auto eval_piece = [&](const std::string & piece, const mtmd_bitmap * bmp, bool logits_last) -> int32_t {
+        
+        LR_TRACE_SCOPE("eval_piece");
+        
+        mtmd_input_text text;
+        text.text          = piece.c_str();
+        text.add_special   = add_special;
+        text.parse_special = true;
+        add_special = false;
+        
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        int32_t ret = ctx->tokenize(chunks.ptr.get(),
+                                    &text,
+                                    &bmp,
+                                    bmp ? 1 : 0);
+        if (ret) {
+            auto args = std::make_format_args(__func__, ret);
+            std::string err=std::vformat(gErrMtmdTokenize, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            return ret;
+        }
+        n_audio_tokens += mtmd_cli_context::count_audio_tokens(chunks.ptr.get());
+        ctx->set_last_prompt_token(chunks.ptr.get());
+        
+        // The total isn't known up front for streamed audio, so only check for a stop
+        llama_pos new_n_past;
+        ret = ctx->eval_chunks(chunks.ptr.get(), ctx->n_past, logits_last, &new_n_past,
+                               [&](size_t, size_t, size_t, size_t) {
+            return !_is_interrupted;
+        });
+        if (ret) {
+            auto args = std::make_format_args(__func__, ret);
+            std::string err=std::vformat(gErrMtmdEvalPrompt, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            return ret;
+        }
+        ctx->n_past = new_n_past;
+        return 0;
+    };
+    
+    size_t found;
+    while ( res == 0 &&
+            media_idx < ctx->media.size() &&
+            (found = prompt.find(marker, pos)) != std::string::npos ) {
+        
+        std::string piece = prompt.substr(pos, found - pos) + marker;
+        pos = found + marker.size();
+        
+        std::shared_ptr<lr_audio_stream> stream = ctx->media[media_idx++];
+        
+        // Is this a bitmap that is already loaded?
+        if ( !stream ) {
+            if ( bitmap_idx >= ctx->bitmaps.entries.size() ) {
+                res = GGML_STATUS_FAILED;
+                break;
+            }
+            res = eval_piece(piece, ctx->bitmaps.entries[bitmap_idx++].ptr.get(), false);
+            continue;
+        }
+        
+        // No, encode each window as soon as it has been decoded
+        std::vector<float> pcm;
+        std::vector<float> speech;
+        std::string text = piece.substr(0, piece.size() - marker.size());
+        size_t n_read = 0;
+        size_t n_encoded = 0;
+        int rate = mtmd_get_audio_bitrate(ctx->vision());
+        while ( res == 0 && stream->next_window(pcm) ) {
+            
+            if ( _is_interrupted ) {
+                res = GGML_STATUS_ABORTED;
+                break;
+            }
+            n_read++;
+            
+            // Skip windows that hold no speech at all
+            const std::vector<float> *samples = &pcm;
+            if ( ctx->use_vad ) {
+                lr_vad_trim(pcm.data(), pcm.size(), rate, ctx->vad, speech);
+                ctx->vad_secs_in  += (double)pcm.size() / rate;
+                ctx->vad_secs_out += (double)speech.size() / rate;
+                if ( speech.empty() ) {
+                    continue;
+                }
+                samples = &speech;
+            }
+            
+            mtmd::bitmap bmp(mtmd_bitmap_init_from_audio(samples->size(), samples->data()));
+            if ( !bmp.ptr ) {
+                res = GGML_STATUS_ALLOC_FAILED;
+                break;
+            }
+            
+            // The first encoded window carries the text preceding the marker
+            res = eval_piece(text + marker, bmp.ptr.get(), false);
+            text.clear();
+            n_encoded++;
+            
+            LOG_DBG("%s: encoded window %zu/%zu of '%s'\n", __func__, n_read, stream->n_windows(), stream->path().c_str());
+        }
+        
+        // Did we fail to produce any audio?
+        if ( res == 0 && n_read == 0 && !_is_interrupted ) {
+            auto args = std::make_format_args(__func__, stream->path());
+            std::string err=std::vformat(gErrMtmdLoadAudioStream, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            res = GGML_STATUS_FAILED;
+        }
+        
+        // Was every window silent? Keep the text that surrounded the audio
+        if ( res == 0 && n_encoded == 0 && !text.empty() && !_is_interrupted ) {
+            LOG_WRN("%s: no speech detected in '%s'\n", __func__, stream->path().c_str());
+            res = eval_piece(text, NULL, false);
+        }
+    }
+    
+    // Evaluate the remaining text & request logits for the last token
+    if ( res == 0 && !_is_interrupted ) {
+        res = eval_piece(prompt.substr(pos), NULL, true);
+    }
+    
+    // Did we stop part way through? Drop the partial prompt from the KV cache
+    if ( res != 0 || _is_interrupted ) {
+        llama_memory_t mem = llama_get_memory(ctx->lctx);
+        if ( mem ) {
+            llama_memory_seq_rm(mem, 0, n_past_start, -1);
+        }
+        ctx->n_past = n_past_start;
+        
+        // The caller drops the turn
+        if ( _is_interrupted ) {
+            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+            return GGML_STATUS_ABORTED;
+        }
+        return res;
+    }
+    
+    if ( ctx->use_vad ) {
+        report_vad_savings(n_audio_tokens);
+    }
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Reports the progress of a prefill & whether to go on
+ *
+ * Sends a progress event with the chunks & tokens evaluated so far & an
+ * estimate of the time left, from the rate so far or earlier prefills
+ *
+ * @param n_chunks_done the number of chunks evaluated
+ * @param n_chunks the number of chunks in the prompt
+ * @param n_tokens_done the number of tokens evaluated
+ * @param n_tokens the number of tokens in the prompt
+ * @param t_start_us when the prefill started
+ *
+ * @return whether to go on, false once stopped
+ */
+bool lr_mtmd_cli::prefill_progress(size_t n_chunks_done,
+                                   size_t n_chunks,
+                                   size_t n_tokens_done,
+                                   size_t n_tokens,
+                                   int64_t t_start_us) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    const double elapsed_ms = (ggml_time_us() - t_start_us) / 1000.0;
+    const double ms_per_token = n_tokens_done ? elapsed_ms / n_tokens_done : ctx->prefill_ms_per_token;
+    const double secs_left = ms_per_token * (n_tokens - std::min(n_tokens_done, n_tokens)) / 1000.0;
+    
+    char progress[128];
+    snprintf(progress, sizeof(progress), "Prefill: %zu/%zu chunks, %zu/%zu tokens, %.1f s left",
+             n_chunks_done, n_chunks, n_tokens_done, n_tokens, secs_left);
+    
+    // Have we been asked to stop?
+    if ( lr_mtmd_cli_callback(this, LlamarattiEventProgress, progress) ) {
+        _is_interrupted = true;
+    }
+    return !_is_interrupted;
+}
+
+/**
+ * @brief Reports how much audio the voice activity detection removed
+ *
+ * The token saving is estimated from the token rate of the audio that
+ * was actually encoded
+ *
+ * @param n_audio_tokens the number of audio tokens that were encoded
+ *
+ */
+void lr_mtmd_cli::report_vad_savings(size_t n_audio_tokens) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    _vad_secs_saved = 0.0f;
+    _vad_tokens_saved = 0;
+    
+    // Was there any audio in this message?
+    double secs_saved = ctx->vad_secs_in - ctx->vad_secs_out;
+    if ( ctx->vad_secs_in <= 0.0 ) {
+        return;
+    }
+    
+    _vad_secs_saved = (float)secs_saved;
+    _vad_tokens_saved = ctx->vad_secs_out > 0.0 ?
+        (int)((double)n_audio_tokens * secs_saved / ctx->vad_secs_out + 0.5) : 0;
+    
+    double secs_in = ctx->vad_secs_in;
+    auto args = std::make_format_args(secs_saved, secs_in, _vad_tokens_saved);
+    std::string msg=std::vformat(gMsgMtmdVadSavings, args);
+    LOG_INF("%s\n", msg.c_str());
+    lr_mtmd_cli_callback(this, LlamarattiEventStatus,msg.c_str());
+}
+
+/**
+ * @brief Records a media item loaded into the current context
+ *
+ * @param kind how the media was loaded, see lr_record_media_kind
+ * @param data the media bytes
+ * @param len the number of bytes
+ * @param a the width of RGB media, the window of streamed audio in ms
+ * @param b the height of RGB media
+ * @param t_start_us when loading started
+ *
+ */
+void lr_mtmd_cli::record_media(int kind,
+                               const void *data,
+                               size_t len,
+                               unsigned int a,
+                               unsigned int b,
+                               int64_t t_start_us) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    if ( !ctx->recorder.is_open() ) {
+        return;
+    }
+    ctx->record_media_ms += (ggml_time_us() - t_start_us) / 1000.0;
+    ctx->recorder.write_media((uint8_t)kind, data, len, a, b);
+}
+
+/**
+ * @brief Records a media file loaded into the current context
+ *
+ * @param kind how the media was loaded, see lr_record_media_kind
+ * @param media_path the path of the media file
+ * @param a the window of streamed audio in ms
+ * @param t_start_us when loading started
+ *
+ */
+void lr_mtmd_cli::record_media_file(int kind, const char *media_path, unsigned int a, int64_t t_start_us) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    if ( !ctx->recorder.is_open() ) {
+        return;
+    }
+    
+    // Can we read the file back?
+    std::vector<uint8_t> bytes;
+    if ( !lr_record_read_file(media_path, bytes) ) {
+        
+        auto args = std::make_format_args(__func__, media_path);
+        std::string err=std::vformat(gErrMtmdRecordMedia, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        return;
+    }
+    record_media(kind, bytes.data(), bytes.size(), a, 0, t_start_us);
+}
+
+/**
+ * @brief Records the tokens & timings of a response
+ *
+ * @param prefill_ms the time taken to evaluate the prompt
+ * @param n_prompt_tokens the number of prompt tokens evaluated
+ * @param generate_ms the time taken to generate the response
+ *
+ */
+void lr_mtmd_cli::record_response(double prefill_ms, int n_prompt_tokens, double generate_ms) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    if ( !ctx->recorder.is_open() ) {
+        return;
+    }
+    ctx->recorder.write_tokens(ctx->response_tokens);
+    ctx->recorder.write_timings({
+        { "media_ms",      ctx->record_media_ms },
+        { "prefill_ms",    prefill_ms },
+        { "prompt_tokens", (double)n_prompt_tokens },
+        { "generate_ms",   generate_ms },
+        { "tokens",        (double)ctx->response_tokens.size() },
+    });
+    ctx->record_media_ms = 0.0;
+}
+
+/**
+ * @brief Checks the context is usable, it is rebuilt by the activity guard
+ * if it was released while idle
+ *
+ * @return whether the context is usable
+ */
+bool lr_mtmd_cli::load_context() {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Was the context restored?
+    if ( !ctx->lctx ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdRestoreContext, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return false;
+    }
+    
+    // Were any conversations lost when it was rebuilt? The call goes on without them
+    if ( ctx->n_sessions_lost > 0 ) {
+        
+        int n_lost = ctx->n_sessions_lost;
+        ctx->n_sessions_lost = 0;
+        
+        auto args = std::make_format_args(__func__, n_lost);
+        std::string err=std::vformat(gErrMtmdSessionsLost, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+    }
+    return true;
+}
+
+/**
+ * @brief Loads the projector if it isn't loaded already
+ *
+ * @return whether the projector is loaded
+ */
+bool lr_mtmd_cli::load_projector() {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Can we load the projector?
+    if ( !ctx->vision() ) {
+        
+        auto args = std::make_format_args(__func__, ctx->mmproj_path);
+        std::string err=std::vformat(gErrMtmdLoadVisionModel, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Passes a cached response to the callback as if it was generated
+ *
+ * @param response the response
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::replay_response(const lr_cached_response &response) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    LR_TRACE_SCOPE("replay_response", (int64_t)response.tokens.size());
+    
+    _is_interrupted = false;
+    _is_generating = true;
+    ctx->clear_media();
+    ctx->response_tokens = response.tokens;
+    
+    // The prompt is done as far as the callback can tell
+    lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+    for ( const std::string &piece : response.pieces ) {
+        
+        // Have we been asked to stop?
+        if ( _is_interrupted ) {
+            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+            break;
+        }
+        if ( lr_mtmd_cli_callback(this, LlamarattiEventResponse,(char *)piece.c_str()) ) {
+            break;
+        }
+    }
+    _is_generating = false;
+    record_response(0.0, 0, 0.0);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Generates a series of responses
+ *
+ * @param n_predict number of tokens
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::gen_response(int n_predict) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         n_predict == 0 ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+
+    // Passes on response text, keeping it if the response is to be cached
+    auto emit = [&](const std::string &text) {
+        if (ctx->response_pieces) {
+            ctx->response_pieces->push_back(text);
+        }
+        return lr_mtmd_cli_callback(this, LlamarattiEventResponse,(char *)text.c_str());
+    };
+
+    // Text held back because it may be the start of a stop string
+    std::string held;
+    auto flush_held = [&]() {
+        if (!held.empty()) {
+            emit(held);
+            held.clear();
+        }
+    };
+    ctx->stop.reset();
+    ctx->response_complete = true;
+
+    llama_tokens &generated_tokens = ctx->response_tokens;
+    generated_tokens.clear();
+    for (int i = 0; i < n_predict; i++) {
+        if (!_is_generating || _is_interrupted) {
+            flush_held();
+            emit("\n");
+            ctx->response_complete = false;
+            break;
+        }
+
+        lr_trace_span trace_sample("sample", i);
+        llama_token token_id = common_sampler_sample(ctx->smpl, ctx->lctx, -1);
+        generated_tokens.push_back(token_id);
+        common_sampler_accept(ctx->smpl, token_id, true);
+        trace_sample.end();
+
+        if (llama_vocab_is_eog(ctx->vocab, token_id) || ctx->check_antiprompt(generated_tokens)) {
+            flush_held();
+            emit("\n");
+            break; // end of generation
+        }
+        
+        // Does the text complete a stop string? Only pass on what can't be part of one
+        std::string piece=common_token_to_piece(ctx->lctx, token_id);
+        int stop_ind = -1;
+        if (!ctx->stop.empty()) {
+            for (unsigned char c : piece) {
+                held.push_back((char)c);
+                if ((stop_ind = ctx->stop.feed(c)) >= 0) {
+                    break;
+                }
+            }
+            size_t n_show;
+            if (stop_ind >= 0) {
+                held.resize(held.size() - ctx->stop.pattern(stop_ind).size());
+                n_show = held.size();
+            } else {
+                n_show = held.size() - ctx->stop.depth();
+            }
+            piece = held.substr(0, n_show);
+            held.erase(0, n_show);
+        }
+        
+        // Have we been asked to stop?
+        lr_trace_span trace_callback("callback", i);
+        if ( emit(piece) ) {
+            ctx->response_complete = false;
+            break;
+        }
+        trace_callback.end();
+
+        if (stop_ind >= 0) {
+            LOG_DBG("%s: stop string '%s' found\n", __func__, ctx->stop.pattern(stop_ind).c_str());
+            emit("\n");
+            break;
+        }
+
+        if (_is_interrupted) {
+            flush_held();
+            emit("\n");
+            ctx->response_complete = false;
+            break;
+        }
+
+        // Can we evaluate the token?
+        ctx->apply_thermal();
+        ctx->thermal_pause();
+        common_batch_clear(ctx->batch);
+        common_batch_add(ctx->batch, token_id, ctx->n_past++, {0}, true);
+        LR_TRACE_SCOPE("decode", i);
+        if (llama_decode(ctx->lctx, ctx->batch)) {
+            
+            auto args = std::make_format_args(__func__);
+            std::string err=std::vformat(gErrMtmdDecodeToken, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+
+            ctx->response_complete = false;
+            return GGML_STATUS_ABORTED;
+        }
+    }
+    flush_held();
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Evaluates & responds to a prompt
+ *
+ * Evaluates a prompt and responds via the custom callback
+ * Call this from a background thread
+ *
+ * @param prompt the prompt
+ * @param sampling (optional) sampler settings for this response only
+ * @param adapter_scales (optional) LoRA adapter scales for this request only, by adapter id
+ * @param n_adapter_scales the number of scales, adapters without one are detached
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::evaluate_and_respond(char *prompt,
+                                      const lr_sampling *sampling/* = NULL*/,
+                                      const float *adapter_scales/* = NULL*/,
+                                      int n_adapter_scales/* = 0*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(prompt) ||
+         (sampling && !is_valid_sampling(*sampling)) ||
+         (adapter_scales && (n_adapter_scales < 0 || n_adapter_scales > get_adapter_count())) ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+
+        return GGML_STATUS_FAILED;
+    }
+
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Can we create a sampler for this response?
+    std::unique_ptr<common_sampler, decltype(&common_sampler_free)> smpl_request(nullptr, common_sampler_free);
+    int n_predict = _n_predict;
+    if ( sampling ) {
+        common_params_sampling sparams;
+        smpl_request.reset(ctx->create_sampler(*sampling, sparams));
+        if ( !smpl_request ) {
+            
+            auto args = std::make_format_args(__func__);
+            std::string err=std::vformat(gErrMtmdSampler, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            
+            return GGML_STATUS_FAILED;
+        }
+        n_predict = sampling->n_predict < 0 ? INT_MAX : sampling->n_predict;
+    }
+    
+    // Use the request's adapters until we're done
+    mtmd_cli_context::adapter_override adapters(*ctx, adapter_scales, n_adapter_scales);
+
+    _context += prompt;
+    
+    _is_interrupted = false;
+    _is_generating = true;
+    
+    LR_TRACE_SCOPE("evaluate_and_respond");
+    
+    common_chat_msg msg;
+    msg.role = "user";
+    msg.content = _context;
+    
+    // Record the request with the seed its sampler ended up using
+    if ( ctx->recorder.is_open() ) {
+        lr_sampling effective;
+        if ( sampling ) {
+            effective = *sampling;
+            effective.seed = common_sampler_get_seed(smpl_request.get());
+        }
+        ctx->recorder.write_request(ctx->request_call, 1, sampling ? &effective : NULL, adapter_scales, n_adapter_scales);
+        ctx->recorder.write_prompt(prompt);
+    }
+    
+    // Can we evaluate this message?
+    const llama_pos n_past_start = ctx->n_past;
+    const int64_t t_prefill_us = ggml_time_us();
+    ctx->begin_turn();
+    int ret = eval_message(&msg, _is_first_msg);
+    if (ret) {
+        ctx->discard_turn();
+        _is_generating = false;
+        return ret;
+    }
+    ctx->end_prompt();
+    const double prefill_ms = (ggml_time_us() - t_prefill_us) / 1000.0;
+    const llama_pos n_prompt_tokens = ctx->n_past - n_past_start;
+    
+    // Can we generate a response?
+    LR_TRACE_SCOPE("gen_response");
+    const int64_t t_generate_us = ggml_time_us();
+    common_sampler *smpl_instance = ctx->smpl;
+    if ( smpl_request ) {
+        ctx->smpl = smpl_request.get();
+    }
+    ret = gen_response(n_predict);
+    ctx->smpl = smpl_instance;
+    ctx->turns.back().response = ctx->response_tokens;
+    _is_generating = false;
+    record_response(prefill_ms, n_prompt_tokens, (ggml_time_us() - t_generate_us) / 1000.0);
+    
+    if (ret) {
+        return ret;
+    }
+
+    // Reset parameters
+    _context.clear();
+    _is_first_msg = false;
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Evaluates & responds to a prompt on its own, outside the conversation
+ *
+ * The conversation is set aside meanwhile & put back afterwards, so the
+ * request neither sees it nor becomes part of it. Media loaded since the
+ * last message go with this request. Requests that sample
+ * with a temperature of 0 or a fixed seed are answered from the response
+ * cache when an earlier one matches, see set_response_cache(), & kept
+ * there otherwise. Call this from a background thread
+ *
+ * @param prompt the prompt
+ * @param sampling (optional) sampler settings for this response only
+ * @param adapter_scales (optional) LoRA adapter scales for this request only, by adapter id
+ * @param n_adapter_scales the number of scales, adapters without one are detached
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::evaluate_and_respond_once(char *prompt,
+                                           const lr_sampling *sampling/* = NULL*/,
+                                           const float *adapter_scales/* = NULL*/,
+                                           int n_adapter_scales/* = 0*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         !is_valid_string(prompt) ||
+         (sampling && !is_valid_sampling(*sampling)) ||
+         (adapter_scales && (n_adapter_scales < 0 || n_adapter_scales > get_adapter_count())) ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+
+        return GGML_STATUS_FAILED;
+    }
+
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // The request samples afresh, so its response depends on its settings only
+    lr_sampling settings;
+    if ( sampling ) {
+        settings = *sampling;
+    } else {
+        get_sampling(&settings);
+    }
+    
+    // Is there a sequence to set the conversation aside in?
+    llama_seq_id seq = ctx->free_session_seq();
+    if ( seq < 0 ||
+         !ctx->reserve_sequences() ||
+         (uint32_t)seq >= llama_n_seq_max(ctx->lctx) ) {
+        
+        uint32_t n_seq = ctx->lctx ? llama_n_seq_max(ctx->lctx) : 0;
+        auto args = std::make_format_args(__func__, n_seq);
+        std::string err=std::vformat(gErrMtmdSequences, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // The media loaded meanwhile stay with this request, along with their markers
+    ctx->park_session(ctx->session_id, seq, "", _is_first_msg);
+    llama_memory_seq_rm(llama_get_memory(ctx->lctx), 0, -1, -1);
+    ctx->n_past = 0;
+    ctx->turns.clear();
+    _is_first_msg = true;
+    
+    // Can the response come from the cache? Only deterministic requests are looked up
+    std::string cache_key;
+    if ( ctx->response_cache.is_enabled() &&
+         !ctx->has_streams() &&
+         (settings.temp <= 0.0f || settings.seed != LR_SEED_RANDOM) ) {
+        
+        common_chat_msg cache_msg;
+        cache_msg.role = "user";
+        cache_msg.content = _context + prompt;
+        cache_key = ctx->response_key(ctx->format_chat(cache_msg), settings, adapter_scales, n_adapter_scales, _is_first_msg);
+    }
+    
+    int ret;
+    lr_cached_response cached;
+    if ( !cache_key.empty() && ctx->response_cache.find(cache_key, cached) ) {
+        
+        LOG_INF("%s: response for %zu media found in the cache\n", __func__, ctx->bitmaps.entries.size());
+        if ( ctx->recorder.is_open() ) {
+            ctx->recorder.write_request(LR_CALL_ONCE, 1, &settings, adapter_scales, n_adapter_scales);
+            ctx->recorder.write_prompt(prompt);
+        }
+        ret = replay_response(cached);
+        
+    } else {
+        
+        lr_cached_response generated;
+        if ( !cache_key.empty() ) {
+            ctx->response_pieces = &generated.pieces;
+        }
+        ctx->request_call = LR_CALL_ONCE;
+        ret = evaluate_and_respond(prompt, &settings, adapter_scales, n_adapter_scales);
+        ctx->request_call = LR_CALL_TURN;
+        ctx->response_pieces = nullptr;
+        
+        if ( !cache_key.empty() &&
+             ret == GGML_STATUS_SUCCESS &&
+             ctx->response_complete &&
+             !_is_interrupted ) {
+            generated.tokens = ctx->response_tokens;
+            ctx->response_cache.store(cache_key, generated);
+        }
+    }
+    
+    // Put the conversation back, without the media this request used
+    ctx->clear_media();
+    ctx->unpark_session(ctx->session_id, _context, _is_first_msg);
+    
+    return ret;
+}
+
+/**
+ * @brief Evaluates a prompt once & generates several alternative responses
+ *
+ * The prompt & any loaded media are evaluated once, then the conversation
+ * is shared by n_responses sequences that are decoded together, one
+ * batch per step, each with its own sampler. Response i uses seed + i,
+ * a random seed is drawn for the first one when none is set. Responses are not
+ * streamed through the callback, the first one continues the
+ * conversation. The responses share what is left of the context, each is
+ * cut short at its share.
+ *
+ * Call this from a background thread
+ *
+ * @param prompt the prompt
+ * @param n_responses the number of responses, up to LR_MAX_RESPONSES
+ * @param responses (returned) the responses
+ * @param sampling (optional) sampler settings for these responses only
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::evaluate_and_respond_n(char *prompt,
+                                        int n_responses,
+                                        std::vector<std::string> &responses,
+                                        const lr_sampling *sampling/* = NULL*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(prompt) ||
+         n_responses < 1 ||
+         n_responses > LR_MAX_RESPONSES ||
+         (sampling && !is_valid_sampling(*sampling)) ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+
+        return GGML_STATUS_FAILED;
+    }
+
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Can the context hold a sequence per response?
+    if ( llama_n_seq_max(ctx->lctx) < (uint32_t)n_responses &&
+         (!ctx->reserve_sequences() || llama_n_seq_max(ctx->lctx) < (uint32_t)n_responses) ) {
+        
+        auto args = std::make_format_args(__func__, n_responses);
+        std::string err=std::vformat(gErrMtmdSequences, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Can we create a sampler per response?
+    lr_sampling settings;
+    if ( sampling ) {
+        settings = *sampling;
+    } else {
+        get_sampling(&settings);
+    }
+    const int n_predict = settings.n_predict < 0 ? INT_MAX : settings.n_predict;
+    std::vector<std::unique_ptr<common_sampler, decltype(&common_sampler_free)>> smpls;
+    for ( int i=0; i<n_responses; i++ ) {
+        lr_sampling seeded = settings;
+        if ( i > 0 ) {
+            seeded.seed = settings.seed + (uint32_t)i;
+        }
+        common_params_sampling sparams;
+        smpls.emplace_back(ctx->create_sampler(seeded, sparams), common_sampler_free);
+        if ( !smpls.back() ) {
+            
+            auto args = std::make_format_args(__func__);
+            std::string err=std::vformat(gErrMtmdSampler, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            
+            return GGML_STATUS_FAILED;
+        }
+        
+        // The rest follow on from the first one's seed, so a recording can repeat them
+        if ( i == 0 ) {
+            settings.seed = common_sampler_get_seed(smpls[0].get());
+        }
+    }
+
+    _context += prompt;
+    
+    _is_interrupted = false;
+    _is_generating = true;
+    
+    LR_TRACE_SCOPE("evaluate_and_respond_n", n_responses);
+    
+    common_chat_msg msg;
+    msg.role = "user";
+    msg.content = _context;
+    
+    if ( ctx->recorder.is_open() ) {
+        ctx->recorder.write_request(LR_CALL_N, (uint32_t)n_responses, &settings);
+        ctx->recorder.write_prompt(prompt);
+    }
+    
+    // Can we evaluate this message?
+    const llama_pos n_past_start = ctx->n_past;
+    const int64_t t_prefill_us = ggml_time_us();
+    ctx->begin_turn();
+    int ret = eval_message(&msg, _is_first_msg);
+    if (ret) {
+        ctx->discard_turn();
+        _is_generating = false;
+        return ret;
+    }
+    ctx->end_prompt();
+    const double prefill_ms = (ggml_time_us() - t_prefill_us) / 1000.0;
+    const llama_pos n_prompt_tokens = ctx->n_past - n_past_start;
+    
+    // Is there room left for every response? They share what the context has left
+    const llama_pos n_free = (llama_pos)llama_n_ctx(ctx->lctx) - ctx->n_past;
+    if ( n_free < n_responses ) {
+        
+        ctx->discard_turn();
+        _is_generating = false;
+        
+        auto args = std::make_format_args(__func__, n_responses);
+        std::string err=std::vformat(gErrMtmdContextFull, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    const int n_tokens_max = std::min(n_predict, (int)(n_free / n_responses));
+    if ( n_tokens_max < n_predict && settings.n_predict >= 0 ) {
+        LOG_WRN("%s: only room for %d tokens per response\n", __func__, n_tokens_max);
+    }
+    
+    // Share the conversation with the other sequences
+    llama_memory_t mem = llama_get_memory(ctx->lctx);
+    for ( int i=1; i<n_responses; i++ ) {
+        llama_memory_seq_rm(mem, i, -1, -1);
+        llama_memory_seq_cp(mem, 0, i, -1, -1);
+    }
+    
+    // Decode the responses together, each still running has one token per batch
+    const int64_t t_generate_us = ggml_time_us();
+    std::vector<llama_tokens> tokens(n_responses);
+    std::vector<llama_pos> pos(n_responses, ctx->n_past);
+    std::vector<int32_t> i_batch(n_responses, -1);
+    std::vector<lr_stop_matcher> stops(n_responses, ctx->stop);
+    std::vector<bool> running(n_responses, true);
+    llama_batch batch = llama_batch_init(n_responses, 0, 1);
+    responses.assign(n_responses, std::string());
+    
+    for ( int n_running = n_responses, step = 0; n_running > 0; step++ ) {
+        if ( !_is_generating || _is_interrupted ) {
+            break;
+        }
+        
+        common_batch_clear(batch);
+        for ( int i=0; i<n_responses; i++ ) {
+            if ( !running[i] ) {
+                continue;
+            }
+            llama_token token_id = common_sampler_sample(smpls[i].get(), ctx->lctx, i_batch[i]);
+            common_sampler_accept(smpls[i].get(), token_id, true);
+            tokens[i].push_back(token_id);
+            
+            // Is this response done?
+            bool done = llama_vocab_is_eog(ctx->vocab, token_id) ||
+                        ctx->check_antiprompt(tokens[i]) ||
+                        (int)tokens[i].size() >= n_tokens_max;
+            if ( !llama_vocab_is_eog(ctx->vocab, token_id) ) {
+                for ( unsigned char c : common_token_to_piece(ctx->lctx, token_id) ) {
+                    responses[i].push_back((char)c);
+                    int stop_ind = stops[i].empty() ? -1 : stops[i].feed(c);
+                    if ( stop_ind >= 0 ) {
+                        responses[i].resize(responses[i].size() - stops[i].pattern(stop_ind).size());
+                        done = true;
+                        break;
+                    }
+                }
+            }
+            if ( done ) {
+                running[i] = false;
+                n_running--;
+                continue;
+            }
+            
+            i_batch[i] = batch.n_tokens;
+            common_batch_add(batch, token_id, pos[i]++, { i }, true);
+        }
+        if ( batch.n_tokens == 0 ) {
+            break;
+        }
+        
+        // Can we evaluate the tokens?
+        ctx->apply_thermal();
+        ctx->thermal_pause();
+        LR_TRACE_SCOPE("decode", step);
+        if ( llama_decode(ctx->lctx, batch) ) {
+            
+            auto args = std::make_format_args(__func__);
+            std::string err=std::vformat(gErrMtmdDecodeToken, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            
+            ret = GGML_STATUS_ABORTED;
+            break;
+        }
+    }
+    llama_batch_free(batch);
+    
+    // Keep only the first response in the conversation
+    for ( int i=1; i<n_responses; i++ ) {
+        llama_memory_seq_rm(mem, i, -1, -1);
+    }
+    ctx->n_past = pos[0];
+    ctx->response_tokens = tokens[0];
+    ctx->turns.back().response = tokens[0];
+    for ( llama_token token : tokens[0] ) {
+        common_sampler_accept(ctx->smpl, token, true);
+    }
+    _is_generating = false;
+    record_response(prefill_ms, n_prompt_tokens, (ggml_time_us() - t_generate_us) / 1000.0);
+    if (ret) {
+        return ret;
+    }
+    
+    size_t n_generated = 0;
+    for ( const llama_tokens &t : tokens ) {
+        n_generated += t.size();
+    }
+    LOG_INF("%s: %d responses, %d prompt tokens evaluated once, %zu tokens generated in %.1f ms\n",
+            __func__, n_responses, (int)n_prompt_tokens, n_generated, (ggml_time_us() - t_generate_us) / 1000.0);
+
+    // Reset parameters
+    _context.clear();
+    _is_first_msg = false;
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Changes the context size without reloading the model
+ *
+ * Only the context & its KV cache are recreated, the model & projector
+ * stay loaded. The conversation is carried over when asked to & it fits
+ * in the new size, otherwise it starts over. Conversations put aside by
+ * fork_session() that no longer fit are dropped & reported. If the new
+ * context can't be created the old size is kept.
+ *
+ * @param n_ctx the new context size in tokens
+ * @param keep_history whether to carry over the conversation
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_context_size(int n_ctx, bool keep_history/* = true*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         n_ctx <= 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Is there anything to do?
+    if ( (uint32_t)n_ctx == llama_n_ctx(ctx->lctx) ) {
+        return GGML_STATUS_SUCCESS;
+    }
+    
+    // Can we recreate the context? Any conversation lost meanwhile is reported
+    const int64_t t_start_ms = ggml_time_ms();
+    bool bResized = ctx->resize_context((uint32_t)n_ctx, keep_history);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    if ( !bResized ) {
+        
+        auto args = std::make_format_args(__func__, n_ctx);
+        std::string err=std::vformat(gErrMtmdResizeContext, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Did the conversation start over?
+    if ( ctx->n_past == 0 ) {
+        _is_first_msg = true;
+    }
+    
+    LOG_INF("%s: context resized to %d tokens in %lld ms, %d tokens kept\n",
+            __func__, n_ctx, (long long)(ggml_time_ms() - t_start_ms), ctx->n_past);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads a LoRA adapter for the base model
+ *
+ * The adapter is loaded once & can then be attached to the session with
+ * set_adapter_scale() or to single requests with evaluate_and_respond(),
+ * so one loaded model can serve several fine-tunes.
+ *
+ * @param adapter_path the path of the adapter GGUF
+ * @param scale the session scale to attach it with, 0 to leave it detached
+ * @param adapter_id (returned, optional) the id of the adapter
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_adapter(char *adapter_path, float scale/* = 0.0f*/, int *adapter_id/* = NULL*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         !is_valid_string(adapter_path) ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    
+    // Can we load the adapter?
+    int id = ctx->load_adapter(adapter_path);
+    if ( id < 0 ) {
+        
+        auto args = std::make_format_args(__func__, adapter_path);
+        std::string err=std::vformat(gErrMtmdLoadAdapter, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    LOG_INF("%s: loaded adapter %d from '%s'\n", __func__, id, adapter_path);
+    if ( ctx->recorder.is_open() ) {
+        ctx->recorder.write_adapter(id, 0.0f, adapter_path);
+    }
+    
+    if ( adapter_id ) {
+        *adapter_id = id;
+    }
+    
+    return scale != 0.0f ? set_adapter_scale(id, scale) : GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Attaches, rescales or detaches a LoRA adapter for the session
+ *
+ * Tokens already in the conversation keep the adapters they were
+ * evaluated with.
+ *
+ * @param adapter_id the id of the adapter
+ * @param scale the scale to apply it with, 0 to detach it
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_adapter_scale(int adapter_id, float scale) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         adapter_id < 0 ||
+         adapter_id >= get_adapter_count() ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    
+    ctx->lora_adapters[adapter_id].scale = scale;
+    ctx->apply_adapters(ctx->lora_adapters);
+    if ( ctx->recorder.is_open() ) {
+        ctx->recorder.write_adapter(adapter_id, scale);
+    }
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Returns the number of LoRA adapters loaded, adapter ids run from 0
+ *
+ * @return the number of adapters
+ */
+int lr_mtmd_cli::get_adapter_count() {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ) {
+        return 0;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    return (int)ctx->lora_adapters.size();
+}
+
+/**
+ * @brief Branches the conversation & switches to the new branch
+ *
+ * The branch shares the cells of the conversation up to where it
+ * diverges, so nothing is evaluated again however many images they
+ * hold, & gets a copy of the sampler's history. The conversation it
+ * came from is kept under its own id for switch_session().
+ *
+ * To edit the last message, branch at the last turn & send the new
+ * message. To regenerate the last response, branch at the last turn
+ * keeping its message & call respond().
+ *
+ * @param session_id (returned) the id of the new branch
+ * @param turn the turn the branch diverges at, counted from 0, -1 to copy the whole conversation
+ * @param keep_message whether the branch keeps that turn's message
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::fork_session(int *session_id, int turn/* = -1*/, bool keep_message/* = false*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         !session_id ||
+         turn < -1 ||
+         turn >= get_turn_count() ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Where does the branch diverge?
+    llama_pos pos = ctx->n_past;
+    size_t n_turns = ctx->turns.size();
+    if ( turn >= 0 ) {
+        pos = keep_message ? ctx->turns[turn].n_past_response : ctx->turns[turn].n_past_prompt;
+        n_turns = (size_t)turn + (keep_message ? 1 : 0);
+    }
+    
+    // Is there room for another sequence & can the conversation be cut back there?
+    const int64_t t_start_us = ggml_time_us();
+    llama_seq_id seq = ctx->free_session_seq();
+    if ( seq < 0 ||
+         !ctx->reserve_sequences() ||
+         (uint32_t)seq >= llama_n_seq_max(ctx->lctx) ||
+         !ctx->can_truncate(pos) ) {
+        
+        auto args = std::make_format_args(__func__, turn);
+        std::string err=std::vformat(gErrMtmdForkSession, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Keep the conversation as it is & cut the active copy back
+    const int parent_id = ctx->session_id;
+    ctx->park_session(parent_id, seq, _context, _is_first_msg);
+    if ( !ctx->truncate(pos, n_turns) ) {
+        
+        ctx->drop_session(parent_id);
+        
+        auto args = std::make_format_args(__func__, turn);
+        std::string err=std::vformat(gErrMtmdForkSession, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    ctx->session_id = ctx->session_next_id++;
+    _context.clear();
+    _is_first_msg = (ctx->n_past == 0);
+    *session_id = ctx->session_id;
+    
+    LOG_INF("%s: session %d branched from %d at %d tokens in %.2f ms\n",
+            __func__, ctx->session_id, parent_id, ctx->n_past, (ggml_time_us() - t_start_us) / 1000.0);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Switches to a conversation put aside by fork_session()
+ *
+ * The active conversation is put aside in its place under its own id
+ *
+ * @param session_id the id of the conversation
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::switch_session(int session_id) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Is there anything to do?
+    if ( session_id == ctx->session_id ) {
+        return GGML_STATUS_SUCCESS;
+    }
+    
+    // Do we have this conversation?
+    if ( ctx->sessions.find(session_id) == ctx->sessions.end() ) {
+        
+        auto args = std::make_format_args(__func__, session_id);
+        std::string err=std::vformat(gErrMtmdSession, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    ctx->swap_session(session_id, _context, _is_first_msg);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Drops a conversation put aside by fork_session()
+ *
+ * @param session_id the id of the conversation, not the active one
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::delete_session(int session_id) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run, the conversation's cells are in the context
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Do we have this conversation?
+    if ( ctx->sessions.find(session_id) == ctx->sessions.end() ) {
+        
+        auto args = std::make_format_args(__func__, session_id);
+        std::string err=std::vformat(gErrMtmdSession, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    ctx->drop_session(session_id);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Returns the id of the active conversation
+ *
+ * @return the id, 0 until the conversation is first branched
+ */
+int lr_mtmd_cli::get_session_id() {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ) {
+        return 0;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    return ctx->session_id;
+}
+
+/**
+ * @brief Removes the last turns of the conversation
+ *
+ * Only the cells of those turns are removed, the turns before them &
+ * their media stay evaluated. The sampler's history is put back to what
+ * it was before them. Use it to recover from a turn that failed, was
+ * cancelled or wasn't wanted.
+ *
+ * @param n_turns the number of turns to remove
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::rollback_turns(int n_turns) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         n_turns < 1 ||
+         n_turns > get_turn_count() ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Can we cut the conversation back to where those turns started?
+    const size_t n_keep = ctx->turns.size() - (size_t)n_turns;
+    const llama_pos n_past_old = ctx->n_past;
+    if ( !ctx->truncate(ctx->turns[n_keep].n_past_prompt, n_keep) ) {
+        
+        auto args = std::make_format_args(__func__, n_turns);
+        std::string err=std::vformat(gErrMtmdRollback, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    _context.clear();
+    _is_first_msg = (ctx->n_past == 0);
+    
+    LOG_INF("%s: %d turns rolled back, %d of %d tokens kept\n", __func__, n_turns, ctx->n_past, n_past_old);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Returns the number of turns in the active conversation
+ *
+ * @return the number of turns
+ */
+int lr_mtmd_cli::get_turn_count() {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ) {
+        return 0;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    return (int)ctx->turns.size();
+}
+
+/**
+ * @brief Responds to the last message again
+ *
+ * Generates a response to a message that has been evaluated but not yet
+ * answered, e.g. on a branch from fork_session() that kept it, via the
+ * custom callback. Call this from a background thread
+ *
+ * @param sampling (optional) sampler settings for this response only
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::respond(const lr_sampling *sampling/* = NULL*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         (sampling && !is_valid_sampling(*sampling)) ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Is there a message waiting for a response?
+    if ( ctx->turns.empty() ||
+         ctx->turns.back().n_past_response != ctx->n_past ||
+         ctx->turns.back().prompt_token == LLAMA_TOKEN_NULL ||
+         !ctx->turns.back().response.empty() ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdNoMessage, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Can we create a sampler for this response?
+    std::unique_ptr<common_sampler, decltype(&common_sampler_free)> smpl_request(nullptr, common_sampler_free);
+    int n_predict = _n_predict;
+    if ( sampling ) {
+        common_params_sampling sparams;
+        smpl_request.reset(ctx->create_sampler(*sampling, sparams));
+        if ( !smpl_request ) {
+            
+            auto args = std::make_format_args(__func__);
+            std::string err=std::vformat(gErrMtmdSampler, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            
+            return GGML_STATUS_FAILED;
+        }
+        n_predict = sampling->n_predict < 0 ? INT_MAX : sampling->n_predict;
+    }
+    
+    // The logits are from whatever was decoded last, so decode the message's last token again
+    llama_memory_t mem = llama_get_memory(ctx->lctx);
+    const llama_pos pos_last = ctx->n_past - 1;
+    common_batch_clear(ctx->batch);
+    common_batch_add(ctx->batch, ctx->turns.back().prompt_token, pos_last, {0}, true);
+    if ( !llama_memory_seq_rm(mem, 0, pos_last, -1) ||
+         llama_decode(ctx->lctx, ctx->batch) ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdDecodeToken, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_ABORTED;
+    }
+    
+    _is_interrupted = false;
+    _is_generating = true;
+    
+    // Can we generate a response?
+    LR_TRACE_SCOPE("respond");
+    common_sampler *smpl_instance = ctx->smpl;
+    if ( smpl_request ) {
+        ctx->smpl = smpl_request.get();
+    }
+    int ret = gen_response(n_predict);
+    ctx->smpl = smpl_instance;
+    ctx->turns.back().response = ctx->response_tokens;
+    _is_generating = false;
+    
+    return ret;
+}
+
+/**
+ * @brief Returns the current sampler settings
+ *
+ * @param sampling (returned) the settings
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::get_sampling(lr_sampling *sampling) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !sampling ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    sampling->temp            = ctx->sampling.temp;
+    sampling->top_k           = ctx->sampling.top_k;
+    sampling->top_p           = ctx->sampling.top_p;
+    sampling->min_p           = ctx->sampling.min_p;
+    sampling->penalty_repeat  = ctx->sampling.penalty_repeat;
+    sampling->penalty_freq    = ctx->sampling.penalty_freq;
+    sampling->penalty_present = ctx->sampling.penalty_present;
+    sampling->penalty_last_n  = ctx->sampling.penalty_last_n;
+    sampling->seed            = ctx->sampling.seed;
+    sampling->n_predict       = _n_predict == INT_MAX ? -1 : _n_predict;
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Changes the sampler settings of later responses
+ *
+ * Only the sampler is rebuilt, the model & the conversation are kept.
+ * The responses of the conversation are fed to the new sampler so
+ * repetition penalties carry on from them.
+ *
+ * @param sampling the new settings
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_sampling(const lr_sampling &sampling) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         !is_valid_sampling(sampling) ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Can we create the new sampler?
+    const int64_t t_start_us = ggml_time_us();
+    common_params_sampling sparams;
+    common_sampler *smpl = ctx->create_sampler(sampling, sparams);
+    if ( !smpl ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdSampler, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    ctx->accept_history(smpl);
+    
+    common_sampler_free(ctx->smpl);
+    ctx->smpl = smpl;
+    ctx->sampling = sparams;
+    ctx->sampling.seed = common_sampler_get_seed(smpl);
+    _n_predict = sampling.n_predict < 0 ? INT_MAX : sampling.n_predict;
+    
+    // Record the settings with the seed the sampler ended up using
+    if ( ctx->recorder.is_open() ) {
+        lr_sampling effective = sampling;
+        effective.seed = ctx->sampling.seed;
+        ctx->recorder.write_sampling(effective);
+    }
+    
+    LOG_INF("%s: sampler rebuilt in %lld us: %s\n", __func__,
+            (long long)(ggml_time_us() - t_start_us), common_sampler_print(smpl).c_str());
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Starts or stops pipelined evaluation
+ *
+ * While the pipeline runs, requests added with queue_request() are
+ * tokenized & have their media encoded on a dedicated encoder thread,
+ * so the next request is encoded while respond_next_request() decodes
+ * the current one. The CPU threads are split between the two stages, a
+ * projector that is already loaded keeps its threads until it is next
+ * loaded.
+ *
+ * @param enabled whether to run the pipeline
+ * @param encoder_threads the threads given to the encoder, 0 for half of them
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_pipeline(bool enabled, int encoder_threads/* = 0*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         encoder_threads < 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    
+    ctx->stop_pipeline();
+    
+    // Split the threads, the stages share them when there are too few
+    int n_total = ctx->n_threads_total;
+    int n_encoder = n_total;
+    int n_decoder = n_total;
+    if ( enabled ) {
+        n_encoder = encoder_threads > 0 ? encoder_threads : std::max(1, n_total / 2);
+        n_encoder = std::min(n_encoder, n_total);
+        n_decoder = std::max(1, n_total - n_encoder);
+    }
+    
+    // The decoder threads are applied as the governor has them
+    ctx->set_vision_threads(n_encoder);
+    ctx->n_threads = n_decoder;
+    ctx->lctx_applied = nullptr;
+    ctx->apply_thermal();
+    
+    if ( enabled ) {
+        ctx->start_pipeline();
+    }
+    LOG_INF("%s: pipeline %s, %d encoder & %d decoder threads\n", __func__, enabled ? "on" : "off", n_encoder, n_decoder);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Queues a prompt, with the media loaded so far, for pipelined evaluation
+ *
+ * Returns as soon as the request is queued, its media are encoded in the
+ * background. Call respond_next_request() to evaluate & respond to the
+ * requests in the order they were queued.
+ *
+ * @param prompt the prompt
+ * @param request_id (returned, optional) identifies the request
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::queue_request(char *prompt, int *request_id/* = NULL*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(prompt) ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    
+    // Is the pipeline running? Streamed audio is decoded as it is encoded, so can't be queued
+    if ( !ctx->pipeline_running ||
+         ctx->has_streams() ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    common_chat_msg msg;
+    msg.role = "user";
+    msg.content = _context + prompt;
+    
+    auto req = std::make_shared<lr_pipeline_request>();
+    if ( ctx->recorder.is_open() ) {
+        ctx->recorder.write_prompt(prompt, &req->record_request);
+    }
+
+    req->prompt = ctx->format_chat(msg);
+    req->add_bos = _is_first_msg;
+    req->bitmaps.entries = std::move(ctx->bitmaps.entries);
+    ctx->clear_media();
+    
+    _context.clear();
+    _is_first_msg = false;
+    
+    {
+        std::lock_guard<std::mutex> lock(ctx->pipeline_mutex);
+        req->id = ctx->pipeline_next_id++;
+        ctx->pipeline.push_back(req);
+    }
+    ctx->pipeline_cv.notify_all();
+    
+    if ( request_id ) {
+        *request_id = req->id;
+    }
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Evaluates & responds to the oldest queued request
+ *
+ * Waits for the request's media to finish encoding, decodes it &
+ * responds via the custom callback. Call this from a background thread.
+ *
+ * @param request_id (returned, optional) the request that was processed
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::respond_next_request(int *request_id/* = NULL*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Is the pipeline running?
+    if ( !ctx->pipeline_running ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Is there a request waiting?
+    std::shared_ptr<lr_pipeline_request> req = ctx->next_request();
+    if ( !req ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    if ( request_id ) {
+        *request_id = req->id;
+    }
+    
+    LR_TRACE_SCOPE("respond_request", req->id);
+    
+    // Was the request tokenized & encoded?
+    if ( req->status ) {
+        
+        int res = req->status;
+        auto args = std::make_format_args(__func__, res);
+        std::string err=std::vformat(gErrMtmdTokenize, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return res;
+    }
+    
+    _is_interrupted = false;
+    _is_generating = true;
+    
+    // Can we decode the prompt?
+    llama_pos n_past = ctx->n_past;
+    const int64_t t_prefill_us = ggml_time_us();
+    ctx->begin_turn();
+    int res = ctx->decode_chunks(req->chunks.ptr.get(), 0, req->chunks.size(), req->embd, req->offsets, n_past, true);
+    if ( res ) {
+        
+        ctx->discard_turn();
+        _is_generating = false;
+        auto args = std::make_format_args(__func__, res);
+        std::string err=std::vformat(gErrMtmdEvalPrompt, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return res;
+    }
+    const double prefill_ms = (ggml_time_us() - t_prefill_us) / 1000.0;
+    const llama_pos n_prompt_tokens = n_past - ctx->n_past;
+    ctx->n_past = n_past;
+    ctx->set_last_prompt_token(req->chunks.ptr.get());
+    ctx->end_prompt();
+    lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+    
+    // Can we generate a response?
+    const int64_t t_generate_us = ggml_time_us();
+    int ret = gen_response(_n_predict);
+    ctx->turns.back().response = ctx->response_tokens;
+    _is_generating = false;
+    
+    // Later requests may have been recorded since, so say which one this answers
+    if ( ctx->recorder.is_open() && req->record_request != UINT32_MAX ) {
+        ctx->recorder.write_answer(req->record_request);
+    }
+    record_response(prefill_ms, n_prompt_tokens, (ggml_time_us() - t_generate_us) / 1000.0);
+    
+    return ret;
+}
+
+/**
+ * @brief Returns whether the model text generation is in progress
+ *
+ * @return Whether the model text generation is in progress
+ */
+bool lr_mtmd_cli::is_generating() {
+    
+    return _is_generating;
+}
+
+/**
+ * @brief Returns whether the model text generation was interrupted
+ *
+ * @return Whether the model text generation is interrupted
+ */
+bool lr_mtmd_cli::is_interrupted() {
+    
+    return _is_interrupted;
+}
+
+/**
+ * @brief Signal to stop text generation
+ *
+ */
+void lr_mtmd_cli::stop_generating() {
+    
+    _is_interrupted=true;
+}
+
+/**
+ * @brief Loads the specified audio or video media into the current context
+ *
+ * @param media_path the path to the media file to load
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_media(char *media_path) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(media_path) ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+
+    // Can we load the media?
+    LR_TRACE_SCOPE("load_media");
+    if ( !ctx->load_media(media_path) ) {
+
+        auto args = std::make_format_args(__func__,media_path);
+        std::string err=std::vformat(gErrMtmdLoadMedia, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    record_media_file(LR_MEDIA_FILE, media_path, 0, t_start_us);
+    _context += mtmd_default_marker();
+
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads several media files into the current context at once
+ *
+ * Files are decoded concurrently on a pool of worker threads, then
+ * added in the order given, so the media markers in the prompt always
+ * follow the input order. A file that fails to decode is skipped &
+ * reported without affecting the others.
+ *
+ * @param media_paths the paths of the media files
+ * @param n_media the number of media files
+ * @param results (returned, optional) the status of each file, n_media entries
+ *
+ * @return GGML_STATUS_SUCCESS if every file was loaded
+ */
+int lr_mtmd_cli::load_media_batch(char *media_paths[], int n_media, int *results/* = NULL*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !media_paths ||
+         n_media <= 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    const int64_t t_start_ms = ggml_time_ms();
+    int64_t t_record_us = ggml_time_us();
+    
+    // Decode every file
+    std::vector<mtmd::bitmap> decoded;
+    int n_workers = ctx->decode_files(media_paths, n_media, decoded);
+    
+    // Add the results in order
+    int n_failed = 0;
+    for ( int ind=0; ind<n_media; ind++ ) {
+        
+        bool bLoaded = ctx->add_bitmap(std::move(decoded[ind]));
+        if ( bLoaded ) {
+            record_media_file(LR_MEDIA_FILE, media_paths[ind], 0, t_record_us);
+            t_record_us = ggml_time_us();
+            _context += mtmd_default_marker();
+        } else {
+            std::string path = media_paths[ind] ? media_paths[ind] : "";
+            auto args = std::make_format_args(__func__,path);
+            std::string err=std::vformat(gErrMtmdLoadMedia, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            n_failed++;
+        }
+        
+        if ( results ) {
+            results[ind] = bLoaded ? GGML_STATUS_SUCCESS : GGML_STATUS_FAILED;
+        }
+    }
+    
+    LOG_INF("%s: decoded %d files on %d threads in %lld ms, %d failed\n",
+            __func__, n_media, n_workers, (long long)(ggml_time_ms() - t_start_ms), n_failed);
+    
+    return n_failed ? GGML_STATUS_FAILED : GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads encoded media that is already in memory into the current context
+ *
+ * Accepts the same formats as load_media, without going through a file
+ *
+ * @param buf the encoded image or audio file contents
+ * @param len the length of the contents in bytes
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_media_from_buffer(const unsigned char *buf, size_t len) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !buf ||
+         len == 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    // Can we decode the media?
+    if ( !ctx->add_bitmap(mtmd::bitmap(mtmd_helper_bitmap_init_from_buf(ctx->vision(), buf, len))) ) {
+
+        std::string desc = "<buffer>";
+        auto args = std::make_format_args(__func__,desc);
+        std::string err=std::vformat(gErrMtmdLoadMedia, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    record_media(LR_MEDIA_FILE, buf, len, 0, 0, t_start_us);
+    _context += mtmd_default_marker();
+
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads decoded RGB pixels into the current context
+ *
+ * Lets callers that already decoded an image (such as HEIC or WEBP via
+ * ImageIO) hand the pixels straight to the encoder
+ *
+ * @param rgb packed 8 bit RGB pixels, row major, nx * ny * 3 bytes
+ * @param nx the image width
+ * @param ny the image height
+ * @param fit_budget whether to downscale the image to the image budget, see set_image_budget()
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_media_from_rgb(const unsigned char *rgb, unsigned int nx, unsigned int ny, bool fit_budget/* = true*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !rgb ||
+         nx == 0 ||
+         ny == 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    // Can we create the bitmap?
+    if ( !ctx->add_bitmap(mtmd::bitmap(nx, ny, rgb), fit_budget) ) {
+
+        std::string desc = "<rgb>";
+        auto args = std::make_format_args(__func__,desc);
+        std::string err=std::vformat(gErrMtmdLoadMedia, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    record_media(fit_budget ? LR_MEDIA_RGB : LR_MEDIA_FRAME, rgb, (size_t)nx * ny * 3, nx, ny, t_start_us);
+    _context += mtmd_default_marker();
+
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads decoded audio samples into the current context
+ *
+ * @param pcm mono float samples in [-1,1] at the encoder sample rate (usually 16kHz)
+ * @param n_samples the number of samples
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_media_from_pcm(const float *pcm, size_t n_samples) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !pcm ||
+         n_samples == 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    // Can we create the bitmap?
+    if ( !ctx->supports_audio ||
+         !ctx->add_bitmap(mtmd::bitmap(mtmd_bitmap_init_from_audio(n_samples, pcm))) ) {
+
+        std::string desc = "<pcm>";
+        auto args = std::make_format_args(__func__,desc);
+        std::string err=std::vformat(gErrMtmdLoadMedia, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    record_media(LR_MEDIA_PCM, pcm, n_samples * sizeof(float), 0, 0, t_start_us);
+    _context += mtmd_default_marker();
+
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Streams the specified audio file into the current context
+ *
+ * Unlike load_media, the file is not decoded up front. It is read &
+ * resampled in windows on a background thread while the message is
+ * evaluated, and each window is encoded as its own chunk. Formats
+ * other than WAV fall back to load_media.
+ *
+ * @param media_path the path to the audio file to stream
+ * @param window_secs the length of each window in seconds, 0 for the default,
+ * otherwise at least LR_AUDIO_MIN_WINDOW_SECS
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_audio_stream(char *media_path, float window_secs/* = 0.0f*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(media_path) ||
+         window_secs < 0.0f ||
+         (window_secs > 0.0f && window_secs < LR_AUDIO_MIN_WINDOW_SECS) ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    // Can we stream this format?
+    if ( !lr_wav_reader::is_wav_file(media_path) ) {
+        LOG_WRN("%s: '%s' is not a WAV file, decoding it in full\n", __func__, media_path);
+        return load_media(media_path);
+    }
+    
+    if ( window_secs == 0.0f ) {
+        window_secs = LR_AUDIO_DEFAULT_WINDOW_SECS;
+    }
+
+    // Can we start streaming the audio?
+    if ( !ctx->load_audio_stream(media_path, window_secs) ) {
+
+        auto args = std::make_format_args(__func__,media_path);
+        std::string err=std::vformat(gErrMtmdLoadAudioStream, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    record_media_file(LR_MEDIA_STREAM, media_path, (unsigned int)(window_secs * 1000.0f), t_start_us);
+    _context += mtmd_default_marker();
+
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads an ordered sequence of frames into the current context
+ *
+ * Each frame is decoded & given a perceptual hash. Frames that are near
+ * duplicates of the last frame kept are dropped, and the remainder are
+ * evenly subsampled to fit the token budget. Only the frames selected
+ * are ever encoded.
+ *
+ * @param frame_paths the paths of the frames, in order
+ * @param n_frames the number of frames
+ * @param max_tokens the token budget for all frames, 0 for half the free context
+ * @param dup_threshold the hash distance at or below which frames are duplicates, -1 for the default
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_image_sequence(char *frame_paths[],
+                                     int n_frames,
+                                     int max_tokens/* = 0*/,
+                                     int dup_threshold/* = -1*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !frame_paths ||
+         n_frames <= 0 ||
+         max_tokens < 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    std::vector<std::string> paths;
+    for ( int ind=0; ind<n_frames; ind++ ) {
+        if ( is_valid_string(frame_paths[ind]) ) {
+            paths.push_back(frame_paths[ind]);
+        }
+    }
+    
+    return load_frames(paths, max_tokens, dup_threshold);
+}
+
+/**
+ * @brief Loads the frames in a directory into the current context
+ *
+ * Image files are taken in natural name order, so frame_2 precedes
+ * frame_10. See load_image_sequence for how frames are selected.
+ *
+ * @param dir_path the directory holding the frames
+ * @param max_tokens the token budget for all frames, 0 for half the free context
+ * @param dup_threshold the hash distance at or below which frames are duplicates, -1 for the default
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_image_directory(char *dir_path,
+                                      int max_tokens/* = 0*/,
+                                      int dup_threshold/* = -1*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(dir_path) ||
+         max_tokens < 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Can we list the frames?
+    std::vector<std::string> paths;
+    if ( !lr_list_frames(dir_path, paths) || paths.empty() ) {
+
+        auto args = std::make_format_args(__func__,dir_path);
+        std::string err=std::vformat(gErrMtmdLoadFrames, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    return load_frames(paths, max_tokens, dup_threshold);
+}
+
+/**
+ * @brief Deduplicates, subsamples & loads a sequence of frames
+ *
+ * Bitmaps of the frames kept are held onto while they still fit the
+ * budget, so in the common case every frame is decoded only once
+ *
+ * @param paths the paths of the frames, in order
+ * @param max_tokens the token budget for all frames, 0 for half the free context
+ * @param dup_threshold the hash distance at or below which frames are duplicates, -1 for the default
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::load_frames(const std::vector<std::string> &paths,
+                             int max_tokens,
+                             int dup_threshold) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Keep the projector loaded while we use it
+    mtmd_cli_context::activity busy(*ctx);
+    if ( !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    if ( !load_context() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    int64_t t_record_us = ggml_time_us();
+    
+    if ( dup_threshold < 0 ) {
+        dup_threshold = LR_FRAMES_DEFAULT_DUP_THRESHOLD;
+    }
+    
+    // Default to half of the context that is still free
+    size_t budget = (size_t)max_tokens;
+    if ( budget == 0 ) {
+        llama_pos n_free = (llama_pos)llama_n_ctx(ctx->lctx) - ctx->n_past;
+        budget = n_free > 0 ? (size_t)n_free / 2 : 0;
+    }
+    
+    struct frame_entry {
+        size_t       path_idx;
+        size_t       n_tokens;
+        mtmd::bitmap bmp;
+    };
+    std::vector<frame_entry> kept;
+    
+    size_t n_failed = 0;
+    size_t n_dups = 0;
+    size_t held_tokens = 0;
+    bool holding = true;
+    uint64_t last_hash = 0;
+    
+    for ( size_t ind=0; ind<paths.size(); ind++ ) {
+        
+        mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(ctx->vision(), paths[ind].c_str()));
+        if ( !bmp.ptr || mtmd_bitmap_is_audio(bmp.ptr.get()) ) {
+            LOG_WRN("%s: skipping frame '%s'\n", __func__, paths[ind].c_str());
+            n_failed++;
+            continue;
+        }
+        
+        // Is this frame a near duplicate of the last one we kept?
+        uint64_t hash = lr_dhash_rgb(bmp.data(), bmp.nx(), bmp.ny());
+        if ( !kept.empty() && lr_hash_distance(hash, last_hash) <= dup_threshold ) {
+            n_dups++;
+            continue;
+        }
+        last_hash = hash;
+        
+        size_t n_tokens = ctx->image_tokens(bmp.ptr.get());
+        held_tokens += n_tokens;
+        
+        // Once over budget we must subsample, so stop holding decoded frames
+        if ( holding && held_tokens > budget ) {
+            holding = false;
+            for ( frame_entry &fe : kept ) {
+                fe.bmp.ptr.reset();
+            }
+        }
+        
+        frame_entry fe;
+        fe.path_idx = ind;
+        fe.n_tokens = n_tokens;
+        if ( holding ) {
+            fe.bmp.ptr = std::move(bmp.ptr);
+        }
+        kept.push_back(std::move(fe));
+    }
+    
+    // Pick the frames that fit the budget
+    std::vector<size_t> frame_tokens;
+    for ( const frame_entry &fe : kept ) {
+        frame_tokens.push_back(fe.n_tokens);
+    }
+    std::vector<size_t> selected = lr_select_frames(frame_tokens, budget);
+    
+    if ( selected.empty() ) {
+
+        std::string first = paths.empty() ? "" : paths[0];
+        auto args = std::make_format_args(__func__,first);
+        std::string err=std::vformat(gErrMtmdLoadFrames, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    size_t n_tokens = 0;
+    for ( size_t idx : selected ) {
+        
+        frame_entry &fe = kept[idx];
+        
+        // Do we need to decode this frame again?
+        if ( !fe.bmp.ptr ) {
+            fe.bmp.ptr.reset(mtmd_helper_bitmap_init_from_file(ctx->vision(), paths[fe.path_idx].c_str()));
+            if ( !fe.bmp.ptr ) {
+                
+                auto args = std::make_format_args(__func__,paths[fe.path_idx]);
+                std::string err=std::vformat(gErrMtmdLoadMedia, args);
+                LOG_ERR("%s\n", err.c_str());
+                lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+                
+                return GGML_STATUS_FAILED;
+            }
+        }
+        
+        // The frame is recorded as it was kept, so replay skips the selection
+        record_media(LR_MEDIA_FRAME, fe.bmp.data(), (size_t)fe.bmp.nx() * fe.bmp.ny() * 3, fe.bmp.nx(), fe.bmp.ny(), t_record_us);
+        ctx->bitmaps.entries.push_back(std::move(fe.bmp));
+        ctx->media.push_back(nullptr);
+        t_record_us = ggml_time_us();
+        _context += mtmd_default_marker();
+        n_tokens += fe.n_tokens;
+    }
+    
+    size_t n_in = paths.size();
+    size_t n_subsampled = kept.size() - selected.size();
+    size_t n_loaded = selected.size();
+    auto args = std::make_format_args(n_in, n_dups, n_subsampled, n_failed, n_loaded, n_tokens);
+    std::string msg=std::vformat(gMsgMtmdFrames, args);
+    LOG_INF("%s\n", msg.c_str());
+    lr_mtmd_cli_callback(this, LlamarattiEventStatus,msg.c_str());
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Enables or disables voice activity detection for audio media
+ *
+ * When enabled, silence & background noise are removed from audio
+ * before it is encoded. Long pauses are shortened rather than removed
+ * so that sentence boundaries survive.
+ *
+ * @param enabled whether to trim audio
+ * @param threshold_db how far above the noise floor speech must be, 0 for the default
+ * @param min_silence_ms the shortest pause that gets compressed, 0 for the default
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_audio_vad(bool enabled,
+                               float threshold_db/* = 0.0f*/,
+                               float min_silence_ms/* = 0.0f*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         threshold_db < 0.0f ||
+         min_silence_ms < 0.0f ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    lr_vad_params params;
+    if ( threshold_db > 0.0f ) {
+        params.threshold_db = threshold_db;
+    }
+    if ( min_silence_ms > 0.0f ) {
+        params.min_silence_ms = min_silence_ms;
+    }
+    
+    ctx->use_vad = enabled;
+    ctx->vad = params;
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Limits how many tokens each image may use
+ *
+ * Images that would exceed the budget are downscaled before encoding.
+ * A latency budget is converted to tokens using the prefill speed
+ * measured on earlier messages, so it takes effect after the first
+ * message. When both are set the smaller budget applies.
+ *
+ * @param max_tokens the most tokens per image, 0 for no limit
+ * @param max_latency_ms the longest prefill per image, 0 for no limit
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_image_budget(int max_tokens, float max_latency_ms/* = 0.0f*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         max_tokens < 0 ||
+         max_latency_ms < 0.0f ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    
+    ctx->image_max_tokens = max_tokens;
+    ctx->image_max_latency_ms = max_latency_ms;
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Returns the size & token count of the last image loaded
+ *
+ * The token count is known until the message holding the image has
+ * been evaluated, or at any time when an image budget is set
+ *
+ * @param n_tokens (returned) the number of tokens the image will use
+ * @param nx (returned) the width it will be encoded at
+ * @param ny (returned) the height it will be encoded at
+ *
+ */
+void lr_mtmd_cli::get_image_tokens(int *n_tokens, int *nx/* = NULL*/, int *ny/* = NULL*/) {
+    
+    if ( n_tokens ) {
+        *n_tokens = 0;
+    }
+    if ( nx ) {
+        *nx = 0;
+    }
+    if ( ny ) {
+        *ny = 0;
+    }
+    if ( !_vctx ) {
+        return;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // The projector is kept loaded while we count
+    mtmd_cli_context::activity busy(*ctx);
+    
+    // Is the last image still pending & its token count not yet known?
+    if ( ctx->last_image_tokens == 0 &&
+         !ctx->bitmaps.entries.empty() ) {
+        const mtmd_bitmap *bmp = ctx->bitmaps.entries.back().ptr.get();
+        if ( !mtmd_bitmap_is_audio(bmp) &&
+             mtmd_bitmap_get_nx(bmp) == ctx->last_image_nx &&
+             mtmd_bitmap_get_ny(bmp) == ctx->last_image_ny ) {
+            ctx->last_image_tokens = ctx->image_tokens(bmp);
+        }
+    }
+    
+    if ( n_tokens ) {
+        *n_tokens = (int)ctx->last_image_tokens;
+    }
+    if ( nx ) {
+        *nx = (int)ctx->last_image_nx;
+    }
+    if ( ny ) {
+        *ny = (int)ctx->last_image_ny;
+    }
+}
+
+/**
+ * @brief Returns what voice activity detection saved on the last message
+ *
+ * @param secs_saved (returned) seconds of audio removed
+ * @param tokens_saved (returned) estimated number of audio tokens saved
+ *
+ */
+void lr_mtmd_cli::get_vad_savings(float *secs_saved, int *tokens_saved) {
+    
+    if ( secs_saved ) {
+        *secs_saved = _vad_secs_saved;
+    }
+    if ( tokens_saved ) {
+        *tokens_saved = _vad_tokens_saved;
+    }
+}
+
+/**
+ * @brief Returns the length of the embeddings returned by embed_batch
+ *
+ * @return the number of floats per embedding, 0 on error
+ */
+int lr_mtmd_cli::get_embedding_size() {
+    
+    if ( !_vctx ) {
+        return 0;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    return llama_model_n_embd(ctx->model);
+}
+
+/**
+ * @brief Computes pooled embeddings for media files & texts
+ *
+ * Uses the loaded projector & model through a separate, temporary
+ * context so the chat history is left untouched. Media files are
+ * decoded in parallel, texts are packed several sequences per decode.
+ * Each embedding is the mean of the model's last hidden states.
+ *
+ * The output holds one row of get_embedding_size() floats per item,
+ * media first, then texts, in the order given. Items that can't be
+ * embedded are reported & left as zeros.
+ *
+ * @param media_paths the paths of the media files
+ * @param n_media the number of media files
+ * @param texts the texts
+ * @param n_texts the number of texts
+ * @param embd_out (returned) the embeddings
+ * @param n_floats the capacity of embd_out
+ * @param normalize whether to scale each embedding to unit length
+ *
+ * @return GGML_STATUS_SUCCESS if every item was embedded
+ */
+int lr_mtmd_cli::embed_batch(char *media_paths[],
+                             int n_media,
+                             char *texts[],
+                             int n_texts,
+                             float *embd_out,
+                             size_t n_floats,
+                             bool normalize/* = true*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         _is_generating ||
+         n_media < 0 ||
+         n_texts < 0 ||
+         n_media + n_texts == 0 ||
+         (n_media > 0 && !media_paths) ||
+         (n_texts > 0 && !texts) ||
+         !embd_out ||
+         n_floats < (size_t)(n_media + n_texts) * get_embedding_size() ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Nothing is released while we run
+    mtmd_cli_context::activity busy(*ctx);
+    if ( n_media > 0 && !load_projector() ) {
+        return GGML_STATUS_FAILED;
+    }
+    
+    LR_TRACE_SCOPE("embed_batch", n_media + n_texts);
+    const int64_t t_start_ms = ggml_time_ms();
+    const size_t n_embd = llama_model_n_embd(ctx->model);
+    
+    // Can we create a pooled embedding context?
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = LR_EMBD_MAX_TOKENS;
+    cparams.n_batch         = LR_EMBD_MAX_TOKENS;
+    cparams.n_ubatch        = LR_EMBD_MAX_TOKENS;
+    cparams.n_seq_max       = LR_EMBD_MAX_SEQS;
+    cparams.kv_unified      = true;
+    cparams.embeddings      = true;
+    cparams.pooling_type    = LLAMA_POOLING_TYPE_MEAN;
+    cparams.n_threads       = ctx->n_threads;
+    cparams.n_threads_batch = ctx->n_threads;
+    std::unique_ptr<llama_context, decltype(&llama_free)> ectx(llama_init_from_model(ctx->model, cparams), llama_free);
+    if ( !ectx ) {
+        
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdEmbedContext, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    llama_memory_t mem = llama_get_memory(ectx.get());
+    
+    int n_failed = 0;
+    
+    // Writes a row, or zeros & reports the item if there is no embedding
+    auto store_row = [&](size_t row, const float *embd, const char *item) {
+        
+        float *dst = embd_out + row * n_embd;
+        if ( !embd ) {
+            memset(dst, 0, n_embd * sizeof(float));
+            
+            std::string name = item ? item : "";
+            auto args = std::make_format_args(__func__,name);
+            std::string err=std::vformat(gErrMtmdEmbed, args);
+            LOG_ERR("%s\n", err.c_str());
+            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+            n_failed++;
+            return;
+        }
+        
+        double norm = 0.0;
+        for ( size_t k=0; k<n_embd; k++ ) {
+            norm += (double)embd[k] * embd[k];
+        }
+        float scale = (normalize && norm > 0.0) ? (float)(1.0 / sqrt(norm)) : 1.0f;
+        for ( size_t k=0; k<n_embd; k++ ) {
+            dst[k] = embd[k] * scale;
+        }
+    };
+    
+    // Media are decoded a group at a time in parallel, then embedded one by one
+    const int n_group = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<mtmd::bitmap> decoded;
+    std::vector<float> pooled;
+    for ( int first=0; first<n_media; first+=n_group ) {
+        
+        int n = std::min(n_group, n_media - first);
+        ctx->decode_files(media_paths + first, n, decoded);
+        
+        for ( int ind=0; ind<n; ind++ ) {
+            LR_TRACE_SCOPE("embed_media", first + ind);
+            bool bEmbedded = decoded[ind].ptr &&
+                             ctx->embed_media(ectx.get(), decoded[ind].ptr.get(), pooled);
+            store_row(first + ind, bEmbedded ? pooled.data() : NULL, media_paths[first + ind]);
+            llama_memory_clear(mem, true);
+        }
+    }
+    
+    // Texts are packed into batches of up to LR_EMBD_MAX_SEQS sequences
+    llama_batch batch = llama_batch_init(LR_EMBD_MAX_TOKENS, 0, 1);
+    std::vector<int> rows;
+    llama_tokens tokens;
+    int ind = 0;
+    while ( ind < n_texts || !tokens.empty() ) {
+        
+        // Fill the batch, a text that doesn't fit waits for the next one
+        common_batch_clear(batch);
+        rows.clear();
+        while ( (int)rows.size() < LR_EMBD_MAX_SEQS ) {
+            
+            if ( tokens.empty() ) {
+                if ( ind >= n_texts ) {
+                    break;
+                }
+                if ( is_valid_string(texts[ind]) ) {
+                    tokens = common_tokenize(ctx->vocab, texts[ind], true, true);
+                }
+                if ( tokens.empty() ) {
+                    store_row(n_media + ind, NULL, texts[ind]);
+                    ind++;
+                    continue;
+                }
+                if ( tokens.size() > LR_EMBD_MAX_TOKENS ) {
+                    LOG_WRN("%s: text %d truncated to %d tokens\n", __func__, ind, LR_EMBD_MAX_TOKENS);
+                    tokens.resize(LR_EMBD_MAX_TOKENS);
+                }
+                ind++;
+            }
+            if ( batch.n_tokens + tokens.size() > LR_EMBD_MAX_TOKENS ) {
+                break;
+            }
+            
+            llama_seq_id seq_id = (llama_seq_id)rows.size();
+            for ( size_t pos=0; pos<tokens.size(); pos++ ) {
+                common_batch_add(batch, tokens[pos], (llama_pos)pos, { seq_id }, true);
+            }
+            rows.push_back(ind - 1);
+            tokens.clear();
+        }
+        if ( rows.empty() ) {
+            continue;
+        }
+        
+        LR_TRACE_SCOPE("embed_texts", batch.n_tokens);
+        bool bDecoded = (llama_decode(ectx.get(), batch) == 0);
+        for ( size_t seq=0; seq<rows.size(); seq++ ) {
+            const float *embd = bDecoded ? llama_get_embeddings_seq(ectx.get(), (llama_seq_id)seq) : NULL;
+            store_row(n_media + rows[seq], embd, texts[rows[seq]]);
+        }
+        llama_memory_clear(mem, true);
+    }
+    llama_batch_free(batch);
+    
+    LOG_INF("%s: embedded %d media & %d texts in %lld ms, %d failed\n",
+            __func__, n_media, n_texts, (long long)(ggml_time_ms() - t_start_ms), n_failed);
+    
+    return n_failed ? GGML_STATUS_FAILED : GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Computes pooled embeddings for media files & texts into a file
+ *
+ * The file is memory mapped & receives the rows of floats directly, in
+ * the layout described for embed_batch, so large corpora need no extra
+ * copy in memory
+ *
+ * @param media_paths the paths of the media files
+ * @param n_media the number of media files
+ * @param texts the texts
+ * @param n_texts the number of texts
+ * @param embd_path the file to create
+ * @param normalize whether to scale each embedding to unit length
+ *
+ * @return GGML_STATUS_SUCCESS if every item was embedded
+ */
+int lr_mtmd_cli::embed_batch_to_file(char *media_paths[],
+                                     int n_media,
+                                     char *texts[],
+                                     int n_texts,
+                                     char *embd_path,
+                                     bool normalize/* = true*/) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         !is_valid_string(embd_path) ||
+         n_media < 0 ||
+         n_texts < 0 ||
+         n_media + n_texts == 0 ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    size_t n_floats = (size_t)(n_media + n_texts) * get_embedding_size();
+    size_t n_bytes = n_floats * sizeof(float);
+    
+    // Can we create & map the file?
+    void *map = MAP_FAILED;
+    int fd = open(embd_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ( fd >= 0 && ftruncate(fd, (off_t)n_bytes) == 0 ) {
+        map = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if ( map == MAP_FAILED ) {
+        
+        if ( fd >= 0 ) {
+            close(fd);
+        }
+        auto args = std::make_format_args(__func__,embd_path);
+        std::string err=std::vformat(gErrMtmdEmbedFile, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    int ret = embed_batch(media_paths, n_media, texts, n_texts, (float *)map, n_floats, normalize);
+    
+    munmap(map, n_bytes);
+    close(fd);
+    
+    return ret;
+}
+
+/**
+ * @brief Sets the strings that end generation when they appear in the response
+ *
+ * Stop strings are matched on the generated text, including where they
+ * span several tokens, & are not passed to the callback. They replace
+ * any set with -r/--reverse-prompt.
+ *
+ * @param stop_strings the stop strings
+ * @param n_stop the number of stop strings, 0 to clear them
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_stop_strings(char *stop_strings[], int n_stop) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         n_stop < 0 ||
+         (n_stop > 0 && !stop_strings) ||
+         _is_generating ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    std::vector<std::string> patterns;
+    for ( int ind=0; ind<n_stop; ind++ ) {
+        if ( is_valid_string(stop_strings[ind]) ) {
+            patterns.push_back(stop_strings[ind]);
+        }
+    }
+    ctx->stop.set_patterns(patterns);
+    
+    return GGML_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Unloads the projector after a period without requests
+ *
+ * The projector is loaded again by the next call that needs it, so a
+ * text only conversation holds only the language model in memory.
+ *
+ * @param idle_secs the seconds without requests before unloading, 0 to never unload
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_projector_idle_unload(float idle_secs) {
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         idle_secs < 0.0f ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
     
-    LOG_INF("Successfully initialized\n");
+    {
+        std::lock_guard<std::mutex> lock(ctx->idle_mutex);
+        ctx->projector_idle_secs = idle_secs;
+    }
+    ctx->update_idle_thread();
     
     return GGML_STATUS_SUCCESS;
 }
 
 /**
- * @brief Uninitializes this adapter
+ * @brief Releases memory after a period without requests
+ *
+ * Once idle for long enough the projector is unloaded & the context's
+ * KV cache & compute buffers are freed, keeping only the cells used by
+ * the conversation. The next call rebuilds the context & restores the
+ * conversation before it continues, so only the model weights stay
+ * resident while idle.
+ *
+ * @param idle_secs the seconds without requests before releasing, 0 to never release
  *
  * @return The status of the operation
  */
-int lr_mtmd_cli::deinit() {
+int lr_mtmd_cli::set_idle_release(float idle_secs) {
     
-    if ( _vctx ) {
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         idle_secs < 0.0f ) {
+
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
         
-        // Cast to required mtmd_cli_context
-        mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
-        delete ctx;
-        _vctx=ctx=NULL;
-        LOG_INF("Successfully uninitialized\n");
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    {
+        std::lock_guard<std::mutex> lock(ctx->idle_mutex);
+        ctx->context_idle_secs = idle_secs;
     }
+    ctx->update_idle_thread();
+    
     return GGML_STATUS_SUCCESS;
 }
 
-
 /**
- * @brief Evaluates a chat message
+ * @brief Keeps the responses of deterministic requests to replay them
  *
- * @param vmsg pointer to a mtmd_cli_context structure
- * @param add_bos add
+ * Only evaluate_and_respond_once() uses the cache, the conversation
+ * isn't touched. A request is answered from the cache when it samples
+ * with a temperature of 0 or a fixed seed & matches an earlier one in
+ * everything the response depends on: the model files & how they were
+ * loaded, the adapters, the sampler settings, the stop strings, the
+ * contents of its media & the formatted prompt. The cached text is passed
+ * to the callback without evaluating anything.
+ *
+ * @param max_entries the most responses kept, in memory & in the directory alike, 0 disables the cache
+ * @param max_bytes the most bytes kept, likewise, 0 for no limit
+ * @param cache_dir (optional) a directory that also keeps responses, so they outlive the process
  *
  * @return The status of the operation
  */
-int lr_mtmd_cli::eval_message(void *vmsg, bool add_bos/* = false*/) {
+int lr_mtmd_cli::set_response_cache(int max_entries, size_t max_bytes/* = 0*/, char *cache_dir/* = NULL*/) {
     
     // Did we get the parameters we need?
-    if ( !_vctx || !vmsg ) {
-        
+    if ( !_vctx ||
+         max_entries < 0 ) {
+
         auto args = std::make_format_args(__func__);
         std::string err=std::vformat(gErrMtmdParams, args);
         LOG_ERR("%s\n", err.c_str());
@@ -323,88 +4904,129 @@ int lr_mtmd_cli::eval_message(void *vmsg, bool add_bos/* = false*/) {
         
         return GGML_STATUS_FAILED;
     }
-    
     // Cast to required mtmd_cli_context
     mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
     
-    // Cast to required common_chat_msg
-    common_chat_msg *msg=(common_chat_msg *)vmsg;
-    
-    common_chat_templates_inputs tmpl_inputs;
-    tmpl_inputs.messages = {*msg};
-    tmpl_inputs.add_generation_prompt = true;
-    tmpl_inputs.use_jinja = false; // jinja is buggy here
-    auto formatted_chat = common_chat_templates_apply(ctx->tmpls.get(), tmpl_inputs);
-    LOG_DBG("formatted_chat.prompt: %s\n", formatted_chat.prompt.c_str());
-
-    mtmd_input_text text;
-    text.text          = formatted_chat.prompt.c_str();
-    text.add_special   = add_bos;
-    text.parse_special = true;
-
-    if (_is_interrupted) {
-        lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
-        return 0;
-    }
-    
-    mtmd::input_chunks chunks(mtmd_input_chunks_init());
-    auto bitmaps_c_ptr = ctx->bitmaps.c_ptr();
-    int32_t res = mtmd_tokenize(ctx->ctx_vision.get(),
-                                chunks.ptr.get(), // output
-                                &text, // text
-                                bitmaps_c_ptr.data(),
-                                bitmaps_c_ptr.size());
-    if (res) {
+    // Can we use the directory?
+    const char *dir_path = is_valid_string(cache_dir) ? cache_dir : NULL;
+    if ( !ctx->response_cache.configure((size_t)max_entries, max_bytes, dir_path) ) {
         
-        auto args = std::make_format_args(__func__, res);
-        std::string err=std::vformat(gErrMtmdTokenize, args);
+        auto args = std::make_format_args(__func__, cache_dir);
+        std::string err=std::vformat(gErrMtmdResponseCache, args);
         LOG_ERR("%s\n", err.c_str());
         lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    return GGML_STATUS_SUCCESS;
+}
 
-        return res;
+/**
+ * @brief Returns how many requests the response cache answered
+ *
+ * @param n_hits (returned) the requests answered from the cache
+ * @param n_misses (returned) the requests looked up but not found
+ *
+ */
+void lr_mtmd_cli::get_response_cache_stats(int *n_hits, int *n_misses) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    if ( ctx ) {
+        ctx->response_cache.get_stats(&hits, &misses, NULL, NULL);
     }
+    if ( n_hits ) {
+        *n_hits = (int)hits;
+    }
+    if ( n_misses ) {
+        *n_misses = (int)misses;
+    }
+}
 
-    ctx->bitmaps.entries.clear();
+/**
+ * @brief Throttles generation while the system runs hot
+ *
+ * The thermal zones under thermal_path are polled in the background &
+ * temperatures passed to report_temperature() count too. From warm_c up
+ * to hot_c the decode threads & the batch size are lowered step by step
+ * & a pause is added after each decode, they are restored once the system
+ * has cooled a little below where each step was taken.
+ *
+ * @param enabled whether to throttle
+ * @param thermal_path (optional) the sysfs thermal directory, /sys/class/thermal by default
+ * @param warm_c the temperature in Celsius where throttling starts, 0 for the default
+ * @param hot_c the temperature in Celsius where throttling is at its most, 0 for the default
+ *
+ * @return The status of the operation
+ */
+int lr_mtmd_cli::set_thermal_governor(bool enabled,
+                                      char *thermal_path/* = NULL*/,
+                                      float warm_c/* = 0.0f*/,
+                                      float hot_c/* = 0.0f*/) {
+    
+    lr_thermal_params params;
+    if ( warm_c > 0.0f ) {
+        params.warm_c = warm_c;
+    }
+    if ( hot_c > 0.0f ) {
+        params.hot_c = hot_c;
+    }
+    
+    // Did we get the parameters we need?
+    if ( !_vctx ||
+         warm_c < 0.0f ||
+         hot_c < 0.0f ||
+         params.hot_c <= params.warm_c ) {
 
-    llama_pos new_n_past;
-    res = mtmd_helper_eval_chunks(ctx->ctx_vision.get(),
-                                  ctx->lctx, // lctx
-                                  chunks.ptr.get(), // chunks
-                                  ctx->n_past, // n_past
-                                  0, // seq_id
-                                  ctx->n_batch, // n_batch
-                                  true, // logits_last
-                                  &new_n_past);
-    if (res) {
-        
-        auto args = std::make_format_args(__func__, res);
-        std::string err=std::vformat(gErrMtmdEvalPrompt, args);
+        auto args = std::make_format_args(__func__);
+        std::string err=std::vformat(gErrMtmdParams, args);
         LOG_ERR("%s\n", err.c_str());
         lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
         
-        return res;
+        return GGML_STATUS_FAILED;
+    }
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    // Full speed resumes with the next decode
+    if ( !enabled ) {
+        ctx->thermal.stop();
+        return GGML_STATUS_SUCCESS;
     }
-
-    ctx->n_past = new_n_past;
-
-    lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
+    
+    // Are there sensors to read? Otherwise only reported temperatures count
+    const char *path = is_valid_string(thermal_path) ? thermal_path : LR_THERMAL_PATH;
+    float temp_c;
+    if ( lr_read_thermal_zones(path, &temp_c) ) {
+        LOG_INF("%s: reading thermal zones under '%s', now %.1f C\n", __func__, path, temp_c);
+    } else {
+        LOG_INF("%s: no thermal zones under '%s', using reported temperatures\n", __func__, path);
+    }
+    ctx->thermal.start(path, params);
     
     return GGML_STATUS_SUCCESS;
 }
 
 /**
- * @brief Generates a series of responses
+ * @brief Passes a temperature measured by the host to the thermal governor
  *
- * @param n_predict number of tokens
+ * For platforms without sysfs thermal zones, each reading counts for a
+ * few seconds
+ *
+ * @param temp_c the temperature in Celsius
  *
  * @return The status of the operation
  */
-int lr_mtmd_cli::gen_response(int n_predict) {
+int lr_mtmd_cli::report_temperature(float temp_c) {
     
     // Did we get the parameters we need?
     if ( !_vctx ||
-         n_predict == 0 ) {
-        
+         isnan(temp_c) ) {
+
         auto args = std::make_format_args(__func__);
         std::string err=std::vformat(gErrMtmdParams, args);
         LOG_ERR("%s\n", err.c_str());
@@ -412,146 +5034,138 @@ int lr_mtmd_cli::gen_response(int n_predict) {
         
         return GGML_STATUS_FAILED;
     }
-    
     // Cast to required mtmd_cli_context
     mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    ctx->thermal.report(temp_c);
+    
+    return GGML_STATUS_SUCCESS;
+}
 
-    llama_tokens generated_tokens;
-    for (int i = 0; i < n_predict; i++) {
-        if (i > _n_predict || !_is_generating || _is_interrupted) {
-            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
-            break;
-        }
-
-        llama_token token_id = common_sampler_sample(ctx->smpl, ctx->lctx, -1);
-        generated_tokens.push_back(token_id);
-        common_sampler_accept(ctx->smpl, token_id, true);
-
-        if (llama_vocab_is_eog(ctx->vocab, token_id) || ctx->check_antiprompt(generated_tokens)) {
-            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
-            break; // end of generation
-        }
-        
-        // Have we been asked to stop?
-        std::string piece=common_token_to_piece(ctx->lctx, token_id);
-        if ( lr_mtmd_cli_callback(this, LlamarattiEventResponse,(char *)piece.c_str()) ) {
-            break;
-        }
-
-        if (_is_interrupted) {
-            lr_mtmd_cli_callback(this, LlamarattiEventResponse,"\n");
-            break;
-        }
-
-        // Can we evaluate the token?
-        common_batch_clear(ctx->batch);
-        common_batch_add(ctx->batch, token_id, ctx->n_past++, {0}, true);
-        if (llama_decode(ctx->lctx, ctx->batch)) {
-            
-            auto args = std::make_format_args(__func__);
-            std::string err=std::vformat(gErrMtmdDecodeToken, args);
-            LOG_ERR("%s\n", err.c_str());
-            lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
-
-            return GGML_STATUS_ABORTED;
-        }
+/**
+ * @brief Returns what the thermal governor is doing
+ *
+ * @param temp_c (returned) the temperature it goes by in Celsius, NAN if none
+ * @param level (returned) how hard it throttles, 0 to LR_THERMAL_LEVELS
+ *
+ */
+void lr_mtmd_cli::get_thermal_state(float *temp_c, int *level) {
+    
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
+    
+    if ( temp_c ) {
+        *temp_c = ctx ? ctx->thermal.temperature() : NAN;
+    }
+    if ( level ) {
+        *level = ctx ? ctx->thermal.level() : 0;
     }
-    return GGML_STATUS_SUCCESS;
 }
 
 /**
- * @brief Evaluates & responds to a prompt
+ * @brief Starts or stops recording the session for replay
  *
- * Evaluates a prompt and responds via the custom callback
- * Call this from a background thread
+ * A recording starts from an empty conversation with the sampler reseeded
+ * from its current seed, so replaying it from init reproduces the session.
+ * The media, prompts, generated tokens & timings of each request are
+ * recorded, along with the call, sampler settings, seed & adapter scales
+ * each request was answered with. The session's sampler settings &
+ * adapters are recorded as they are at the start & whenever they change.
+ *
+ * @param record_path the file to record to, NULL to stop recording
  *
  * @return The status of the operation
  */
-int lr_mtmd_cli::evaluate_and_respond(char *prompt) {
+int lr_mtmd_cli::set_recording(char *record_path) {
     
     // Did we get the parameters we need?
     if ( !_vctx ||
-         !is_valid_string(prompt) ) {
-        
+         _is_generating ) {
+
         auto args = std::make_format_args(__func__);
         std::string err=std::vformat(gErrMtmdParams, args);
         LOG_ERR("%s\n", err.c_str());
         lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
-
+        
         return GGML_STATUS_FAILED;
     }
-
-    _context += prompt;
-    
-    _is_interrupted = false;
-    _is_generating = true;
-    
-    common_chat_msg msg;
-    msg.role = "user";
-    msg.content = _context;
+    // Cast to required mtmd_cli_context
+    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
     
-    // Can we evaluate this message?
-    int ret = eval_message(&msg, _is_first_msg);
-    if (ret) {
-        _is_generating = false;
-        return ret;
+    ctx->recorder.close();
+    if ( !is_valid_string(record_path) ) {
+        return GGML_STATUS_SUCCESS;
     }
     
-    // Can we generate a response?
-    ret = gen_response(_n_predict);
-    _is_generating = false;
-    if (ret) {
+    // Start from an empty conversation
+    int ret = clear_history();
+    if ( ret ) {
         return ret;
     }
-
-    // Reset parameters
+    ctx->clear_media();
     _context.clear();
-    _is_first_msg = false;
+    _is_first_msg = true;
+    
+    // Reseed the sampler, so replay sees the same random numbers
+    ctx->sampling.seed = common_sampler_get_seed(ctx->smpl);
+    common_sampler_free(ctx->smpl);
+    ctx->smpl = common_sampler_init(ctx->model, ctx->sampling);
+    ctx->record_media_ms = 0.0;
+    
+    // Can we start the recording?
+    if ( !ctx->recorder.open(record_path) ||
+         !ctx->recorder.write_init(ctx->init_args, ctx->sampling.seed) ) {
+        
+        ctx->recorder.close();
+        auto args = std::make_format_args(__func__, record_path);
+        std::string err=std::vformat(gErrMtmdRecordOpen, args);
+        LOG_ERR("%s\n", err.c_str());
+        lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
+        
+        return GGML_STATUS_FAILED;
+    }
+    
+    // Settings changed since init, adapters loaded since are loaded again on replay
+    lr_sampling current;
+    get_sampling(&current);
+    ctx->recorder.write_sampling(current);
+    const size_t n_init_adapters = ctx->lora_adapters.size() - ctx->lora_loaded.size();
+    for ( size_t i=0; i<ctx->lora_adapters.size(); i++ ) {
+        if ( i >= n_init_adapters ) {
+            ctx->recorder.write_adapter((int32_t)i, 0.0f, ctx->lora_adapters[i].path);
+        }
+        ctx->recorder.write_adapter((int32_t)i, ctx->lora_adapters[i].scale);
+    }
     
     return GGML_STATUS_SUCCESS;
 }
 
 /**
- * @brief Returns whether the model text generation is in progress
+ * @brief Starts or stops recording a trace of the inference pipeline
  *
- * @return Whether the model text generation is in progress
- */
-bool lr_mtmd_cli::is_generating() {
-    
-    return _is_generating;
-}
-
-/**
- * @brief Returns whether the model text generation was interrupted
+ * Starting discards any previously recorded spans
  *
- * @return Whether the model text generation is interrupted
- */
-bool lr_mtmd_cli::is_interrupted() {
-    
-    return _is_interrupted;
-}
-
-/**
- * @brief Signal to stop text generation
+ * @param enabled whether to record
  *
  */
-void lr_mtmd_cli::stop_generating() {
+void lr_mtmd_cli::set_tracing(bool enabled) {
     
-    _is_interrupted=true;
+    lr_trace_enable(enabled);
 }
 
 /**
- * @brief Loads the specified audio or video media into the current context
+ * @brief Writes the recorded trace as Chrome trace event JSON
  *
- * @param media_path the path to the media file to load
+ * The file can be opened in Perfetto or chrome://tracing
+ *
+ * @param trace_path the file to write
  *
  * @return The status of the operation
  */
-int lr_mtmd_cli::load_media(char *media_path) {
+int lr_mtmd_cli::dump_trace(char *trace_path) {
     
     // Did we get the parameters we need?
-    if ( !_vctx ||
-         !is_valid_string(media_path) ) {
+    if ( !is_valid_string(trace_path) ) {
 
         auto args = std::make_format_args(__func__);
         std::string err=std::vformat(gErrMtmdParams, args);
@@ -560,22 +5174,18 @@ int lr_mtmd_cli::load_media(char *media_path) {
         
         return GGML_STATUS_FAILED;
     }
-    // Cast to required mtmd_cli_context
-    mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
-
-    // Can we load the media?
-    if ( !ctx->load_media(media_path) ) {
-
-        auto args = std::make_format_args(__func__,media_path);
-        std::string err=std::vformat(gErrMtmdLoadMedia, args);
+    
+    // Can we write the trace?
+    if ( !lr_trace_dump(trace_path) ) {
+        
+        auto args = std::make_format_args(__func__,trace_path);
+        std::string err=std::vformat(gErrMtmdTraceDump, args);
         LOG_ERR("%s\n", err.c_str());
         lr_mtmd_cli_callback(this, LlamarattiEventStatus,err.c_str());
         
         return GGML_STATUS_FAILED;
     }
     
-    _context += mtmd_default_marker();
-
     return GGML_STATUS_SUCCESS;
 }
 
@@ -599,9 +5209,23 @@ int lr_mtmd_cli::clear_history() {
     // Cast to required mtmd_cli_context
     mtmd_cli_context *ctx=(mtmd_cli_context *)_vctx;
     
+    // Keep the idle thread from releasing the context meanwhile
+    std::lock_guard<std::mutex> lock(ctx->idle_mutex);
+    
     ctx->n_past=0;
+    ctx->turns.clear();
+    _is_first_msg = true;
     //llama_kv_self_seq_rm(ctx->lctx, 0, 1, -1); // keep BOS
     
+    // Was the context released while idle? Then the conversation's cells are
+    // dropped when it is rebuilt, those of the sessions are kept
+    if ( ctx->context_released ) {
+        if ( ctx->sessions.empty() ) {
+            ctx->kv_saved.clear();
+        }
+        return GGML_STATUS_SUCCESS;
+    }
+    
     // Can we get the memory object from the context?
     llama_memory_t mem = llama_get_memory(ctx->lctx);
     if ( !mem ) {
@@ -613,8 +5237,8 @@ int lr_mtmd_cli::clear_history() {
         return GGML_STATUS_FAILED;
     }
     
-    // Can we remove the token sequence?
-    bool bSuccess = llama_memory_seq_rm(mem, 0, 1, -1);
+    // Can we remove the token sequence? The next message starts with its own BOS
+    bool bSuccess = llama_memory_seq_rm(mem, 0, -1, -1);
     if ( !bSuccess ) {
         auto args = std::make_format_args(__func__);
         std::string err=std::vformat(gErrMtmdRemoveTokSeq, args);
@@ -624,7 +5248,7 @@ int lr_mtmd_cli::clear_history() {
         return GGML_STATUS_FAILED;
     }
     
-    ctx->bitmaps.entries.clear();
+    ctx->clear_media();
     
     LOG_DBG("Successfully cleared history");
     
@@ -658,6 +5282,12 @@ bool default_lr_mtmd_cli_callback(void *vmtmd,
         case LlamarattiEventResponse:
             LOG("%d: %s\n", (int)event, piece);
             fflush(stdout);
+            break;
+            
+        // Prefill progress
+        case LlamarattiEventProgress:
+            LOG_INF("%s\n", piece);
+            break;
             
         default:
             break;
@@ -16,9 +16,39 @@
 #define LR_MTMD_CLI_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
 #include "lr-mtmd-cli-callback.h"
 
+// see lr-mtmd-cli-cache.h
+struct lr_cached_response;
+
+// Seed that asks for a random seed
+#define LR_SEED_RANDOM  0xFFFFFFFF
+
+/**
+ * @struct lr_sampling
+ *
+ * @brief Sampler settings that can be changed without reloading the model
+ *
+ * Get the current settings with get_sampling(), change what is needed &
+ * pass them back to set_sampling() or to a single request
+ *
+ */
+struct lr_sampling {
+    float    temp            = 0.8f;
+    int      top_k           = 40;      // <= 0 to disable
+    float    top_p           = 0.95f;   // 1.0 to disable
+    float    min_p           = 0.05f;   // 0.0 to disable
+    float    penalty_repeat  = 1.0f;    // 1.0 to disable
+    float    penalty_freq    = 0.0f;    // 0.0 to disable
+    float    penalty_present = 0.0f;    // 0.0 to disable
+    int      penalty_last_n  = 64;      // tokens penalized, -1 for the context size
+    uint32_t seed            = LR_SEED_RANDOM;
+    int      n_predict       = -1;      // most tokens per response, -1 for no limit
+};
+
 /**
 * @class lr_mtmd_cli
 *
@@ -36,9 +66,41 @@ class lr_mtmd_cli {
     int  _n_predict;
     std::string _context;
     
+    float _vad_secs_saved;
+    int   _vad_tokens_saved;
+    
     int eval_message(void *vmsg, bool add_bos = false);
     
+    int eval_segmented(const std::string &prompt, bool add_bos);
+    
+    void report_vad_savings(size_t n_audio_tokens);
+    
+    bool prefill_progress(size_t n_chunks_done,
+                          size_t n_chunks,
+                          size_t n_tokens_done,
+                          size_t n_tokens,
+                          int64_t t_start_us);
+    
+    int load_frames(const std::vector<std::string> &paths, int max_tokens, int dup_threshold);
+    
+    bool load_projector();
+    
+    bool load_context();
+    
+    void record_media(int kind,
+                      const void *data,
+                      size_t len,
+                      unsigned int a,
+                      unsigned int b,
+                      int64_t t_start_us);
+    
+    void record_media_file(int kind, const char *media_path, unsigned int a, int64_t t_start_us);
+    
+    void record_response(double prefill_ms, int n_prompt_tokens, double generate_ms);
+    
     int gen_response(int n_predict);
+    
+    int replay_response(const lr_cached_response &response);
 
 public:
     
@@ -54,10 +116,116 @@ public:
     
     int deinit();
     
-    int evaluate_and_respond(char *prompt);
+    int evaluate_and_respond(char *prompt,
+                             const lr_sampling *sampling = NULL,
+                             const float *adapter_scales = NULL,
+                             int n_adapter_scales = 0);
+    
+    int evaluate_and_respond_once(char *prompt,
+                                  const lr_sampling *sampling = NULL,
+                                  const float *adapter_scales = NULL,
+                                  int n_adapter_scales = 0);
+    
+    int evaluate_and_respond_n(char *prompt,
+                               int n_responses,
+                               std::vector<std::string> &responses,
+                               const lr_sampling *sampling = NULL);
+    
+    int get_sampling(lr_sampling *sampling);
+    
+    int set_sampling(const lr_sampling &sampling);
+    
+    int set_context_size(int n_ctx, bool keep_history = true);
+    
+    int load_adapter(char *adapter_path, float scale = 0.0f, int *adapter_id = NULL);
+    
+    int set_adapter_scale(int adapter_id, float scale);
+    
+    int get_adapter_count();
+    
+    int fork_session(int *session_id, int turn = -1, bool keep_message = false);
+    
+    int switch_session(int session_id);
+    
+    int delete_session(int session_id);
+    
+    int get_session_id();
+    
+    int get_turn_count();
+    
+    int rollback_turns(int n_turns);
+    
+    int respond(const lr_sampling *sampling = NULL);
+    
+    int set_pipeline(bool enabled, int encoder_threads = 0);
+    
+    int queue_request(char *prompt, int *request_id = NULL);
+    
+    int respond_next_request(int *request_id = NULL);
     
     int load_media(char *media_path);
     
+    int load_media_batch(char *media_paths[], int n_media, int *results = NULL);
+    
+    int load_media_from_buffer(const unsigned char *buf, size_t len);
+    
+    int load_media_from_rgb(const unsigned char *rgb, unsigned int nx, unsigned int ny, bool fit_budget = true);
+    
+    int load_media_from_pcm(const float *pcm, size_t n_samples);
+    
+    int load_audio_stream(char *media_path, float window_secs = 0.0f);
+    
+    int load_image_sequence(char *frame_paths[], int n_frames, int max_tokens = 0, int dup_threshold = -1);
+    
+    int load_image_directory(char *dir_path, int max_tokens = 0, int dup_threshold = -1);
+    
+    int set_audio_vad(bool enabled, float threshold_db = 0.0f, float min_silence_ms = 0.0f);
+    
+    void get_vad_savings(float *secs_saved, int *tokens_saved);
+    
+    int set_image_budget(int max_tokens, float max_latency_ms = 0.0f);
+    
+    void get_image_tokens(int *n_tokens, int *nx = NULL, int *ny = NULL);
+    
+    int set_stop_strings(char *stop_strings[], int n_stop);
+    
+    int get_embedding_size();
+    
+    int embed_batch(char *media_paths[],
+                    int n_media,
+                    char *texts[],
+                    int n_texts,
+                    float *embd_out,
+                    size_t n_floats,
+                    bool normalize = true);
+    
+    int embed_batch_to_file(char *media_paths[],
+                            int n_media,
+                            char *texts[],
+                            int n_texts,
+                            char *embd_path,
+                            bool normalize = true);
+    
+    int set_projector_idle_unload(float idle_secs);
+    
+    int set_idle_release(float idle_secs);
+    
+    int set_response_cache(int max_entries, size_t max_bytes = 0, char *cache_dir = NULL);
+    
+    void get_response_cache_stats(int *n_hits, int *n_misses);
+    
+    int set_thermal_governor(bool enabled, char *thermal_path = NULL, float warm_c = 0.0f, float hot_c = 0.0f);
+    
+    int report_temperature(float temp_c);
+    
+    void get_thermal_state(float *temp_c, int *level);
+    
+    int set_recording(char *record_path);
+    
+    void set_tracing(bool enabled);
+    
+    int dump_trace(char *trace_path);
+    
     bool is_generating();
     
     bool is_interrupted();